@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include "workflow/WFHttpServer.h"
+#include "workflow/WFFacilities.h"
+#include "workflow/Workflow.h"
+#include "llm_client.h"
+
+using namespace wfai;
+
+// count every allocation in this process
+static std::atomic<size_t> alloc_count(0);
+
+void *operator new(size_t size)
+{
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+static const char *response_json =
+	"{\"id\":\"bench\",\"object\":\"chat.completion\",\"created\":0,"
+	"\"model\":\"bench\",\"choices\":[{\"index\":0,\"message\":"
+	"{\"role\":\"assistant\",\"content\":\"ok\"},\"finish_reason\":\"stop\"}],"
+	"\"usage\":{\"prompt_tokens\":1,\"completion_tokens\":1,\"total_tokens\":2}}";
+
+static void process(WFHttpTask *task)
+{
+	auto *resp = task->get_resp();
+	resp->add_header_pair("Content-Type", "application/json");
+	resp->append_output_body_nocopy(response_json, strlen(response_json));
+}
+
+static void run(LLMClient& client, ChatCompletionRequest& request, int n)
+{
+	WFFacilities::WaitGroup wait_group(1);
+	std::atomic<int> success(0);
+
+	ParallelWork *pwork = Workflow::create_parallel_work(
+		[&wait_group](const ParallelWork *) { wait_group.done(); });
+
+	size_t before = alloc_count.load();
+	auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < n; i++)
+	{
+		auto *task = client.create_chat_task(request, nullptr,
+			[&success](WFHttpChunkedTask *task, ChatCompletionRequest *req,
+					   ChatCompletionResponse *resp)
+			{
+				if (task->get_state() == WFT_STATE_SUCCESS &&
+					resp->state == RESPONSE_SUCCESS)
+				{
+					success++;
+				}
+			});
+
+		pwork->add_series(Workflow::create_series_work(task, nullptr));
+	}
+
+	size_t created = alloc_count.load();
+	pwork->start();
+	wait_group.wait();
+
+	auto end = std::chrono::steady_clock::now();
+	size_t after = alloc_count.load();
+	double ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+	fprintf(stderr, "  success %d/%d, %.1f ms\n", success.load(), n, ms);
+	fprintf(stderr, "  allocations : create %.2f / request, total %.2f / request\n",
+			(double)(created - before) / n, (double)(after - before) / n);
+}
+
+int main(int argc, char *argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 10000;
+	unsigned short port = 18080;
+
+	WFHttpServer server(process);
+	if (server.start(port) != 0)
+	{
+		perror("server start");
+		return 1;
+	}
+
+	std::string url = "http://127.0.0.1:" + std::to_string(port) +
+					  "/v1/chat/completions";
+	LLMClient client("bench-key", url);
+
+	ChatCompletionRequest request;
+	request.model = "bench";
+	request.messages.push_back({"system", "You are a helpful assistant."});
+	request.messages.push_back({"user", "hi"});
+
+	// warm up connections and lazily created globals
+	run(client, request, 100);
+
+	fprintf(stderr, "new/delete, %d concurrent requests\n", n);
+	client.set_arena_size(0);
+	run(client, request, n);
+
+	fprintf(stderr, "arena, %d concurrent requests\n", n);
+	client.set_arena_size(4096);
+	run(client, request, n);
+
+	server.stop();
+	return 0;
+}
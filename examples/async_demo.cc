@@ -5,6 +5,7 @@
 #include <string>
 #include <iostream>
 #include "llm_client.h"
+#include "llm_result_set.h"
 
 using namespace wfai;
 
@@ -66,5 +67,43 @@ int main(int argc, char *argv[])
 		printf("\n\n✓ Async streaming completed\n\n");
 	}
 
+	printf("Multiplexed Streaming (using AsyncResultSet):\n");
+	{
+		const char *questions[] = {"Say hi.", "Say bye.", "Say thanks."};
+		ChatCompletionRequest requests[3];
+		AsyncResult results[3];
+		AsyncResultSet set;
+
+		for (int i = 0; i < 3; i++)
+		{
+			requests[i].stream = true;
+			requests[i].max_tokens = 10;
+			requests[i].messages.push_back({"user", questions[i]});
+			results[i] = client.chat_completion_async(requests[i]);
+			set.add(&results[i]);
+		}
+
+		// one thread drives all streams
+		while (set.size() != 0 && !stop_flag)
+		{
+			AsyncResult *result = set.wait(1000);
+			if (!result)
+				continue; // timeout
+
+			int i = (int)(result - results);
+			ChatCompletionChunk *chunk = result->get_chunk();
+
+			if (!chunk || chunk->state != RESPONSE_SUCCESS)
+			{
+				printf("[%d] end\n", i);
+				set.remove(result);
+			}
+			else if (!chunk->choices.empty())
+				printf("[%d] %s\n", i, chunk->choices[0].delta.content.c_str());
+		}
+
+		printf("\n✓ Multiplexed streaming completed\n\n");
+	}
+
 	return 0;
 }
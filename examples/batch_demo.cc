@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string>
+#include "llm_batch.h"
+
+using namespace wfai;
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "USAGE: %s <api_key> [base_url] [model]\n", argv[0]);
+		return 1;
+	}
+
+	std::string base_url = argc > 2 ? argv[2] : "https://api.openai.com/v1";
+	std::string model = argc > 3 ? argv[3] : "gpt-4o-mini";
+	const char *path = "batch_input.jsonl";
+	const char *questions[] = {
+		"hi",
+		"What is the capital of France?",
+		"Write a haiku about the sea.",
+	};
+
+	BatchWriter writer;
+	if (!writer.open(path))
+	{
+		fprintf(stderr, "Cannot open %s\n", path);
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof questions / sizeof questions[0]; i++)
+	{
+		ChatCompletionRequest request;
+		request.model = model;
+		request.messages.push_back({"user", questions[i]});
+		writer.add("request-" + std::to_string(i), request);
+	}
+
+	writer.close();
+	fprintf(stderr, "wrote %zu requests to %s\n", writer.count(), path);
+
+	BatchClient client(argv[1], base_url);
+	client.set_poll_interval(10);
+
+	BatchResult result = client.batch_sync(path,
+		[](const std::string& custom_id, int status_code,
+		   ChatCompletionResponse *response)
+		{
+			if (status_code == 200 && !response->choices.empty())
+			{
+				fprintf(stderr, "%s: %s\n", custom_id.c_str(),
+						response->choices[0].message.content.c_str());
+			}
+			else
+			{
+				fprintf(stderr, "%s: failed %d %s\n", custom_id.c_str(),
+						status_code, response->error.c_str());
+			}
+		});
+
+	if (!result.success)
+	{
+		fprintf(stderr, "Batch failed: %s\n", result.error_message.c_str());
+		return 1;
+	}
+
+	fprintf(stderr, "batch %s %s, %zu results, %zu failed\n",
+			result.batch_id.c_str(), result.status.c_str(),
+			result.result_count, result.error_count);
+	return 0;
+}
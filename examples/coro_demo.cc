@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string>
+#include "llm_coro.h"
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+using namespace wfai;
+
+FunctionManager func_mgr;
+
+void get_current_weather(const std::string& arguments, FunctionResult *result)
+{
+	result->name = "get_current_weather";
+	result->success = true;
+	result->result = "Temperature: 25°C, Sunny";
+}
+
+CoTask<> chat_flow(LLMClient& client)
+{
+	ChatCompletionRequest request;
+	request.model = "deepseek-chat";
+	request.messages.push_back({"user", "hi"});
+
+	// one request, straight-line code without blocking any thread
+	SyncResult result = co_await co_chat_completion(client, request);
+	if (!result.success)
+	{
+		fprintf(stderr, "Request failed: %s\n", result.error_message.c_str());
+		co_return;
+	}
+
+	if (!result.response.choices.empty())
+	{
+		fprintf(stderr, "Response: %s\n",
+				result.response.choices[0].message.content.c_str());
+	}
+
+	// streaming
+	request.messages.push_back({"assistant",
+		result.response.choices.empty() ? "" :
+		result.response.choices[0].message.content});
+	request.messages.push_back({"user", "Tell me a short story."});
+
+	ChatStream stream = co_chat_stream(client, request);
+	while (ChatCompletionChunk *chunk = co_await stream.next())
+	{
+		if (!chunk->choices.empty())
+			fprintf(stderr, "%s", chunk->choices[0].delta.content.c_str());
+	}
+
+	fprintf(stderr, "\nStream finished. success: %d\n", stream.result().success);
+
+	// run a local function without blocking
+	FunctionResult weather = co_await co_execute(func_mgr,
+		"get_current_weather", "{\"location\":\"Beijing\"}");
+	fprintf(stderr, "Function: %s\n", weather.result.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "USAGE: %s <api_key>\n", argv[0]);
+		return 1;
+	}
+
+	FunctionDefinition weather_func;
+	weather_func.name = "get_current_weather";
+	weather_func.description = "Get current weather";
+	func_mgr.register_function(weather_func, get_current_weather);
+
+	LLMClient client(argv[1]);
+	sync_wait(chat_flow(client));
+	return 0;
+}
+
+#else
+
+int main()
+{
+	fprintf(stderr, "coro_demo requires C++20 coroutines\n");
+	return 1;
+}
+
+#endif
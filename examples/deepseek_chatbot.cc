@@ -9,10 +9,12 @@
 #include "workflow/WFFacilities.h"
 #include "llm_client.h"
 #include "llm_memory.h"
+#include "llm_summarizer.h"
 
 using namespace wfai;
 
 #define MAX_CONTENT_LENGTH 1024
+#define MAX_HISTORY_TOKENS 16384
 
 volatile bool stop_flag;
 WFFacilities::WaitGroup wait_group(1);
@@ -27,9 +29,8 @@ public:
 
 	// for memory
 	Memory *memory;
+	MemorySummarizer *summarizer;
 	std::string session_id = "default"; // for this session
-	std::string stream_role;			// save role for streaming
-	std::string stream_content;			// save whole content for streaming
 
 private:
 	int state; // for printing response
@@ -183,26 +184,28 @@ void callback(WFHttpChunkedTask *task,
 
 	if (task->get_state() == WFT_STATE_SUCCESS)
 	{
-		if (!request->stream && !response->choices.empty())
+		// streaming response has the whole message as well
+		if (!response->choices.empty() &&
+			(!request->stream || ctx->is_finish()))
 		{
-			const auto& msg = response->choices[0].message;
-			if (request->model == "deepseek-reasoner")
+			auto& msg = response->choices[0].message;
+
+			if (!request->stream)
 			{
-				fprintf(stderr, "<think>\n\n%s\n<\\think>\n\n",
-						msg.reasoning_content.c_str());
-			}
-			fprintf(stderr, "%s\n", msg.content.c_str());
+				if (request->model == "deepseek-reasoner")
+				{
+					fprintf(stderr, "<think>\n\n%s\n<\\think>\n\n",
+							msg.reasoning_content.c_str());
+				}
+				fprintf(stderr, "%s\n", msg.content.c_str());
 
-			print_llm_info(response, true);
+				print_llm_info(response, true);
+			}
 
 			ctx->memory->add_message(ctx->session_id,
 				{std::move(msg.role), std::move(msg.content)});
-			success = true;
-		}
-		else if (ctx->is_finish()) // stream and success finished
-		{
-			ctx->memory->add_message(ctx->session_id,
-				{std::move(ctx->stream_role), std::move(ctx->stream_content)});
+			// summarize old turns in background if too long
+			ctx->summarizer->compact(ctx->session_id);
 			success = true;
 		}
 	}
@@ -246,12 +249,6 @@ void extract(WFHttpChunkedTask *task,
 		if (ctx->set_context())
 			fprintf(stderr, "\n\n<\\think>\n\n");
 		fprintf(stderr, "%s", choice.delta.content.c_str());
-		ctx->stream_content.append(std::move(choice.delta.content));
-	}
-	else if (!choice.delta.role.empty()) // begin
-	{
-		ctx->stream_role = std::move(choice.delta.role);
-		ctx->stream_content.clear(); // finish_reason could be null
 	}
 	else if (choice.finish_reason.length()) // end
 	{
@@ -286,14 +283,16 @@ void next_query(SeriesWork *series)
 		request.model = ctx->model;
 		request.stream = ctx->stream;
 
-		// get history memory
-		request.messages = ctx->memory->get_history(ctx->session_id);
+		// get the newest history in budget, shared without copying
+		request.history = ctx->memory->get_window(ctx->session_id,
+												  MAX_HISTORY_TOKENS);
 		request.messages.push_back({"user", query});
 
 		// add memory into history
 		ctx->memory->add_message(ctx->session_id, {"user", query});
 
-		auto *next = ctx->client->create_chat_task(request, extract, callback);
+		auto *next = ctx->client->create_chat_task(std::move(request),
+												   extract, callback);
 		series->push_back(next);
 		ctx->reset_state();
 		break;
@@ -318,12 +317,14 @@ int main(int argc, char *argv[])
 
 	LLMClient client(argv[1]);
 	Memory memory;
+	MemorySummarizer summarizer(&client, &memory);
 
 	ExampleContext ctx;
 	ctx.client = &client;
 	ctx.model = "deepseek-reasoner";
 	ctx.stream = true;
 	ctx.memory = &memory;
+	ctx.summarizer = &summarizer;
 	ctx.session_id = "main";
 
 	if (argc >= 3)
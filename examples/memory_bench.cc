@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llm_memory.h"
+
+using namespace wfai;
+
+// USAGE: memory_bench [ops_per_thread] [max_threads]
+// Threads serving different sessions : add a message, read the history
+// for the next request, and drop the session now and then.
+static double run(Memory& memory, const std::vector<std::string>& sessions,
+				  int threads, int ops)
+{
+	std::vector<std::thread> workers;
+	auto start = std::chrono::steady_clock::now();
+
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&memory, &sessions, t, ops]() {
+			Message msg("user", "hello, how is the weather today?");
+			size_t n = sessions.size();
+
+			for (int i = 0; i < ops; i++)
+			{
+				const std::string& id = sessions[(t * 7919 + i * 31) % n];
+
+				memory.add_message(id, msg);
+				MessageHistory history = memory.get_shared_history(id);
+
+				if (history.size() >= 32)
+					memory.clear(id);
+			}
+		});
+	}
+
+	for (auto& worker : workers)
+		worker.join();
+
+	std::chrono::duration<double> cost = std::chrono::steady_clock::now() - start;
+	return (double)threads * ops / cost.count();
+}
+
+int main(int argc, char *argv[])
+{
+	int ops = argc > 1 ? atoi(argv[1]) : 200000;
+	int max_threads = argc > 2 ? atoi(argv[2]) :
+					  (int)std::thread::hardware_concurrency();
+	std::vector<std::string> sessions;
+
+	for (int i = 0; i < 4096; i++)
+		sessions.push_back("session-" + std::to_string(i));
+
+	if (max_threads < 1)
+		max_threads = 1;
+
+	printf("%d ops per thread, %zu sessions\n", ops, sessions.size());
+	printf("%8s %16s %16s %8s\n", "threads", "1 lock(op/s)", "sharded(op/s)", "speedup");
+
+	double base = 0;
+	for (int threads = 1; threads <= max_threads; threads *= 2)
+	{
+		Memory single(1);
+		Memory sharded;
+
+		double one = run(single, sessions, threads, ops);
+		double many = run(sharded, sessions, threads, ops);
+
+		if (threads == 1)
+			base = many;
+
+		printf("%8d %16.0f %16.0f %7.2fx\n", threads, one, many, many / base);
+	}
+
+	return 0;
+}
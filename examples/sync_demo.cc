@@ -96,5 +96,34 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	printf("3. Batch of Requests, 2 at a time:\n");
+	{
+		const char *cities[] = {"Beijing", "Shanghai", "Shenzhen", "Hangzhou"};
+		std::vector<ChatCompletionRequest> requests(4);
+
+		for (int i = 0; i < 4; i++)
+		{
+			requests[i].model = "deepseek-chat";
+			requests[i].tool_choice = "none";
+			requests[i].messages.push_back({"user",
+				std::string("One sentence about ") + cities[i]});
+		}
+
+		auto results = client.chat_completion_batch(requests, 2,
+			[](size_t finished, size_t total) {
+				printf("progress %zu/%zu\n", finished, total);
+			});
+
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			if (results[i].success)
+				printf("%s : %s\n", cities[i],
+					   results[i].response.choices[0].message.content.c_str());
+			else
+				printf("%s : ✗ %s\n", cities[i], results[i].error_message.c_str());
+		}
+		printf("\n");
+	}
+
 	return 0;
 }
@@ -18,7 +18,11 @@ ChatCompletionRequest::ChatCompletionRequest() :
 	top_p(1.0),
 	tool_choice("none"),
 	logprobs(false),
-	top_logprobs(0)
+	top_logprobs(0),
+	ttft_timeout(-1),
+	tpot_timeout(-1),
+	priority(PRIORITY_NORMAL),
+	deadline(-1)
 {
 }
 
@@ -78,64 +82,97 @@ std::string escape_string(const std::string &s)
 	return result;
 }
 
-std::string ChatCompletionRequest::to_json() const 
+uint32_t ChatCompletionRequest::estimate_tokens() const
 {
-	std::string json = "{";
+	size_t tokens = this->history.tokens(); // counted when added
+	size_t bytes = 0;
 
-	json += "\"messages\":[";
-	for (size_t i = 0; i < messages.size(); i++) 
-	{
-		const auto& msg = messages[i];
-		std::string escaped_content = escape_string(msg.content);
+	for (const auto& msg : this->messages)
+		tokens += MessageHistory::estimate_tokens(msg);
 
-		json += "{";
-		json += "\"role\":\"" + msg.role + "\",";
+	for (const auto& tool : this->tools)
+		bytes += tool.function.name.size() + tool.function.description.size();
 
-		if (!msg.content.empty() || msg.role == "tool")
-			json += "\"content\":\"" + escaped_content + "\",";
-		else
-			json += "\"content\":null,";
+	tokens += bytes / 4;
+	return (uint32_t)tokens + (this->max_tokens > 0 ? this->max_tokens : 0);
+}
+
+std::string ChatCompletionRequest::to_json() const
+{
+	std::string json = "{\"messages\":[";
+	bool first = true;
+
+	auto append = [&json, &first](const Message& msg) {
+		if (!first)
+			json += ",";
+
+		message_to_json(msg, json);
+		first = false;
+	};
+
+	this->history.for_each(append);
+	for (const auto& msg : this->messages)
+		append(msg);
+
+	json += "],";
+	json += this->params_to_json();
+	json += "}";
+	return json;
+}
+
+void ChatCompletionRequest::message_to_json(const Message& msg,
+											std::string& json)
+{
+	json += "{";
+	json += "\"role\":\"" + msg.role + "\",";
 
-		if (!msg.name.empty())
-			json += ",\"name\":\"" + msg.name + "\",";
+	if (!msg.content.empty() || msg.role == "tool")
+		json += "\"content\":\"" + escape_string(msg.content) + "\",";
+	else
+		json += "\"content\":null,";
 
-		// fill tool_calls in from assistant as response
-		if (msg.role == "assistant" && !msg.tool_calls.empty())
+	if (!msg.name.empty())
+		json += "\"name\":\"" + escape_string(msg.name) + "\",";
+
+	// fill tool_calls in from assistant as response
+	if (msg.role == "assistant" && !msg.tool_calls.empty())
+	{
+		json += "\"tool_calls\":[";
+		for (size_t j = 0; j < msg.tool_calls.size(); j++)
 		{
-			json += "\"tool_calls\":[";
-			for (size_t j = 0; j < msg.tool_calls.size(); j++)
-			{
-				const auto& tc = msg.tool_calls[j];
-				json += "{";
-				json += "\"id\":\"" + tc.id + "\",";
-				json += "\"type\":\"" + tc.type + "\",";
-				json += "\"function\":{";
-				json += "\"name\":\"" + tc.function.name + "\",";
-				json += "\"arguments\":\"" + escape_string(tc.function.arguments) + "\"";
-				json += "}";
-				json += "}";
-				if (j < msg.tool_calls.size() - 1)
-					json += ",";
-			}
-			json += "],";
+			const auto& tc = msg.tool_calls[j];
+			json += "{";
+			json += "\"id\":\"" + tc.id + "\",";
+			json += "\"type\":\"" + tc.type + "\",";
+			json += "\"function\":{";
+			json += "\"name\":\"" + tc.function.name + "\",";
+			json += "\"arguments\":\"" + escape_string(tc.function.arguments) + "\"";
+			json += "}";
+			json += "}";
+			if (j < msg.tool_calls.size() - 1)
+				json += ",";
 		}
+		json += "],";
+	}
 
-		// fill tool_call_id when this message is tool call result
-		if (msg.role == "tool" && !msg.tool_call_id.empty())
-			json += "\"tool_call_id\":\"" + msg.tool_call_id + "\",";
+	// fill tool_call_id when this message is tool call result
+	if (msg.role == "tool" && !msg.tool_call_id.empty())
+		json += "\"tool_call_id\":\"" + msg.tool_call_id + "\",";
 
-		if (msg.prefix)
-			json += "\"prefix\":true,";
+	if (msg.prefix)
+		json += "\"prefix\":true,";
 
-		// remove the last , in json object
-		if (json.back() == ',')
-			json.pop_back();
+	// remove the last , in json object
+	if (json.back() == ',')
+		json.pop_back();
 
-		json += "}";
-		if (i < messages.size() - 1)
-			json += ",";
-	}
-	json += "],";
+	json += "}";
+}
+
+// all fields after messages, without the leading , and the closing }
+std::string ChatCompletionRequest::params_to_json() const
+{
+	std::string json;
 
 	json += "\"model\":\"" + model + "\"";
 
@@ -175,10 +212,79 @@ std::string ChatCompletionRequest::to_json() const
 	if (top_logprobs)
 		json += ",\"top_logprobs\":" + std::to_string(top_logprobs);
 
-	json += "}";
 	return json;
 }
 
+PreparedChatRequest::PreparedChatRequest(const ChatCompletionRequest& request) :
+	params(request)
+{
+	this->prefix = "{\"messages\":[";
+	this->empty_prefix = true;
+	this->messages_to_json(request.history, request.messages, this->prefix);
+	this->empty_prefix = request.history.empty() && request.messages.empty();
+	this->suffix = "]," + request.params_to_json() + "}";
+
+	this->params.history.clear();
+	this->params.messages.clear();
+	this->params.tools.clear(); // already in suffix
+	this->params.cancel = CancelHandle(); // each request has its own
+}
+
+void PreparedChatRequest::messages_to_json(const MessageHistory& history,
+										   const std::vector<Message>& messages,
+										   std::string& json) const
+{
+	bool first = this->empty_prefix;
+
+	auto append = [&json, &first](const Message& msg) {
+		if (!first)
+			json += ",";
+
+		ChatCompletionRequest::message_to_json(msg, json);
+		first = false;
+	};
+
+	history.for_each(append);
+	for (const auto& msg : messages)
+		append(msg);
+}
+
+std::string PreparedChatRequest::to_json(const std::vector<Message>& messages) const
+{
+	std::string json;
+
+	json.reserve(this->prefix.size() + this->suffix.size() +
+				 messages.size() * 128);
+	json = this->prefix;
+	this->messages_to_json(MessageHistory(), messages, json);
+	json += this->suffix;
+	return json;
+}
+
+std::string PreparedChatRequest::to_json(const ChatCompletionRequest& req) const
+{
+	std::string json = this->prefix;
+
+	this->messages_to_json(req.history, req.messages, json);
+
+	// the suffix is out of date after tool calls changed tool_choice
+	if (req.tool_choice == this->params.tool_choice)
+		json += this->suffix;
+	else
+	{
+		json += "],";
+		json += req.params_to_json();
+		json += "}";
+	}
+
+	return json;
+}
+
+void PreparedChatRequest::make_request(ChatCompletionRequest& req) const
+{
+	req = this->params;
+}
+
 std::string ChatCompletionRequest::tools_to_json() const
 {
 	std::string json;
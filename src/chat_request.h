@@ -7,19 +7,33 @@
 #include <map>
 #include "workflow/json_parser.h"
 #include "llm_util.h"
+#include "llm_history.h"
 
 namespace wfai {
 
+// escape for a JSON string value
+std::string escape_string(const std::string &s);
+
 class ChatCompletionRequest
 {
 public:
 	std::string to_json() const;
+
+	// rough prompt tokens (4 bytes each) plus max_tokens, as providers
+	// count a request against the token rate limit
+	uint32_t estimate_tokens() const;
+
+	// pieces of to_json() : {"messages":[ <message>,... ], <params> }
+	static void message_to_json(const Message& msg, std::string& json);
+	std::string params_to_json() const;
+
 	ChatCompletionRequest();
 
 private:
 	std::string tools_to_json() const;
 
 public:
+	MessageHistory history; // shared earlier messages, sent before messages
 	std::vector<Message> messages;
 	std::string model;
 	double frequency_penalty;
@@ -36,10 +50,56 @@ public:
 	bool logprobs;
 	int top_logprobs;
 
+	// not sent to server, milliseconds. -1 : adaptive or client default
+	int ttft_timeout;	// time to first token
+	int tpot_timeout;	// time per output token, max gap between chunks
+
+	// not sent to server, for RequestScheduler
+	int priority;		// PRIORITY_*, lower runs first
+	int deadline;		// ms from submission, -1 : none, within a tenant
+	std::string tenant;	// fair share between tenants, "" : default
+
+	// not sent to server, keep a copy and cancel() to stop the request,
+	// seen at the next chunk as AsyncResult::cancel(). One waiting for a
+	// slot of scheduler is finished at once, its callback in this thread
+	CancelHandle cancel;
+
 //friend:
 //	class LLMClient;
 };
 
+// A request template serialized once. Messages of the template are the
+// fixed prefix, such as system prompt. Each call only serializes the
+// messages appended after them.
+// Use LLMClient::prepare() to include tools of its function manager.
+class PreparedChatRequest
+{
+public:
+	PreparedChatRequest(const ChatCompletionRequest& request);
+
+	// the same as to_json() of template with messages appended
+	std::string to_json(const std::vector<Message>& messages) const;
+
+	// req : made by make_request(), messages may grow by tool calls
+	std::string to_json(const ChatCompletionRequest& req) const;
+
+	// copy of parameters without fixed messages and tools
+	void make_request(ChatCompletionRequest& req) const;
+
+	uint32_t prefix_tokens() const { return this->prefix.size() / 4; }
+
+private:
+	void messages_to_json(const MessageHistory& history,
+						  const std::vector<Message>& messages,
+						  std::string& json) const;
+
+private:
+	ChatCompletionRequest params;
+	std::string prefix;	// {"messages":[ and fixed messages
+	std::string suffix;	// ], parameters and }
+	bool empty_prefix;	// no fixed message
+};
+
 } // namespace wfai
 
 #endif // CHAT_REQUEST_H 
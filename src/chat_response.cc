@@ -292,7 +292,20 @@ bool ChatResponse::parse_json(const char *msg, size_t size)
 	json_value_t *root = json_value_parse(json_buf);
 	free(json_buf);
 
-	if (!root || json_value_type(root) != JSON_VALUE_OBJECT)
+	if (!root)
+	{
+		this->state = RESPONSE_PARSE_ERROR;
+		return false;
+	}
+
+	bool ret = this->parse_json(root);
+	json_value_destroy(root);
+	return ret;
+}
+
+bool ChatResponse::parse_json(const json_value_t *root)
+{
+	if (json_value_type(root) != JSON_VALUE_OBJECT)
 	{
 		this->state = RESPONSE_PARSE_ERROR;
 		return false;
@@ -309,7 +322,6 @@ bool ChatResponse::parse_json(const char *msg, size_t size)
 			error = json_value_string(message_val);
 
 		this->state = RESPONSE_API_ERROR;
-		json_value_destroy(root);
 		return false;
 	}
 
@@ -337,7 +349,6 @@ bool ChatResponse::parse_json(const char *msg, size_t size)
 	if (!choices_val || json_value_type(choices_val) != JSON_VALUE_ARRAY)
 	{
 		this->state = RESPONSE_CONTENT_ERROR;
-		json_value_destroy(root);
 		return false;
 	}
 
@@ -367,7 +378,6 @@ bool ChatResponse::parse_json(const char *msg, size_t size)
 		// stream_content.last_chunk = std::string(msg, size);
 	}
 
-	json_value_destroy(root);
 	if (ret)
 		this->state = RESPONSE_SUCCESS;
 
@@ -442,7 +452,8 @@ bool ChatCompletionChunk::parse_message(const json_object_t *object,
 }
 
 ChatCompletionResponse::ChatCompletionResponse(ChatCompletionResponse&& move) :
-	ChatResponse(std::move(move))
+	ChatResponse(std::move(move)),
+	streamed(std::move(move.streamed))
 {
 }
 
@@ -452,6 +463,23 @@ ChatCompletionResponse::operator=(ChatCompletionResponse&& move)
 	if (this != &move) {
 		ChatResponse::operator=(std::move(move));
 		usage = std::move(move.usage);
+		streamed = std::move(move.streamed);
+	}
+	return *this;
+}
+
+ChatCompletionResponse::ChatCompletionResponse(const ChatCompletionResponse& copy) :
+	ChatResponse(copy)
+{
+}
+
+ChatCompletionResponse&
+ChatCompletionResponse::operator=(const ChatCompletionResponse& copy)
+{
+	if (this != &copy)
+	{
+		ChatResponse::operator=(copy);
+		this->buffer.clear();
 	}
 	return *this;
 }
@@ -460,10 +488,73 @@ void ChatCompletionResponse::clear()
 {
 	ChatResponse::clear();
 	this->buffer.clear();
+	this->streamed.clear();
 	this->is_stream = false;
 	this->is_done = false;
 }
 
+void ChatCompletionResponse::append_chunk(const ChatCompletionChunk& chunk)
+{
+	if (this->id.empty())
+	{
+		this->id = chunk.id;
+		this->object = "chat.completion";
+		this->created = chunk.created;
+		this->model = chunk.model;
+		this->system_fingerprint = chunk.system_fingerprint;
+	}
+
+	// the last one has it if stream_options.include_usage
+	if (chunk.usage.total_tokens != 0)
+		this->usage = chunk.usage;
+
+	for (const Choice& c : chunk.choices)
+	{
+		size_t i = c.index >= 0 ? (size_t)c.index : 0;
+
+		if (this->streamed.size() <= i)
+			this->streamed.resize(i + 1);
+
+		this->streamed[i].content.append(c.delta.content);
+		this->streamed[i].reasoning_content.append(c.delta.reasoning_content);
+
+		if (!c.delta.role.empty() || !c.finish_reason.empty())
+		{
+			if (this->choices.size() <= i)
+				this->choices.resize(i + 1);
+
+			if (!c.delta.role.empty())
+				this->choices[i].message.role = c.delta.role;
+
+			if (!c.finish_reason.empty())
+				this->choices[i].finish_reason = c.finish_reason;
+		}
+	}
+}
+
+void ChatCompletionResponse::flatten()
+{
+	if (this->streamed.empty())
+		return;
+
+	if (this->choices.size() < this->streamed.size())
+		this->choices.resize(this->streamed.size());
+
+	for (size_t i = 0; i < this->streamed.size(); i++)
+	{
+		Choice::Message& msg = this->choices[i].message;
+
+		this->choices[i].index = (int)i;
+		if (msg.role.empty())
+			msg.role = "assistant";
+
+		this->streamed[i].content.flatten(msg.content);
+		this->streamed[i].reasoning_content.flatten(msg.reasoning_content);
+	}
+
+	this->streamed.clear();
+}
+
 bool ChatCompletionResponse::parse_message(const json_object_t *object,
 										   Choice& choice)
 {
@@ -8,9 +8,12 @@
 #include <functional>
 #include "workflow/json_parser.h"
 #include "llm_util.h"
+#include "llm_rope.h"
 
 namespace wfai {
 
+class ChatCompletionChunk;
+
 struct Usage
 {
 	int completion_tokens;			// 模型 completion 产生的 token 数
@@ -169,11 +172,15 @@ public:
 	ChatResponse(ChatResponse&& move); 
 	ChatResponse& operator=(ChatResponse&& move);
 
+	ChatResponse(const ChatResponse& copy) = default;
+	ChatResponse& operator=(const ChatResponse& copy) = default;
+
 	virtual ~ChatResponse() { }
 	virtual void clear();
 
 public:
 	bool parse_json(const char *msg, size_t size);
+	bool parse_json(const json_value_t *root);
 
 private:
 	bool parse_choice(const json_value_t *choice);
@@ -200,9 +207,21 @@ public:
 	void clear() override;
 	bool buffer_empty() { return this->buffer.empty(); }
 
+	// for streaming : keep delta texts of chunk in ropes until flatten()
+	// makes messages of choices, as what non-streaming one has
+	void append_chunk(const ChatCompletionChunk& chunk);
+	void flatten();
+
 private:
 	Buffer buffer;
 
+	struct StreamedText
+	{
+		TextRope content;
+		TextRope reasoning_content;
+	};
+	std::vector<StreamedText> streamed; // by index of choice
+
 public:
 	ChatCompletionResponse()
 	{
@@ -212,6 +231,10 @@ public:
 	ChatCompletionResponse(ChatCompletionResponse&& move);
 	ChatCompletionResponse& operator=(ChatCompletionResponse&& move);
 
+	// copy the parsed result only, raw buffer is not copied
+	ChatCompletionResponse(const ChatCompletionResponse& copy);
+	ChatCompletionResponse& operator=(const ChatCompletionResponse& copy);
+
 	virtual ~ChatCompletionResponse() { }
 
 private:
@@ -229,6 +252,9 @@ public:
 	ChatCompletionChunk(ChatCompletionChunk&& move);
 	ChatCompletionChunk& operator=(ChatCompletionChunk&& move);
 
+	ChatCompletionChunk(const ChatCompletionChunk& copy) = default;
+	ChatCompletionChunk& operator=(const ChatCompletionChunk& copy) = default;
+
 	virtual ~ChatCompletionChunk() { }
 
 	void clear() override
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "llm_arena.h"
+
+using namespace wfai;
+
+static constexpr size_t max_block_size = 1024 * 1024;
+
+static inline char *align_up(char *p, size_t align)
+{
+	uintptr_t n = reinterpret_cast<uintptr_t>(p);
+	return reinterpret_cast<char *>((n + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+Arena::Arena(char *begin, size_t size) :
+	cur(begin),
+	end(begin + size),
+	chain(nullptr),
+	cleanups(nullptr),
+	next_size(size * 2),
+	blocks(1)
+{
+}
+
+Arena *Arena::create(size_t size)
+{
+	size_t head = (sizeof (Arena) + alignof(std::max_align_t) - 1) &
+				  ~(alignof(std::max_align_t) - 1);
+	char *mem = static_cast<char *>(malloc(head + size));
+
+	if (!mem)
+		throw std::bad_alloc();
+
+	return new(mem) Arena(mem + head, size);
+}
+
+void Arena::destroy(Arena *arena)
+{
+	Cleanup *c = arena->cleanups;
+	Block *b = arena->chain;
+	Block *next;
+
+	// cleanups are pushed in front, so in reverse order of creation
+	while (c)
+	{
+		Cleanup *next_cleanup = c->next;
+		c->fn(c->obj);
+		c = next_cleanup;
+	}
+
+	while (b)
+	{
+		next = b->next;
+		free(b);
+		b = next;
+	}
+
+	arena->~Arena();
+	free(arena);
+}
+
+void *Arena::allocate(size_t size, size_t align)
+{
+	char *p = align_up(this->cur, align);
+
+	if (p + size > this->end || p < this->cur)
+	{
+		size_t need = sizeof (Block) + size + align;
+		size_t block_size = this->next_size > need ? this->next_size : need;
+		Block *b = static_cast<Block *>(malloc(block_size));
+
+		if (!b)
+			throw std::bad_alloc();
+
+		b->next = this->chain;
+		this->chain = b;
+		this->cur = reinterpret_cast<char *>(b + 1);
+		this->end = reinterpret_cast<char *>(b) + block_size;
+		this->blocks++;
+
+		if (this->next_size < max_block_size)
+			this->next_size *= 2;
+
+		p = align_up(this->cur, align);
+	}
+
+	this->cur = p + size;
+	return p;
+}
+
+void Arena::add_cleanup(void (*fn)(void *), void *obj)
+{
+	Cleanup *c = static_cast<Cleanup *>(this->allocate(sizeof (Cleanup),
+													   alignof(Cleanup)));
+	c->fn = fn;
+	c->obj = obj;
+	c->next = this->cleanups;
+	this->cleanups = c;
+}
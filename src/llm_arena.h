@@ -0,0 +1,70 @@
+#ifndef LLM_ARENA_H
+#define LLM_ARENA_H
+
+#include <stddef.h>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+namespace wfai {
+
+// Monotonic memory for objects living as long as one request.
+// Nothing is freed until destroy(), which runs destructors in reverse
+// order of creation and frees all blocks at once.
+class Arena
+{
+public:
+	// the arena itself and the first block are in one allocation
+	static Arena *create(size_t size);
+	static void destroy(Arena *arena);
+
+	void *allocate(size_t size, size_t align);
+
+	template<class T, class... ARGS>
+	T *make(ARGS&&... args)
+	{
+		void *p = this->allocate(sizeof (T), alignof(T));
+		T *obj = new(p) T(std::forward<ARGS>(args)...);
+
+		if (!std::is_trivially_destructible<T>::value)
+			this->add_cleanup(&Arena::destruct<T>, obj);
+
+		return obj;
+	}
+
+	size_t get_blocks() const { return this->blocks; }
+
+private:
+	template<class T>
+	static void destruct(void *obj) { static_cast<T *>(obj)->~T(); }
+
+	void add_cleanup(void (*fn)(void *), void *obj);
+
+	struct Cleanup
+	{
+		void (*fn)(void *);
+		void *obj;
+		Cleanup *next;
+	};
+
+	struct Block
+	{
+		Block *next;
+	};
+
+	Arena(char *begin, size_t size);
+	~Arena() { }
+
+private:
+	char *cur;
+	char *end;
+	Block *chain;		// blocks after the first one
+	Cleanup *cleanups;
+	size_t next_size;
+	size_t blocks;
+};
+
+} // namespace wfai
+
+#endif // LLM_ARENA_H
@@ -0,0 +1,591 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "workflow/HttpMessage.h"
+#include "workflow/HttpUtil.h"
+#include "workflow/WFTaskFactory.h"
+#include "workflow/WFFacilities.h"
+#include "llm_batch.h"
+
+using namespace wfai;
+
+static constexpr const char *auth_str = "Bearer ";
+static constexpr const char *multipart_boundary = "----WorkflowAIBatchBoundary";
+static constexpr const char *default_completion_window = "24h";
+static constexpr int default_poll_interval = 30; // seconds
+static constexpr int default_redirect_max = 3;
+static constexpr size_t default_max_unchunked_size = 16 * 1024 * 1024;
+static constexpr size_t max_header_size = 16 * 1024; // in size limit too
+
+class BatchClient::BatchContext
+{
+public:
+	std::string path;
+	void *map;
+	size_t map_size;
+	std::string partial; // the last line not complete yet
+	bool error_file; // downloading error_file_id
+	size_t offset; // of the next range to download
+	batch_extract_t extract;
+	batch_callback_t callback;
+	BatchResult result;
+
+	BatchContext() :
+		map(MAP_FAILED), map_size(0), error_file(false), offset(0)
+	{
+	}
+
+	~BatchContext()
+	{
+		if (this->map != MAP_FAILED)
+			munmap(this->map, this->map_size);
+	}
+};
+
+////////// BatchWriter //////////
+
+bool BatchWriter::open(const std::string& path)
+{
+	if (this->fp)
+		return false;
+
+	this->fp = fopen(path.c_str(), "w");
+	this->lines = 0;
+	return this->fp != nullptr;
+}
+
+bool BatchWriter::add(const std::string& custom_id,
+					  const ChatCompletionRequest& req)
+{
+	if (!this->fp)
+		return false;
+
+	std::string line = "{\"custom_id\":\"" + escape_string(custom_id) +
+					   "\",\"method\":\"POST\",\"url\":\"" + this->url +
+					   "\",\"body\":" + req.to_json() + "}\n";
+
+	if (fwrite(line.data(), 1, line.size(), this->fp) != line.size())
+		return false;
+
+	this->lines++;
+	return true;
+}
+
+bool BatchWriter::close()
+{
+	if (!this->fp)
+		return true;
+
+	bool ret = fclose(this->fp) == 0;
+	this->fp = nullptr;
+	return ret;
+}
+
+////////// BatchClient //////////
+
+static json_value_t *parse_http_json(protocol::HttpResponse *resp)
+{
+	const void *body;
+	size_t len;
+
+	if (!resp->get_parsed_body(&body, &len))
+		return nullptr;
+
+	std::string buf(static_cast<const char *>(body), len);
+	return json_value_parse(buf.c_str());
+}
+
+static std::string json_find_string(const json_value_t *root, const char *name)
+{
+	if (!root || json_value_type(root) != JSON_VALUE_OBJECT)
+		return "";
+
+	const json_value_t *val = json_object_find(name, json_value_object(root));
+	if (!val || json_value_type(val) != JSON_VALUE_STRING)
+		return "";
+
+	return json_value_string(val);
+}
+
+static bool check_http_task(WFHttpTask *task, BatchResult *result,
+							const char *step)
+{
+	if (task->get_state() != WFT_STATE_SUCCESS)
+	{
+		result->error_message = std::string(step) + " failed. State: " +
+			std::to_string(task->get_state()) +
+			", Error: " + std::to_string(task->get_error());
+		return false;
+	}
+
+	protocol::HttpResponse *resp = task->get_resp();
+	if (strcmp(resp->get_status_code(), "200") != 0)
+	{
+		result->error_message = std::string(step) + " HTTP error: " +
+			resp->get_status_code() + " " + resp->get_reason_phrase();
+		return false;
+	}
+
+	return true;
+}
+
+static bool batch_finished(const std::string& status)
+{
+	return status == "completed" || status == "failed" ||
+		   status == "expired" || status == "cancelled";
+}
+
+// one line of output file :
+// {"id":..,"custom_id":..,"response":{"status_code":..,"body":{..}},"error":..}
+static void handle_line(BatchClient::BatchContext *ctx,
+						const char *line, size_t len)
+{
+	while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' '))
+		len--;
+
+	if (len == 0)
+		return;
+
+	std::string buf(line, len);
+	json_value_t *root = json_value_parse(buf.c_str());
+	ChatCompletionResponse resp;
+	int status_code = 0;
+
+	if (!root || json_value_type(root) != JSON_VALUE_OBJECT)
+	{
+		if (root)
+			json_value_destroy(root);
+		return;
+	}
+
+	std::string custom_id = json_find_string(root, "custom_id");
+	const json_object_t *obj = json_value_object(root);
+	const json_value_t *resp_val = json_object_find("response", obj);
+
+	if (resp_val && json_value_type(resp_val) == JSON_VALUE_OBJECT)
+	{
+		const json_object_t *resp_obj = json_value_object(resp_val);
+		const json_value_t *code_val = json_object_find("status_code", resp_obj);
+		if (code_val && json_value_type(code_val) == JSON_VALUE_NUMBER)
+			status_code = (int)json_value_number(code_val);
+
+		const json_value_t *body_val = json_object_find("body", resp_obj);
+		if (body_val)
+			resp.ChatResponse::parse_json(body_val);
+	}
+	else
+	{
+		const json_value_t *err_val = json_object_find("error", obj);
+		resp.state = RESPONSE_API_ERROR;
+		resp.error = json_find_string(err_val, "message");
+	}
+
+	json_value_destroy(root);
+
+	ctx->result.result_count++;
+	if (ctx->error_file)
+		ctx->result.error_count++;
+
+	if (ctx->extract)
+		ctx->extract(custom_id, status_code, &resp);
+}
+
+// start of the rest after a 206 response, 0 if nothing left
+static size_t next_range(const protocol::HttpResponse *resp, size_t length)
+{
+	protocol::HttpHeaderCursor cursor(resp);
+	std::string value;
+	size_t first;
+	size_t last;
+	size_t total;
+	int n;
+
+	if (!cursor.find("Content-Range", value))
+		return 0;
+
+	n = sscanf(value.c_str(), "bytes %zu-%zu/%zu", &first, &last, &total);
+	if (n == 3)
+		return last + 1 < total ? last + 1 : 0;
+
+	// total is "*", the end is a range shorter than asked
+	if (n == 2 && last + 1 - first == length)
+		return last + 1;
+
+	return 0;
+}
+
+// handle all complete lines, keep the rest in ctx->partial
+static void handle_lines(BatchClient::BatchContext *ctx,
+						 const char *data, size_t size)
+{
+	const char *end = data + size;
+	const char *p = data;
+	const char *nl;
+
+	if (!ctx->partial.empty())
+	{
+		nl = (const char *)memchr(p, '\n', end - p);
+		if (!nl)
+		{
+			ctx->partial.append(p, size);
+			return;
+		}
+
+		ctx->partial.append(p, nl - p);
+		handle_line(ctx, ctx->partial.data(), ctx->partial.size());
+		ctx->partial.clear();
+		p = nl + 1;
+	}
+
+	while (p < end && (nl = (const char *)memchr(p, '\n', end - p)) != NULL)
+	{
+		handle_line(ctx, p, nl - p);
+		p = nl + 1;
+	}
+
+	ctx->partial.assign(p, end - p);
+}
+
+BatchClient::BatchClient(const std::string& api_key,
+						 const std::string& base_url) :
+	api_key(api_key),
+	base_url(base_url),
+	endpoint("/v1/chat/completions"),
+	completion_window(default_completion_window),
+	poll_interval(default_poll_interval),
+	redirect_max(default_redirect_max),
+	max_unchunked_size(default_max_unchunked_size)
+{
+	if (!this->base_url.empty() && this->base_url.back() == '/')
+		this->base_url.pop_back();
+}
+
+void BatchClient::add_headers(protocol::HttpRequest *req)
+{
+	req->add_header_pair("Authorization", auth_str + this->api_key);
+	req->add_header_pair("Connection", "keep-alive");
+}
+
+WFHttpTask *BatchClient::create_upload_task(BatchContext *ctx)
+{
+	auto *task = WFTaskFactory::create_http_task(
+		this->base_url + "/files",
+		this->redirect_max,
+		0,
+		std::bind(&BatchClient::upload_callback, this,
+				  std::placeholders::_1, ctx)
+	);
+
+	std::string boundary = multipart_boundary;
+	std::string head = "--" + boundary + "\r\n"
+		"Content-Disposition: form-data; name=\"purpose\"\r\n\r\n"
+		"batch\r\n"
+		"--" + boundary + "\r\n"
+		"Content-Disposition: form-data; name=\"file\"; "
+		"filename=\"batch.jsonl\"\r\n"
+		"Content-Type: application/jsonl\r\n\r\n";
+	std::string tail = "\r\n--" + boundary + "--\r\n";
+
+	auto *req = task->get_req();
+	req->set_method("POST");
+	this->add_headers(req);
+	req->add_header_pair("Content-Type",
+						 "multipart/form-data; boundary=" + boundary);
+
+	// file content is sent from the mapping without copying
+	req->append_output_body(head.data(), head.size());
+	req->append_output_body_nocopy(ctx->map, ctx->map_size);
+	req->append_output_body(tail.data(), tail.size());
+
+	return task;
+}
+
+void BatchClient::upload_callback(WFHttpTask *task, BatchContext *ctx)
+{
+	if (!check_http_task(task, &ctx->result, "Upload"))
+		return;
+
+	json_value_t *root = parse_http_json(task->get_resp());
+	ctx->result.input_file_id = json_find_string(root, "id");
+	if (root)
+		json_value_destroy(root);
+
+	if (ctx->result.input_file_id.empty())
+	{
+		ctx->result.error_message = "Upload response without file id";
+		return;
+	}
+
+	series_of(task)->push_back(this->create_batch_task(ctx));
+}
+
+WFHttpTask *BatchClient::create_batch_task(BatchContext *ctx)
+{
+	auto *task = WFTaskFactory::create_http_task(
+		this->base_url + "/batches",
+		this->redirect_max,
+		0,
+		std::bind(&BatchClient::batch_callback, this,
+				  std::placeholders::_1, ctx)
+	);
+
+	std::string body = "{\"input_file_id\":\"" +
+		escape_string(ctx->result.input_file_id) +
+		"\",\"endpoint\":\"" + this->endpoint +
+		"\",\"completion_window\":\"" + this->completion_window + "\"}";
+
+	auto *req = task->get_req();
+	req->set_method("POST");
+	this->add_headers(req);
+	req->add_header_pair("Content-Type", "application/json");
+	req->append_output_body(body.data(), body.size());
+
+	return task;
+}
+
+void BatchClient::batch_callback(WFHttpTask *task, BatchContext *ctx)
+{
+	if (!check_http_task(task, &ctx->result, "Create batch"))
+		return;
+
+	json_value_t *root = parse_http_json(task->get_resp());
+	ctx->result.batch_id = json_find_string(root, "id");
+	ctx->result.status = json_find_string(root, "status");
+	if (root)
+		json_value_destroy(root);
+
+	if (ctx->result.batch_id.empty())
+	{
+		ctx->result.error_message = "Create batch response without batch id";
+		return;
+	}
+
+	series_of(task)->push_back(this->create_poll_task(ctx));
+}
+
+WFHttpTask *BatchClient::create_poll_task(BatchContext *ctx)
+{
+	auto *task = WFTaskFactory::create_http_task(
+		this->base_url + "/batches/" + ctx->result.batch_id,
+		this->redirect_max,
+		0,
+		std::bind(&BatchClient::poll_callback, this,
+				  std::placeholders::_1, ctx)
+	);
+
+	auto *req = task->get_req();
+	req->set_method("GET");
+	this->add_headers(req);
+
+	return task;
+}
+
+void BatchClient::poll_callback(WFHttpTask *task, BatchContext *ctx)
+{
+	SeriesWork *series = series_of(task);
+
+	if (!check_http_task(task, &ctx->result, "Poll batch"))
+		return;
+
+	json_value_t *root = parse_http_json(task->get_resp());
+	ctx->result.status = json_find_string(root, "status");
+	ctx->result.output_file_id = json_find_string(root, "output_file_id");
+	ctx->result.error_file_id = json_find_string(root, "error_file_id");
+	if (root)
+		json_value_destroy(root);
+
+	if (!batch_finished(ctx->result.status))
+	{
+		auto *timer = WFTaskFactory::create_timer_task(
+			(time_t)this->poll_interval, 0, nullptr);
+
+		series->push_back(timer);
+		series->push_back(this->create_poll_task(ctx));
+		return;
+	}
+
+	if (ctx->result.status != "completed")
+	{
+		ctx->result.error_message = "Batch " + ctx->result.status;
+		return;
+	}
+
+	// output of the requests succeeded, then of the ones failed
+	if (!ctx->result.output_file_id.empty())
+		series->push_back(this->create_download_task(ctx));
+	else if (!ctx->result.error_file_id.empty())
+	{
+		ctx->error_file = true;
+		series->push_back(this->create_download_task(ctx));
+	}
+	else
+		ctx->result.success = true;
+}
+
+WFHttpChunkedTask *BatchClient::create_download_task(BatchContext *ctx)
+{
+	const std::string& file_id = ctx->error_file ? ctx->result.error_file_id :
+												   ctx->result.output_file_id;
+	auto *task = this->client.create_chunked_task(
+		this->base_url + "/files/" + file_id + "/content",
+		this->redirect_max,
+		std::bind(&BatchClient::download_extract, this,
+				  std::placeholders::_1, ctx),
+		std::bind(&BatchClient::download_callback, this,
+				  std::placeholders::_1, ctx)
+	);
+
+	auto *req = task->get_req();
+	req->set_method("GET");
+	this->add_headers(req);
+
+	// a file sent without chunks is buffered whole, so it is fetched in
+	// ranges, and a server sending more than a range fails the task
+	req->add_header_pair("Range", "bytes=" + std::to_string(ctx->offset) +
+		"-" + std::to_string(ctx->offset + this->max_unchunked_size - 1));
+	task->get_resp()->set_size_limit(this->max_unchunked_size +
+									 max_header_size);
+
+	return task;
+}
+
+void BatchClient::download_extract(WFHttpChunkedTask *task, BatchContext *ctx)
+{
+	const void *data;
+	size_t size;
+
+	// streamed in chunks, nothing is buffered
+	task->get_resp()->set_size_limit((size_t)-1);
+
+	if (task->get_chunk()->get_chunk_data(&data, &size))
+		handle_lines(ctx, static_cast<const char *>(data), size);
+}
+
+void BatchClient::download_callback(WFHttpChunkedTask *task, BatchContext *ctx)
+{
+	protocol::HttpResponse *resp = task->get_resp();
+	const char *name = ctx->error_file ? "error file" : "output file";
+	int state = task->get_state();
+	const char *code = state == WFT_STATE_SUCCESS ? resp->get_status_code() : "";
+	bool ranged = strcmp(code, "206") == 0;
+	size_t next = 0;
+	const void *body;
+	size_t len;
+
+	if (state == WFT_STATE_SYS_ERROR && task->get_error() == EMSGSIZE)
+	{
+		ctx->result.error_message = std::string("Download ") + name +
+			" not chunked, not ranged and over limit";
+		return;
+	}
+
+	// 416 for a range of an empty file
+	if (state != WFT_STATE_SUCCESS ||
+		(strcmp(code, "200") != 0 && !ranged && strcmp(code, "416") != 0))
+	{
+		ctx->result.error_message = std::string("Download ") + name +
+			" failed. State: " + std::to_string(state) +
+			", Error: " + std::to_string(task->get_error());
+		return;
+	}
+
+	// with Content-Length the body is buffered instead of streamed
+	// through download_extract(), in the size limit
+	if (strcmp(code, "416") != 0 && !resp->is_chunked() &&
+		resp->get_parsed_body(&body, &len))
+	{
+		handle_lines(ctx, static_cast<const char *>(body), len);
+	}
+
+	if (ranged)
+		next = next_range(resp, this->max_unchunked_size);
+
+	if (next != 0)
+	{
+		ctx->offset = next;
+		series_of(task)->push_back(this->create_download_task(ctx));
+		return;
+	}
+
+	ctx->offset = 0;
+	if (!ctx->partial.empty())
+	{
+		handle_line(ctx, ctx->partial.data(), ctx->partial.size());
+		ctx->partial.clear();
+	}
+
+	if (!ctx->error_file && !ctx->result.error_file_id.empty())
+	{
+		ctx->error_file = true;
+		series_of(task)->push_back(this->create_download_task(ctx));
+		return;
+	}
+
+	ctx->result.success = true;
+}
+
+SeriesWork *BatchClient::create_batch_work(const std::string& jsonl_path,
+										   batch_extract_t extract,
+										   batch_callback_t callback)
+{
+	BatchContext *ctx = new BatchContext();
+	SubTask *first;
+	struct stat st;
+
+	ctx->path = jsonl_path;
+	ctx->extract = std::move(extract);
+	ctx->callback = std::move(callback);
+
+	int fd = open(jsonl_path.c_str(), O_RDONLY);
+	if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		ctx->map_size = st.st_size;
+		ctx->map = mmap(NULL, ctx->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	if (ctx->map != MAP_FAILED)
+	{
+		first = this->create_upload_task(ctx);
+	}
+	else
+	{
+		ctx->result.error_message = "Cannot map batch file: " + jsonl_path;
+		first = WFTaskFactory::create_empty_task();
+	}
+
+	return Workflow::create_series_work(first,
+		[ctx](const SeriesWork *) {
+			if (ctx->callback)
+				ctx->callback(&ctx->result);
+
+			delete ctx;
+		}
+	);
+}
+
+BatchResult BatchClient::batch_sync(const std::string& jsonl_path,
+									batch_extract_t extract)
+{
+	WFFacilities::WaitGroup wait_group(1);
+	BatchResult result;
+
+	SeriesWork *series = this->create_batch_work(jsonl_path,
+		std::move(extract),
+		[&wait_group, &result](BatchResult *res) {
+			result = std::move(*res);
+			wait_group.done();
+		}
+	);
+
+	series->start();
+	wait_group.wait();
+	return result;
+}
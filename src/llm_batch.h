@@ -0,0 +1,119 @@
+#ifndef LLM_BATCH_H
+#define LLM_BATCH_H
+
+#include <stdio.h>
+#include <string>
+#include <functional>
+#include "workflow/WFHttpChunkedClient.h"
+#include "workflow/Workflow.h"
+#include "chat_request.h"
+#include "chat_response.h"
+
+namespace wfai {
+
+// Write requests into a JSONL file for Batch API, one line each.
+// Lines go to the file directly so memory does not grow with batch size.
+class BatchWriter
+{
+public:
+	bool open(const std::string& path);
+	bool add(const std::string& custom_id, const ChatCompletionRequest& req);
+	bool close();
+
+	size_t count() const { return this->lines; }
+
+public:
+	BatchWriter() : fp(nullptr), lines(0), url("/v1/chat/completions") {}
+	BatchWriter(const std::string& url) : fp(nullptr), lines(0), url(url) {}
+	~BatchWriter() { this->close(); }
+
+private:
+	FILE *fp;
+	size_t lines;
+	std::string url;
+};
+
+struct BatchResult
+{
+	bool success;
+	std::string error_message;
+	std::string input_file_id;
+	std::string batch_id;
+	std::string status;			// final status of the batch
+	std::string output_file_id;
+	std::string error_file_id;
+	size_t result_count;		// lines received from output and error file
+	size_t error_count;			// of them from error file
+
+	BatchResult() : success(false), result_count(0), error_count(0) {}
+};
+
+// each result line of the output file, then of the error file.
+// resp is only valid in the call
+using batch_extract_t = std::function<void (const std::string& custom_id,
+											int status_code,
+											ChatCompletionResponse *resp)>;
+
+using batch_callback_t = std::function<void (BatchResult *result)>;
+
+// Batch API : upload JSONL, create batch, poll, then stream the output file
+class BatchClient
+{
+public:
+	// all steps in one series, callback at the end of the series
+	SeriesWork *create_batch_work(const std::string& jsonl_path,
+								  batch_extract_t extract,
+								  batch_callback_t callback);
+
+	// blocking until the whole batch is done and all results are extracted
+	BatchResult batch_sync(const std::string& jsonl_path,
+						   batch_extract_t extract);
+
+	void set_poll_interval(int seconds) { this->poll_interval = seconds; }
+	void set_completion_window(const std::string& window)
+	{
+		this->completion_window = window;
+	}
+
+	// output files are downloaded in ranges of this size. a file sent
+	// chunked is streamed, one sent whole over this fails the batch
+	void set_max_unchunked_size(size_t size)
+	{
+		this->max_unchunked_size = size;
+	}
+
+public:
+	// base_url is the API root, such as https://api.openai.com/v1
+	BatchClient(const std::string& api_key, const std::string& base_url);
+
+public:
+	class BatchContext;
+
+	WFHttpTask *create_upload_task(BatchContext *ctx);
+	WFHttpTask *create_batch_task(BatchContext *ctx);
+	WFHttpTask *create_poll_task(BatchContext *ctx);
+	WFHttpChunkedTask *create_download_task(BatchContext *ctx);
+
+	void upload_callback(WFHttpTask *task, BatchContext *ctx);
+	void batch_callback(WFHttpTask *task, BatchContext *ctx);
+	void poll_callback(WFHttpTask *task, BatchContext *ctx);
+	void download_extract(WFHttpChunkedTask *task, BatchContext *ctx);
+	void download_callback(WFHttpChunkedTask *task, BatchContext *ctx);
+
+private:
+	void add_headers(protocol::HttpRequest *req);
+
+private:
+	WFHttpChunkedClient client;
+	std::string api_key;
+	std::string base_url;
+	std::string endpoint;
+	std::string completion_window;
+	int poll_interval; // seconds
+	int redirect_max;
+	size_t max_unchunked_size;
+};
+
+} // namespace wfai
+
+#endif // LLM_BATCH_H
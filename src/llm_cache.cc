@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include "llm_util.h"
+#include "llm_cache.h"
+
+#define CACHE_RECORD_MAGIC	0x32414657	// "WFA2"
+#define CACHE_ALIGN(n)		(((n) + 7) & ~((size_t)7))
+
+namespace wfai {
+
+constexpr size_t ResponseCache::default_memory_limit;
+constexpr size_t ResponseCache::default_segment_size;
+constexpr size_t ResponseCache::default_max_segments;
+
+// value follows the header, padded to 8 bytes
+// header is written after value so a torn record is never valid
+struct CacheRecord
+{
+	uint32_t magic;
+	uint32_t size;
+	uint64_t key;
+	uint64_t check;
+	uint64_t checksum;
+};
+
+static std::string segment_path(const std::string& dir, size_t id)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%06zu.seg", id);
+	return dir + name;
+}
+
+ResponseCache::ResponseCache(size_t memory_limit) :
+	memory_limit(memory_limit),
+	memory_size(0),
+	segment_size(0),
+	max_segments(0),
+	tail(0)
+{
+}
+
+ResponseCache::~ResponseCache()
+{
+	this->close();
+}
+
+bool ResponseCache::get(uint64_t key, uint64_t check, std::string& value)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	auto it = this->lru_map.find(key);
+	if (it != this->lru_map.end())
+	{
+		if (it->second->check != check)
+			return false;
+
+		this->lru.splice(this->lru.begin(), this->lru, it->second);
+		value = it->second->value;
+		return true;
+	}
+
+	if (!this->disk_get(key, check, value))
+		return false;
+
+	this->lru_put(key, check, value);
+	return true;
+}
+
+void ResponseCache::put(uint64_t key, uint64_t check,
+						const std::string& value)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->lru_put(key, check, value);
+
+	if (!this->segments.empty())
+	{
+		auto it = this->index.find(key);
+		if (it == this->index.end() || it->second.check != check)
+			this->disk_put(key, check, value);
+	}
+}
+
+void ResponseCache::lru_put(uint64_t key, uint64_t check,
+							const std::string& value)
+{
+	auto it = this->lru_map.find(key);
+	if (it != this->lru_map.end())
+	{
+		this->memory_size -= it->second->value.size();
+		this->lru.erase(it->second);
+		this->lru_map.erase(it);
+	}
+
+	if (value.size() > this->memory_limit)
+		return;
+
+	while (this->memory_size + value.size() > this->memory_limit)
+	{
+		LRUEntry& last = this->lru.back();
+		this->memory_size -= last.value.size();
+		this->lru_map.erase(last.key);
+		this->lru.pop_back();
+	}
+
+	this->lru.push_front(LRUEntry());
+	this->lru.front().key = key;
+	this->lru.front().check = check;
+	this->lru.front().value = value;
+	this->lru_map[key] = this->lru.begin();
+	this->memory_size += value.size();
+}
+
+bool ResponseCache::disk_get(uint64_t key, uint64_t check, std::string& value)
+{
+	auto it = this->index.find(key);
+	if (it == this->index.end() || it->second.check != check)
+		return false;
+
+	const Location& loc = it->second;
+	const Segment& seg = this->segments[loc.segment - this->segments[0].id];
+	value.assign(seg.base + loc.offset, loc.size);
+	return true;
+}
+
+void ResponseCache::disk_put(uint64_t key, uint64_t check,
+							 const std::string& value)
+{
+	size_t len = sizeof (CacheRecord) + CACHE_ALIGN(value.size());
+
+	if (len > this->segment_size)
+		return;
+
+	if (this->tail + len > this->segment_size)
+	{
+		if (!this->open_segment(this->segments.back().id + 1, true))
+			return;
+
+		this->tail = 0;
+		while (this->segments.size() > this->max_segments)
+			this->drop_segment();
+	}
+
+	Segment& seg = this->segments.back();
+	CacheRecord *record = (CacheRecord *)(seg.base + this->tail);
+	char *data = (char *)(record + 1);
+
+	memcpy(data, value.data(), value.size());
+	record->size = (uint32_t)value.size();
+	record->key = key;
+	record->check = check;
+	record->checksum = fnv1a_hash(value.data(), value.size());
+	__atomic_store_n(&record->magic, CACHE_RECORD_MAGIC, __ATOMIC_RELEASE);
+
+	Location loc;
+	loc.segment = seg.id;
+	loc.offset = this->tail + sizeof (CacheRecord);
+	loc.size = value.size();
+	loc.check = check;
+	this->index[key] = loc;
+	this->tail += len;
+}
+
+bool ResponseCache::open_segment(size_t id, bool create)
+{
+	std::string path = segment_path(this->dir, id);
+	// a file left by an earlier run is not loaded, so it is reused
+	int flags = create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+	int fd = ::open(path.c_str(), flags, 0644);
+
+	if (fd < 0)
+		return false;
+
+	// zero tail of a new segment marks the end of records
+	if (create && ftruncate(fd, this->segment_size) < 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof (CacheRecord))
+	{
+		::close(fd);
+		return false;
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (base == MAP_FAILED)
+		return false;
+
+	Segment seg;
+	seg.id = id;
+	seg.base = (char *)base;
+	seg.size = st.st_size;
+	this->segments.push_back(seg);
+	return true;
+}
+
+void ResponseCache::scan_segment(const Segment& seg)
+{
+	size_t off = 0;
+
+	while (off + sizeof (CacheRecord) <= seg.size)
+	{
+		const CacheRecord *record = (const CacheRecord *)(seg.base + off);
+		size_t len = sizeof (CacheRecord) + CACHE_ALIGN(record->size);
+
+		if (record->magic != CACHE_RECORD_MAGIC || off + len > seg.size)
+			break;
+
+		const char *data = (const char *)(record + 1);
+		if (fnv1a_hash(data, record->size) != record->checksum)
+			break;
+
+		Location loc;
+		loc.segment = seg.id;
+		loc.offset = off + sizeof (CacheRecord);
+		loc.size = record->size;
+		loc.check = record->check;
+		this->index[record->key] = loc;
+		off += len;
+	}
+
+	this->tail = off;
+}
+
+// remove the oldest segment with its file and records
+void ResponseCache::drop_segment()
+{
+	Segment seg = this->segments.front();
+	auto it = this->index.begin();
+
+	while (it != this->index.end())
+	{
+		if (it->second.segment == seg.id)
+			it = this->index.erase(it);
+		else
+			++it;
+	}
+
+	munmap(seg.base, seg.size);
+	unlink(segment_path(this->dir, seg.id).c_str());
+	this->segments.pop_front();
+}
+
+bool ResponseCache::open(const std::string& dir, size_t segment_size,
+						 size_t max_segments)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	std::vector<size_t> ids;
+	DIR *dirp;
+
+	if (!this->segments.empty())
+		return false;
+
+	mkdir(dir.c_str(), 0755);
+	dirp = opendir(dir.c_str());
+	if (!dirp)
+		return false;
+
+	struct dirent *ent;
+	while ((ent = readdir(dirp)) != NULL)
+	{
+		size_t id;
+		char ext[8];
+
+		if (sscanf(ent->d_name, "%zu.%7s", &id, ext) == 2 &&
+			strcmp(ext, "seg") == 0)
+		{
+			ids.push_back(id);
+		}
+	}
+
+	closedir(dirp);
+	std::sort(ids.begin(), ids.end());
+
+	this->dir = dir;
+	this->segment_size = segment_size;
+	this->max_segments = max_segments > 0 ? max_segments : 1;
+
+	// segment ids are dense from the oldest, stop loading at the first gap
+	// and remove the rest, their ids are taken again
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		if ((i != 0 && ids[i] != ids[i - 1] + 1) ||
+			!this->open_segment(ids[i], false))
+		{
+			for (size_t j = i; j < ids.size(); j++)
+				unlink(segment_path(dir, ids[j]).c_str());
+
+			break;
+		}
+
+		this->scan_segment(this->segments.back());
+	}
+
+	while (this->segments.size() > this->max_segments)
+		this->drop_segment();
+
+	if (this->segments.empty())
+	{
+		if (!this->open_segment(0, true))
+			return false;
+
+		this->tail = 0;
+	}
+	else if (this->segments.back().size != segment_size)
+	{
+		// sealed by a process with another segment size
+		this->tail = this->segment_size;
+	}
+
+	return true;
+}
+
+void ResponseCache::close()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	for (const Segment& seg : this->segments)
+		munmap(seg.base, seg.size);
+
+	this->segments.clear();
+	this->index.clear();
+	this->tail = 0;
+}
+
+} // namespace wfai
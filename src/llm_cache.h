@@ -0,0 +1,94 @@
+#ifndef LLM_CACHE_H
+#define LLM_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace wfai {
+
+// Exact-match cache for raw responses, keyed by hash of serialized request.
+// Value is what the server sent : json for non streaming, SSE for streaming.
+// check is a second hash of the request, a key with another check misses.
+//
+// Two tiers:
+//   1. in-memory LRU limited by bytes
+//   2. optional append-only segment files mapped by mmap, survive restarts.
+//      The oldest segment is removed when there are more than max_segments
+class ResponseCache
+{
+public:
+	bool get(uint64_t key, uint64_t check, std::string& value);
+	void put(uint64_t key, uint64_t check, const std::string& value);
+
+	// load existing segments in dir and append new records to them
+	bool open(const std::string& dir, size_t segment_size,
+			  size_t max_segments = default_max_segments);
+	void close();
+
+public:
+	ResponseCache(size_t memory_limit);
+	ResponseCache() : ResponseCache(default_memory_limit) {}
+	~ResponseCache();
+
+	ResponseCache(const ResponseCache&) = delete;
+	ResponseCache& operator=(const ResponseCache&) = delete;
+
+	static constexpr size_t default_memory_limit = 64 * 1024 * 1024;
+	static constexpr size_t default_segment_size = 64 * 1024 * 1024;
+	static constexpr size_t default_max_segments = 16;
+
+private:
+	struct Segment
+	{
+		size_t id; // file name
+		char *base;
+		size_t size;
+	};
+
+	struct Location
+	{
+		size_t segment; // id
+		size_t offset; // of the value
+		size_t size;
+		uint64_t check;
+	};
+
+	struct LRUEntry
+	{
+		uint64_t key;
+		uint64_t check;
+		std::string value;
+	};
+
+	using LRUList = std::list<LRUEntry>;
+
+	void lru_put(uint64_t key, uint64_t check, const std::string& value);
+	bool disk_get(uint64_t key, uint64_t check, std::string& value);
+	void disk_put(uint64_t key, uint64_t check, const std::string& value);
+	bool open_segment(size_t id, bool create);
+	void scan_segment(const Segment& seg);
+	void drop_segment();
+
+private:
+	std::mutex mutex;
+
+	size_t memory_limit;
+	size_t memory_size;
+	LRUList lru;
+	std::unordered_map<uint64_t, LRUList::iterator> lru_map;
+
+	std::string dir;
+	size_t segment_size;
+	size_t max_segments;
+	size_t tail; // append offset in the last segment
+	std::deque<Segment> segments; // by id, no gap
+	std::unordered_map<uint64_t, Location> index;
+};
+
+} // namespace wfai
+
+#endif // LLM_CACHE_H
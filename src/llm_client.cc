@@ -1,4 +1,7 @@
+#include <errno.h>
 #include <stdint.h>
+#include <strings.h>
+#include <chrono>
 #include "workflow/HttpMessage.h"
 #include "workflow/HttpUtil.h"
 #include "workflow/WFTaskFactory.h"
@@ -7,6 +10,7 @@
 #include "workflow/Workflow.h"
 #include "workflow/WFFacilities.h"
 #include "workflow/WFFuture.h"
+#include "workflow/WFGlobal.h"
 #include "llm_client.h"
 #include "llm_session.h"
 
@@ -19,20 +23,129 @@ static constexpr uint32_t default_streaming_tpft = 1 * 1000; // ms
 static constexpr uint32_t default_no_streaming_ttft = 500 * 1000; // ms
 static constexpr uint32_t default_no_streaming_tpft = 100 * 1000; // ms
 static constexpr int default_redirect_max = 3;
+static constexpr size_t default_arena_size = 4096;
+static constexpr size_t default_max_pending_chunks = 0; // no flow control
+static constexpr size_t default_ring_capacity = 64;
+static constexpr int64_t min_key_wait = 1000; // us
+static constexpr int64_t max_key_wait = 1000 * 1000; // us, to see cancel
+
+static StreamInflater *create_inflater(const protocol::HttpMessage *msg)
+{
+	protocol::HttpHeaderCursor cursor(msg);
+	std::string value;
+
+	if (!cursor.find("Content-Encoding", value))
+		return nullptr;
+
+	if (strcasecmp(value.c_str(), "gzip") != 0 &&
+		strcasecmp(value.c_str(), "x-gzip") != 0 &&
+		strcasecmp(value.c_str(), "deflate") != 0)
+	{
+		return nullptr;
+	}
+
+	StreamInflater *inflater = new StreamInflater();
+	if (!inflater->init())
+	{
+		delete inflater;
+		return nullptr;
+	}
+
+	return inflater;
+}
+
+// number of "data: " events in SSE bytes, not less than chunks in it
+static size_t count_events(const std::string& sse)
+{
+	size_t n = 0;
+	size_t pos = 0;
+
+	while ((pos = sse.find("data: ", pos)) != std::string::npos)
+	{
+		pos += 6;
+		n++;
+	}
+
+	return n;
+}
+
+// for the response body which is not received by extract()
+static bool get_response_body(WFHttpChunkedTask *task,
+							  const void **body, size_t *len,
+							  std::string& inflated)
+{
+	if (!task->get_resp()->get_parsed_body(body, len))
+		return false;
+
+	StreamInflater *inflater = create_inflater(task->get_resp());
+	if (!inflater)
+		return true;
+
+	bool ret = inflater->inflate(*body, *len, inflated);
+	delete inflater;
+
+	*body = inflated.data();
+	*len = inflated.size();
+	return ret;
+}
+
+static inline int64_t get_current_time_us()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+static inline uint32_t estimate_tokens(const SessionContext *ctx)
+{
+	uint32_t tokens = ctx->req->estimate_tokens();
+
+	if (ctx->prepared)
+		tokens += ctx->prepared->prefix_tokens();
+
+	return tokens;
+}
+
+// objects of a request go to its arena if there is one
+template<class T>
+static inline T *ctx_new(Arena *arena)
+{
+	return arena ? arena->make<T>() : new T();
+}
+
+template<class T>
+static inline void ctx_delete(Arena *arena, T *obj)
+{
+	if (!arena)
+		delete obj;
+}
+
+// small enough for std::function to keep it without allocation
+template<void (LLMClient::*FUNC)(WFHttpChunkedTask *, SessionContext *)>
+struct TaskHandler
+{
+	LLMClient *client;
+	SessionContext *ctx;
+
+	void operator()(WFHttpChunkedTask *task) const
+	{
+		(this->client->*FUNC)(task, this->ctx);
+	}
+};
 
 // for tool calls execution, both single or parallel
 class ToolCallsData
 {
 public:
+	ToolCallsData() : arena(nullptr) { }
 
 	~ToolCallsData()
 	{
 		for (auto *result : results)
-			delete result;
+			ctx_delete(arena, result);
 	}
 
 public:
-	SessionContext *context;
+	Arena *arena;
 	std::vector<FunctionResult *> results;
 	std::vector<std::string> tool_call_ids;
 };
@@ -42,24 +155,42 @@ public:
 bool append_tool_call_from_chunk(const ChatCompletionChunk& chunk,
 								 ChatCompletionResponse *resp)
 {
-	if (resp->choices.empty()) // first time to mark
+	// choice may be made by append_chunk() already
+	if (resp->choices.empty())
+		resp->choices.emplace_back();
+
+	auto& tool_calls = resp->choices[0].message.tool_calls;
+	if (tool_calls.empty()) // first time to mark
 	{
-		ChatResponse::Choice choice;
-		choice.message.tool_calls.push_back(chunk.choices[0].delta.tool_calls[0]);
-		resp->choices.push_back(choice);
+		tool_calls.push_back(chunk.choices[0].delta.tool_calls[0]);
 		return true;
 	}
 
 	// not the first time
-	if (resp->choices[0].message.tool_calls.empty())
-		return false;
-
-	resp->choices[0].message.tool_calls[0].function.arguments +=
+	tool_calls[0].function.arguments +=
 		chunk.choices[0].delta.tool_calls[0].function.arguments;
 
 	return true;
 }
 
+// for async streaming
+// mark the last chunk before put, consumer may free it at any time after put
+static void async_streaming_put(SessionContext *ctx, ChatCompletionChunk *chunk)
+{
+	bool last = false;
+
+	if (!chunk->choices.empty() && !chunk->choices[0].finish_reason.empty())
+	{
+		chunk->set_last_chunk(true);
+		last = true;
+	}
+
+	ctx->async_msgqueue_put(chunk);
+
+	if (last)
+		ctx->async_msgqueue_finish();
+}
+
 LLMClient::LLMClient() :
 	LLMClient("", default_url)
 {
@@ -73,7 +204,8 @@ LLMClient::LLMClient(const std::string& api_key) :
 LLMClient::LLMClient(const std::string& api_key,
 					 const std::string& base_url) :
 	api_key(api_key),
-	base_url(base_url)
+	base_url(base_url),
+	auth_header(auth_str + api_key)
 {
 	this->redirect_max = default_redirect_max;
 	this->streaming_ttft = default_streaming_ttft;
@@ -81,53 +213,254 @@ LLMClient::LLMClient(const std::string& api_key,
 	this->ttft = default_no_streaming_ttft;
 	this->tpft = default_no_streaming_tpft;
 	this->function_manager = nullptr;
+	this->coalescing = false;
+	this->response_cache = nullptr;
+	this->similar_cache = nullptr;
+	this->adaptive_timeout = false;
+	this->compress_threshold = 0;
+	this->compress_level = Z_DEFAULT_COMPRESSION;
+	this->accept_encoding = false;
+	this->scheduler = nullptr;
+	this->key_pool = nullptr;
+	this->arena_size = default_arena_size;
+	this->max_pending_chunks = default_max_pending_chunks;
 }
 
 WFHttpChunkedTask *LLMClient::create_chat_task(ChatCompletionRequest& request,
 											   llm_extract_t extract,
 											   llm_callback_t callback)
 {
-	ChatCompletionRequest *req = new ChatCompletionRequest(request);
-	ChatCompletionResponse *resp = new ChatCompletionResponse();
+	return this->create_chat_task(ChatCompletionRequest(request),
+								  std::move(extract), std::move(callback));
+}
 
-	SessionContext *ctx = new SessionContext(
-		req, resp, std::move(extract), std::move(callback), true);
+WFHttpChunkedTask *LLMClient::create_chat_task(ChatCompletionRequest&& request,
+											   llm_extract_t extract,
+											   llm_callback_t callback)
+{
+	SessionContext *ctx = this->create_context(std::move(extract),
+											   std::move(callback));
+	*ctx->req = std::move(request);
 
-	return this->create(ctx);
+	this->cache_lookup(ctx, false); // task is always sent, only to store
+	return this->begin(this->create(ctx), ctx);
 }
 
-WFHttpChunkedTask *LLMClient::create(SessionContext *ctx)
+WFHttpChunkedTask *LLMClient::create_chat_task_batched(ChatCompletionRequest& request,
+													   llm_batch_extract_t extract,
+													   llm_callback_t callback)
 {
-	auto extract_handler = std::bind(
-		&LLMClient::extract,
-		this,
-		std::placeholders::_1,
-		ctx
-	);
+	return this->create_chat_task_batched(ChatCompletionRequest(request),
+										  std::move(extract),
+										  std::move(callback));
+}
+
+WFHttpChunkedTask *LLMClient::create_chat_task_batched(ChatCompletionRequest&& request,
+													   llm_batch_extract_t extract,
+													   llm_callback_t callback)
+{
+	SessionContext *ctx = this->create_context(nullptr, std::move(callback));
+	*ctx->req = std::move(request);
+	ctx->batch_extract = std::move(extract);
+
+	this->cache_lookup(ctx, false);
+	return this->begin(this->create(ctx), ctx);
+}
+
+WFHttpChunkedTask *LLMClient::create_chat_task(const PreparedChatRequest& prepared,
+											   const std::vector<Message>& messages,
+											   llm_extract_t extract,
+											   llm_callback_t callback)
+{
+	SessionContext *ctx = this->create_context(std::move(extract),
+											   std::move(callback));
+	prepared.make_request(*ctx->req);
+	ctx->req->messages = messages;
+	ctx->prepared = &prepared;
+
+	this->cache_lookup(ctx, false);
+	return this->begin(this->create(ctx), ctx);
+}
+
+SessionContext *LLMClient::create_context(llm_extract_t extract,
+										  llm_callback_t callback)
+{
+	if (this->arena_size == 0)
+	{
+		return new SessionContext(new ChatCompletionRequest(),
+								  new ChatCompletionResponse(),
+								  std::move(extract), std::move(callback),
+								  true);
+	}
+
+	Arena *arena = Arena::create(this->arena_size);
+	auto *req = arena->make<ChatCompletionRequest>();
+	auto *resp = arena->make<ChatCompletionResponse>();
+
+	// req and resp are released by arena
+	auto *ctx = arena->make<SessionContext>(req, resp,
+											std::move(extract),
+											std::move(callback),
+											false);
+	ctx->arena = arena;
+	return ctx;
+}
+
+// Runs hook with its series when started, which puts the chat task into
+// the series, so time in the scheduler queue is not taken as latency of
+// the server. Or the task is finished without sending and dismissed
+class DispatchTask : public WFGenericTask
+{
+public:
+	DispatchTask(std::function<void (SeriesWork *)> hook) :
+		hook(std::move(hook))
+	{
+	}
+
+protected:
+	virtual void dispatch()
+	{
+		this->hook(series_of(this));
+		this->state = WFT_STATE_SUCCESS;
+		this->WFGenericTask::dispatch();
+	}
+
+private:
+	std::function<void (SeriesWork *)> hook;
+};
+
+WFConditional *LLMClient::create_scheduled_chat_task(ChatCompletionRequest& request,
+													 llm_extract_t extract,
+													 llm_callback_t callback)
+{
+	return this->create_scheduled_chat_task(ChatCompletionRequest(request),
+											std::move(extract),
+											std::move(callback));
+}
+
+WFConditional *LLMClient::create_scheduled_chat_task(ChatCompletionRequest&& request,
+													 llm_extract_t extract,
+													 llm_callback_t callback)
+{
+	SessionContext *ctx = this->create_context(std::move(extract),
+											   std::move(callback));
+	WFHttpChunkedTask *task;
+	WFGenericTask *dispatch;
+
+	*ctx->req = std::move(request);
+	this->cache_lookup(ctx, false);
+	task = this->create(ctx);
+
+	// a hit skips the scheduler, and is replayed at dispatch with the
+	// chat task, which is never sent
+	if (ctx->cacheable && this->cache_get(ctx))
+	{
+		dispatch = new DispatchTask([this, task, ctx](SeriesWork *series) {
+			// callbacks may use series_of() of the task
+			task->set_pointer(series);
+			this->serve_cached(task, ctx);
+			task->dismiss();
+		});
+	}
+	else if (this->scheduler)
+		return static_cast<WFConditional *>(this->schedule(task, ctx));
+	else
+		dispatch = this->schedule(task, ctx);
+
+	WFConditional *cond = WFTaskFactory::create_conditional(dispatch);
+	cond->signal(nullptr);
+	return cond;
+}
+
+WFGenericTask *LLMClient::schedule(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	ChatCompletionRequest *req = ctx->req;
+	RequestScheduler *scheduler = this->scheduler;
+	AsyncResultPtr *result = ctx->get_async_result();
+	int64_t deadline = -1;
+	uint64_t ticket;
+	WFGenericTask *dispatch = new DispatchTask(
+		[this, task, ctx](SeriesWork *series) {
+			ctx->req->cancel.remove_hook(ctx->cancel_hook);
+			ctx->cancel_hook = 0;
+			this->begin_in(series, task, ctx);
+		});
+
+	if (!scheduler)
+		return dispatch;
+
+	if (req->deadline >= 0)
+		deadline = get_current_time_us() + (int64_t)req->deadline * 1000;
+
+	ctx->scheduled = true;
+	ctx->tenant = req->tenant; // req may be changed by tool calls
+
+	// a cancelled or abandoned one leaves the queue without a slot
+	WFConditional *cond =
+		scheduler->admit(dispatch, req->priority, deadline, ctx->tenant,
+						 estimate_tokens(ctx),
+		[ctx]() -> bool {
+			// a leader of duplicates is sorted out at dispatch
+			if (ctx->get_flight() ||
+				(!ctx->cancel_requested() && !ctx->is_abandoned()))
+			{
+				return false;
+			}
+
+			ctx->scheduled = false;
+			return true;
+		}, &ticket);
+
+	// at the time of cancel, not when it comes to the head of queue.
+	// nothing happens once it has got a slot. ctx may be gone by now
+	auto recheck = [scheduler, ticket]() { scheduler->recheck(ticket); };
+
+	if (result)
+		result->set_cancel_hook(recheck);
+
+	ctx->cancel_hook = req->cancel.add_hook(recheck);
+	return cond;
+}
 
+// cancelled or abandoned before sent, finished without the server
+bool LLMClient::cancel_unsent(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	if (ctx->get_flight())
+		this->detach_cancelled(task, ctx);
+
+	if (!ctx->cancel_requested() && !ctx->is_abandoned())
+		return false;
+
+	ctx->cancelled = true;
+	ctx->cacheable = false;
+	this->finish_cancel(task, ctx);
+	this->finish(task, ctx);
+	return true;
+}
+
+WFHttpChunkedTask *LLMClient::create(SessionContext *ctx)
+{
+	extract_t extract_handler = TaskHandler<&LLMClient::extract>{this, ctx};
 	callback_t callback_handler;
 
 	if (this->function_manager && ctx->req->tool_choice != "none")
 	{
-		auto tools = this->function_manager->get_functions();
-		for (const auto& tool : tools)
-			ctx->req->tools.emplace_back(tool);
+		// prepared request already has them
+		if (!ctx->prepared)
+		{
+			auto tools = this->function_manager->get_functions();
+			for (const auto& tool : tools)
+				ctx->req->tools.emplace_back(tool);
 
-		callback_handler = std::bind(
-			&LLMClient::callback_with_tools,
-			this,
-			std::placeholders::_1,
-			ctx
-		);
+			ctx->body.clear();
+		}
+
+		callback_handler =
+			TaskHandler<&LLMClient::callback_with_tools>{this, ctx};
 	}
 	else
 	{
-		callback_handler = std::bind(
-			&LLMClient::callback,
-			this,
-			std::placeholders::_1,
-			ctx
-		);
+		callback_handler = TaskHandler<&LLMClient::callback>{this, ctx};
 	}
 
 	auto *task = client.create_chunked_task(
@@ -137,39 +470,264 @@ WFHttpChunkedTask *LLMClient::create(SessionContext *ctx)
 		std::move(callback_handler)
 	);
 
-	if (ctx->req->stream)
-	{
-		task->set_watch_timeout(this->streaming_ttft);
-		task->set_recv_timeout(this->streaming_tpft);
-	}
-	else
-	{
-		task->set_watch_timeout(this->ttft);
-		task->set_recv_timeout(this->tpft);
-	}
+	this->set_timeout(task, ctx);
+	ctx->key_index = -1;
 
 	auto *http_req = task->get_req();
-	http_req->add_header_pair("Authorization", auth_str + this->api_key);
 	http_req->add_header_pair("Content-Type", "application/json");
 	http_req->add_header_pair("Connection", "keep-alive");
 	http_req->set_method("POST");
 
-	std::string body = ctx->req->to_json();
-	http_req->append_output_body(body.data(), body.size());
+	const std::string *body = &this->get_body(ctx);
+	std::string gz;
+
+	if (this->compress_threshold > 0 && body->size() >= this->compress_threshold)
+	{
+		if (gzip_compress(body->data(), body->size(), this->compress_level, gz))
+		{
+			http_req->add_header_pair("Content-Encoding", "gzip");
+			body = &gz;
+		}
+	}
+
+	if (this->accept_encoding)
+		http_req->add_header_pair("Accept-Encoding", "gzip, deflate");
+
+	// response of each round may be encoded differently
+	delete ctx->inflater;
+	ctx->inflater = nullptr;
+	ctx->encoding_checked = false;
+	ctx->partial.clear();
+
+	http_req->append_output_body(body->data(), body->size());
+	ctx->body.clear(); // req will be changed if there is next round
 
 	return task;
 }
 
+const std::string& LLMClient::get_body(SessionContext *ctx)
+{
+	if (ctx->body.empty())
+	{
+		if (ctx->prepared)
+			ctx->body = ctx->prepared->to_json(*ctx->req);
+		else
+			ctx->body = ctx->req->to_json();
+	}
+
+	return ctx->body;
+}
+
+void LLMClient::set_timeout(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	ChatCompletionRequest *req = ctx->req;
+	int watch = req->stream ? this->streaming_ttft : this->ttft;
+	int recv = req->stream ? this->streaming_tpft : this->tpft;
+
+	if (!ctx->latency)
+	{
+		ctx->latency = this->latency.get_stats(this->base_url,
+											   req->model, req->stream);
+	}
+
+	if (this->adaptive_timeout)
+	{
+		int timeout = this->latency.ttft_timeout(ctx->latency);
+		if (timeout > 0 && timeout < watch)
+			watch = timeout;
+
+		timeout = this->latency.tpot_timeout(ctx->latency);
+		if (timeout > 0 && timeout < recv)
+			recv = timeout;
+	}
+
+	if (req->ttft_timeout >= 0)
+		watch = req->ttft_timeout;
+
+	if (req->tpot_timeout >= 0)
+		recv = req->tpot_timeout;
+
+	task->set_watch_timeout(watch);
+	task->set_recv_timeout(recv);
+}
+
+WFHttpChunkedTask *LLMClient::begin(WFHttpChunkedTask *task,
+									SessionContext *ctx)
+{
+	std::string key;
+
+	// picked now, a key chosen before waiting in the scheduler may be
+	// throttled or out of budget by the time the request is sent
+	if (this->key_pool)
+	{
+		ctx->key_tokens = estimate_tokens(ctx);
+		ctx->key_index = this->key_pool->acquire(ctx->key_tokens, key);
+	}
+
+	this->set_key(task, ctx, key);
+	return task;
+}
+
+void LLMClient::begin_in(SeriesWork *series, WFHttpChunkedTask *task,
+						 SessionContext *ctx)
+{
+	int64_t wait = -1;
+	std::string key;
+
+	// callbacks run without sending may use series_of() of the task
+	task->set_pointer(series);
+	if (this->cancel_unsent(task, ctx))
+	{
+		task->dismiss();
+		return;
+	}
+
+	if (this->key_pool)
+	{
+		ctx->key_tokens = estimate_tokens(ctx);
+		ctx->key_index = this->key_pool->acquire(ctx->key_tokens, key, &wait);
+
+		// no key to be refused for sure, api_key is used if there is one
+		if (ctx->key_index < 0 && this->api_key.empty())
+		{
+			if (wait >= 0)
+			{
+				series->push_front(this->wait_key(task, ctx, wait));
+				return;
+			}
+
+			ctx->resp->state = RESPONSE_NO_KEY;
+			ctx->resp->error = "No usable API key";
+			this->finish(task, ctx);
+			task->dismiss();
+			return;
+		}
+	}
+
+	this->set_key(task, ctx, key);
+	series->push_front(task);
+}
+
+WFTimerTask *LLMClient::wait_key(WFHttpChunkedTask *task, SessionContext *ctx,
+								 int64_t wait_us)
+{
+	// wakes up at times to see a cancel
+	if (wait_us > max_key_wait)
+		wait_us = max_key_wait;
+	else if (wait_us < min_key_wait)
+		wait_us = min_key_wait;
+
+	return WFTaskFactory::create_timer_task((unsigned int)wait_us,
+		[this, task, ctx](WFTimerTask *timer) {
+			this->begin_in(series_of(timer), task, ctx);
+		});
+}
+
+void LLMClient::set_key(WFHttpChunkedTask *task, SessionContext *ctx,
+						const std::string& key)
+{
+	auto *http_req = task->get_req();
+
+	// never "Bearer " of an empty api_key instead of a key of pool
+	if (ctx->key_index >= 0)
+		http_req->add_header_pair("Authorization", auth_str + key);
+	else if (!this->key_pool || !this->api_key.empty())
+		http_req->add_header_pair("Authorization", this->auth_header);
+
+	ctx->start_time = get_current_time_us();
+	ctx->last_time = 0;
+}
+
+static int64_t header_to_int(const protocol::HttpMessage *msg,
+							 const char *name)
+{
+	protocol::HttpHeaderCursor cursor(msg);
+	std::string value;
+	char *end;
+
+	if (!cursor.find(name, value) || value.empty())
+		return -1;
+
+	long long n = strtoll(value.c_str(), &end, 10);
+	if (*end != '\0' || n < 0) // such as Retry-After of HTTP-date
+		return -1;
+
+	return n;
+}
+
+void LLMClient::release_key(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	protocol::HttpResponse *resp = task->get_resp();
+	int status_code = 0;
+	int retry_after = -1;
+	int used = ctx->resp->usage.total_tokens;
+
+	if (ctx->key_index < 0)
+		return;
+
+	if (ctx->cancelled)
+		status_code = 200; // not a fault of the key
+	else if (task->get_state() == WFT_STATE_SUCCESS)
+	{
+		status_code = atoi(resp->get_status_code());
+		retry_after = (int)header_to_int(resp, "Retry-After");
+
+		this->key_pool->update_remaining(ctx->key_index,
+			header_to_int(resp, "x-ratelimit-remaining-requests"),
+			header_to_int(resp, "x-ratelimit-remaining-tokens"));
+	}
+
+	this->key_pool->release(ctx->key_index, status_code, retry_after,
+							ctx->key_tokens, used > 0 ? used : 0);
+	ctx->key_index = -1;
+}
+
+void LLMClient::record_latency(SessionContext *ctx)
+{
+	int64_t now = get_current_time_us();
+
+	if (ctx->last_time == 0)
+		ctx->latency->add_ttft((now - ctx->start_time) / 1000);
+	else
+		ctx->latency->add_tpot((now - ctx->last_time) / 1000);
+
+	ctx->last_time = now;
+}
+
+// a body with Content-Length never reaches extract(), its TTFT is taken
+// here. a timeout is a sample too, at least as long as the timeout,
+// otherwise timeouts learned from fast responses would never grow again
+void LLMClient::record_done(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	if (ctx->cancelled)
+		return;
+
+	if (task->get_state() == WFT_STATE_SUCCESS)
+	{
+		if (ctx->last_time == 0)
+			this->record_latency(ctx);
+	}
+	else if (task->get_state() == WFT_STATE_SYS_ERROR &&
+			 task->get_error() == ETIMEDOUT)
+	{
+		this->record_latency(ctx);
+	}
+}
+
 void LLMClient::callback(WFHttpChunkedTask *task, SessionContext *ctx)
 {
 	const void *body;
 	size_t len;
+	std::string inflated;
+
+	this->extract_rest(task, ctx);
+	this->record_done(task, ctx);
 
 	if (task->get_state() == WFT_STATE_SUCCESS && !ctx->req->stream)
 	{
 		if (ctx->resp->buffer_empty())
 		{
-			task->get_resp()->get_parsed_body(&body, &len);
+			get_response_body(task, &body, &len, inflated);
 			ctx->resp->ChatResponse::parse_json((const char *)body, len);
 		}
 		else
@@ -177,10 +735,67 @@ void LLMClient::callback(WFHttpChunkedTask *task, SessionContext *ctx)
 	}
 	// TODO: if (!ret) set error
 
+	if (ctx->cancelled)
+		this->finish_cancel(task, ctx);
+
+	this->release_key(task, ctx);
+	this->finish(task, ctx);
+}
+
+WFHttpChunkedTask *LLMClient::create_or_join(SessionContext *ctx)
+{
+	if (this->coalescing)
+	{
+		Flight *flight = this->single_flight.join(this->get_body(ctx), ctx);
+		if (!flight)
+			return nullptr;
+
+		ctx->set_flight(flight);
+	}
+
+	return this->create(ctx);
+}
+
+void LLMClient::finish(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	Flight *flight = ctx->get_flight();
+
+	// whole message of streaming, before anyone sees resp
+	ctx->resp->flatten();
+
+	// let the next one go before running any callback
+	if (ctx->scheduled)
+	{
+		this->scheduler->release(ctx->tenant);
+		ctx->scheduled = false;
+	}
+
+	if (ctx->cacheable)
+		this->cache_store(task, ctx);
+
+	if (flight)
+	{
+		this->single_flight.leave(flight);
+
+		// waiters first, the callback of leader may move resp away
+		for (SessionContext *waiter : flight->waiters)
+		{
+			*waiter->resp = *ctx->resp;
+
+			if (waiter->callback)
+				waiter->callback(task, waiter->req, waiter->resp);
+
+			SessionContext::destroy(waiter);
+		}
+
+		ctx->set_flight(nullptr);
+		delete flight;
+	}
+
 	if (ctx->callback)
 		ctx->callback(task, ctx->req, ctx->resp);
 
-	delete ctx;
+	SessionContext::destroy(ctx);
 }
 
 void LLMClient::callback_with_tools(WFHttpChunkedTask *task,
@@ -190,17 +805,22 @@ void LLMClient::callback_with_tools(WFHttpChunkedTask *task,
 	ChatCompletionResponse *resp = ctx->resp;
 	const void *body;
 	size_t len;
+	std::string inflated;
 	bool ret = true; // TODO: let's take streaming parse_json return true
 
+	this->extract_rest(task, ctx);
+	this->record_done(task, ctx);
+
 	// for streaming:
-	// 	already parse chunk and fill resp in append_tool_call_from_chunk()
+	// 	already parse chunk and fill resp in append_tool_call_from_chunk(),
+	// 	texts are flattened by finish()
 	// for non streaming:
 	// 	need to parse resp here
 	if (task->get_state() == WFT_STATE_SUCCESS && !ctx->req->stream)
 	{
 		if (resp->buffer_empty())
 		{
-			task->get_resp()->get_parsed_body(&body, &len);
+			get_response_body(task, &body, &len, inflated);
 			ret = resp->ChatResponse::parse_json((const char *)body, len);
 		}
 		else
@@ -209,16 +829,19 @@ void LLMClient::callback_with_tools(WFHttpChunkedTask *task,
 		}
 	}
 
+	if (ctx->cancelled)
+		this->finish_cancel(task, ctx);
+
+	this->release_key(task, ctx);
+
 	// parse resp
-	if (task->get_state() != WFT_STATE_SUCCESS ||
+	if (ctx->cancelled ||
+		task->get_state() != WFT_STATE_SUCCESS ||
 		!ret ||
 		resp->choices.empty() ||
 		resp->choices[0].message.tool_calls.empty())
 	{
-		if (ctx->callback)
-			ctx->callback(task, req, resp);
-
-		delete ctx;
+		this->finish(task, ctx);
 		return;
 	}
 
@@ -235,15 +858,17 @@ void LLMClient::callback_with_tools(WFHttpChunkedTask *task,
 	req->tool_choice = "none";
 	req->tools.clear();
 
-	ToolCallsData *tc_data = new ToolCallsData();
+	ToolCallsData *tc_data = ctx_new<ToolCallsData>(ctx->arena);
 	bool mgr_ret = false;
 
+	tc_data->arena = ctx->arena;
+
 	// calculate
 	if (resp->choices[0].message.tool_calls.size() == 1)
 	{
 		const auto& tc = resp->choices[0].message.tool_calls[0];
 		// if (tc.type == "function")
-		FunctionResult *res = new FunctionResult();
+		FunctionResult *res = ctx_new<FunctionResult>(ctx->arena);
 		tc_data->results.push_back(res);
 		tc_data->tool_call_ids.push_back(tc.id);
 
@@ -283,171 +908,645 @@ void LLMClient::callback_with_tools(WFHttpChunkedTask *task,
 		// Create series for each tool call
 		for (const auto& tc : resp->choices[0].message.tool_calls)
 		{
-			FunctionResult *res = new FunctionResult();
-			tc_data->results.push_back(res);
-			tc_data->tool_call_ids.push_back(tc.id);
+			FunctionResult *res = ctx_new<FunctionResult>(ctx->arena);
+			tc_data->results.push_back(res);
+			tc_data->tool_call_ids.push_back(tc.id);
+
+			WFGoTask *go_task = this->function_manager->async_execute(
+				tc.function.name,
+				tc.function.arguments,
+				res);
+
+			if (go_task)
+			{
+				SeriesWork *series = Workflow::create_series_work(go_task, nullptr);
+				pwork->add_series(series);
+				mgr_ret = true;
+			}
+		}
+
+		if (mgr_ret)
+			series_of(task)->push_front(pwork);
+		else
+			pwork->dismiss();
+	}
+
+	if (!mgr_ret)
+	{
+		resp->state = RESPONSE_TOOLS_ERROR;
+		ctx_delete(ctx->arena, tc_data);
+		this->finish(task, ctx);
+	}
+}
+
+void LLMClient::p_tool_calls_callback(const ParallelWork *pwork,
+									  SessionContext *ctx)
+{
+	ToolCallsData *tc_data = static_cast<ToolCallsData *>(pwork->get_context());
+
+	// Add all tool call results to the request messages
+	for (size_t i = 0; i < tc_data->results.size(); ++i)
+	{
+		Message msg;
+		msg.role = "tool";
+		msg.tool_call_id = tc_data->tool_call_ids[i];
+		if (tc_data->results[i]->success)
+			msg.content = tc_data->results[i]->result;
+		else
+			msg.content = tc_data->results[i]->error_message;
+		ctx->req->messages.push_back(std::move(msg));
+	}
+
+	ctx->resp->clear(); // clear resp for next round
+
+	ctx_delete(ctx->arena, tc_data);
+	this->begin_in(series_of(pwork), this->create(ctx), ctx);
+}
+
+void LLMClient::tool_calls_callback(WFGoTask *task, SessionContext *ctx)
+{
+	ToolCallsData *tc_data = static_cast<ToolCallsData *>(task->user_data);
+//	if (!ctx || ctx->results.empty() || ctx->tool_call_ids.empty())
+//		return;
+
+	Message msg;
+	msg.role = "tool";
+	msg.tool_call_id = tc_data->tool_call_ids[0];
+	if (tc_data->results[0]->success)
+		msg.content = tc_data->results[0]->result;
+	else
+		msg.content = tc_data->results[0]->error_message;
+	ctx->req->messages.push_back(std::move(msg));
+
+	ctx->resp->clear(); // clear resp for next round
+
+	ctx_delete(ctx->arena, tc_data);
+	this->begin_in(series_of(task), this->create(ctx), ctx);
+}
+
+void LLMClient::extract(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	protocol::HttpMessageChunk *msg_chunk = task->get_chunk();
+	const void *msg;
+	size_t size;
+
+	if (!msg_chunk->get_chunk_data(&msg, &size))
+	{
+		// TODO : mark error : invalid chunk data
+		return;
+	}
+
+	if (this->check_cancel(task, ctx))
+		return;
+
+	this->record_latency(ctx);
+
+	if (!ctx->encoding_checked)
+	{
+		ctx->inflater = create_inflater(task->get_resp());
+		ctx->encoding_checked = true;
+	}
+
+	std::string inflated;
+	if (ctx->inflater)
+	{
+		if (!ctx->inflater->inflate(msg, size, inflated))
+		{
+			// nothing after it can be read, close the connection
+			task->get_resp()->set_size_limit(0);
+			ctx->resp->state = RESPONSE_FRAMEWORK_ERROR;
+			ctx->resp->error = "Invalid compressed data";
+			ctx->cacheable = false;
+			return;
+		}
+
+		msg = inflated.data();
+		size = inflated.size();
+		if (size == 0)
+			return;
+	}
+
+	if (ctx->cacheable)
+		ctx->cache_record.append(static_cast<const char *>(msg), size);
+
+	if (!ctx->req->stream)
+	{
+		ctx->resp->append_buffer(static_cast<const char*>(msg), size);
+
+		if (ctx->extract)
+			ctx->extract(task, ctx->req, nullptr); // not a chunk for no streaming
+	}
+	else if (ctx->inflater)
+		this->extract_events(task, ctx, static_cast<const char *>(msg), size);
+	else
+		this->extract_stream(task, ctx, static_cast<const char *>(msg), size);
+}
+
+void LLMClient::extract_events(WFHttpChunkedTask *task, SessionContext *ctx,
+							   const char *msg, size_t size)
+{
+	std::string& partial = ctx->partial;
+	size_t lf;
+	size_t crlf;
+	size_t end = 0;
+
+	partial.append(msg, size);
+
+	lf = partial.rfind("\n\n");
+	if (lf != std::string::npos)
+		end = lf + 2;
+
+	crlf = partial.rfind("\n\r\n");
+	if (crlf != std::string::npos && crlf + 3 > end)
+		end = crlf + 3;
+
+	if (end != 0)
+	{
+		this->extract_stream(task, ctx, partial.data(), end);
+		partial.erase(0, end);
+	}
+}
+
+void LLMClient::extract_rest(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	// the last event may not be followed by a blank line
+	if (!ctx->partial.empty() && !ctx->cancelled)
+		this->extract_stream(task, ctx, ctx->partial.data(), ctx->partial.size());
+
+	ctx->partial.clear();
+}
+
+bool LLMClient::check_cancel(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	if (ctx->get_flight())
+		this->detach_cancelled(task, ctx);
+
+	if (!ctx->cancelled && (ctx->cancel_requested() || ctx->overflowed))
+	{
+		// Workflow has no abort, but a message over its size limit
+		// fails the task and closes the connection, so server stops
+		task->get_resp()->set_size_limit(0);
+		ctx->cancelled = true;
+		ctx->cacheable = false;
+	}
+
+	return ctx->cancelled;
+}
+
+// nobody reads the response for this one of coalesced requests
+static bool participant_gone(SessionContext *ctx)
+{
+	AsyncResultPtr *result = ctx->get_async_result();
+
+	return ctx->cancel_requested() || ctx->overflowed ||
+		   (result && result->is_abandoned());
+}
+
+bool LLMClient::check_pending(SessionContext *ctx)
+{
+	AsyncResultPtr *result = ctx->get_async_result();
+
+	if (this->max_pending_chunks == 0 || ctx->overflowed)
+		return ctx->overflowed;
+
+	if (result->msg_queue_size() < this->max_pending_chunks ||
+		result->is_response_waited())
+	{
+		return false;
+	}
+
+	ctx->overflowed = true;
+	return true;
+}
+
+void LLMClient::detach_cancelled(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	Flight *flight = ctx->get_flight();
+	std::vector<SessionContext *> detached;
+
+	this->single_flight.detach(flight, participant_gone, detached);
+	for (SessionContext *waiter : detached)
+	{
+		ctx->resp->flatten();
+		*waiter->resp = *ctx->resp;
+		this->finish_detached(task, ctx, waiter);
+	}
+
+	if (!participant_gone(ctx))
+		return;
+
+	// a task going to be closed or handed over takes no more duplicates
+	this->single_flight.leave(flight);
+	if (flight->waiters.empty())
+	{
+		// cancelled as a single request from now on
+		ctx->set_flight(nullptr);
+		delete flight;
+		return;
+	}
+
+	SessionContext *waiter = flight->waiters.back();
+
+	flight->waiters.pop_back();
+	ctx->resp->flatten();
+	*waiter->resp = *ctx->resp;
+
+	// the task goes on for the waiter, ctx holds its user from now on
+	ctx->swap_user(waiter);
+	this->finish_detached(task, ctx, waiter);
+}
+
+void LLMClient::finish_detached(WFHttpChunkedTask *task,
+								SessionContext *leader, SessionContext *ctx)
+{
+	// for the usage generated so far
+	ctx->start_time = leader->start_time;
+	ctx->chunks = leader->chunks;
+	ctx->cancelled = true;
+	this->finish_cancel(task, ctx);
+
+	if (ctx->callback)
+		ctx->callback(task, ctx->req, ctx->resp);
+
+	SessionContext::destroy(ctx);
+}
+
+void LLMClient::finish_cancel(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	ChatCompletionRequest *req = ctx->req;
+	ChatCompletionResponse *resp = ctx->resp;
+	Usage& usage = resp->usage;
+
+	resp->state = ctx->overflowed ? RESPONSE_FLOW_CONTROL : RESPONSE_CANCELLED;
+	resp->error = ctx->overflowed ? "Too many chunks not taken" : "Cancelled";
+
+	// server sends usage at the end only, so estimate what was generated.
+	// nothing if it was never sent
+	if (usage.total_tokens == 0 && ctx->start_time != 0)
+	{
+		uint32_t max_tokens = req->max_tokens > 0 ? req->max_tokens : 0;
+
+		usage.prompt_tokens = (int)(req->estimate_tokens() - max_tokens);
+		usage.completion_tokens = ctx->chunks; // about one token each
+		usage.total_tokens = usage.prompt_tokens + usage.completion_tokens;
+	}
+
+	if (req->stream && (ctx->extract || ctx->batch_extract))
+	{
+		ChatCompletionChunk chunk;
+
+		chunk.state = resp->state;
+		chunk.usage = usage;
+		chunk.set_last_chunk(true);
+
+		if (ctx->batch_extract)
+			ctx->batch_extract(task, req, &chunk, 1);
+		else
+			ctx->extract(task, req, &chunk);
+	}
+}
+
+void LLMClient::extract_stream(WFHttpChunkedTask *task, SessionContext *ctx,
+							   const char *msg, size_t size)
+{
+	const char *p = msg;
+	const char *msg_end = p + size;
+	const char *begin;
+	const char *end;
+	size_t len;
+	size_t n = 0;
+
+	while (p < msg_end)
+	{
+		begin = strstr(p, "data: ");
+		if (!begin || begin >= msg_end)
+			break;
+
+		begin += 6;
+
+		end = strstr(begin, "data: "); // \r\n
+		end = (end && end < msg_end) ? end : msg_end;
+		p = end;
+
+		while (end > begin && (*(end - 1) == '\n' || *(end - 1) == '\r'))
+			--end;
+
+		len = end - begin;
+		if (len > 0)
+		{
+			if (task && this->check_cancel(task, ctx))
+				break;
 
-			WFGoTask *go_task = this->function_manager->async_execute(
-				tc.function.name,
-				tc.function.arguments,
-				res);
+			ChatCompletionChunk local;
+			ChatCompletionChunk *slot = &local;
 
-			if (go_task)
+			// reuse chunks of previous reads, no construction each time
+			if (ctx->batch_extract)
 			{
-				SeriesWork *series = Workflow::create_series_work(go_task, nullptr);
-				pwork->add_series(series);
+				if (n == ctx->chunk_batch.size())
+					ctx->chunk_batch.emplace_back();
+				else
+					ctx->chunk_batch[n].clear();
+
+				slot = &ctx->chunk_batch[n];
 			}
-		}
 
-		series_of(task)->push_front(pwork);
+			ChatCompletionChunk& chunk = *slot;
+			if (chunk.parse_json(begin, len))
+			{
+				ctx->chunks++;
+
+				if (!chunk.choices.empty() &&
+					!chunk.choices[0].delta.tool_calls.empty())
+				{
+					if (!append_tool_call_from_chunk(chunk, ctx->resp))
+					{
+						chunk.state = RESPONSE_FRAMEWORK_ERROR;
+					}
+				}
+
+				ctx->resp->append_chunk(chunk);
+
+				Flight *flight = ctx->get_flight();
+				if (flight)
+				{
+					// duplicates coming from now on would miss chunks
+					this->single_flight.leave(flight);
+
+					for (SessionContext *waiter : flight->waiters)
+					{
+						// a slow one is detached at the next chunk
+						if (waiter->is_async_streaming() &&
+							!this->check_pending(waiter))
+						{
+							async_streaming_put(waiter,
+								new ChatCompletionChunk(chunk));
+						}
+					}
+				}
+
+				if (ctx->batch_extract)
+				{
+					n++;
+				}
+				else if (ctx->extract)
+				{
+					ctx->extract(task, ctx->req, &chunk);
+				}
+				else if (ctx->is_async_streaming())
+				{
+					// created by async api and streaming mode. a replay
+					// is before the user, a slow one stops at next chunk
+					if (!task || !this->check_pending(ctx))
+					{
+						async_streaming_put(ctx,
+							new ChatCompletionChunk(std::move(chunk)));
+					}
+				}
+			}
+		}
 	}
 
-	if (!mgr_ret)
-	{
-		resp->state = RESPONSE_TOOLS_ERROR;
+	if (n != 0)
+		ctx->batch_extract(task, ctx->req, ctx->chunk_batch.data(), n);
+}
 
-		if (ctx->callback)
-			ctx->callback(task, req, resp);
+bool LLMClient::cache_lookup(SessionContext *ctx, bool replay)
+{
+	ChatCompletionRequest *req = ctx->req;
 
-		delete tc_data;
-		delete ctx;
+	// only deterministic requests, and local tools may change anything
+	if ((!this->response_cache && !this->similar_cache) ||
+		req->temperature != 0 ||
+		(this->function_manager && req->tool_choice != "none"))
+	{
+		return false;
 	}
+
+	const std::string& body = this->get_body(ctx);
+	ctx->cacheable = true;
+	ctx->cache_key = fnv1a_hash(body.data(), body.size());
+	ctx->cache_check = mix_hash(body.data(), body.size());
+
+	if (!replay || !this->cache_get(ctx))
+		return false;
+
+	this->cache_replay(nullptr, ctx);
+	return true;
 }
 
-void LLMClient::p_tool_calls_callback(const ParallelWork *pwork,
-									  SessionContext *ctx)
+bool LLMClient::cache_get(SessionContext *ctx)
 {
-	ToolCallsData *tc_data = static_cast<ToolCallsData *>(pwork->get_context());
+	ChatCompletionRequest *req = ctx->req;
+	std::string& record = ctx->cache_record;
 
-	// Add all tool call results to the request messages
-	for (size_t i = 0; i < tc_data->results.size(); ++i)
+	if (!this->response_cache ||
+		!this->response_cache->get(ctx->cache_key, ctx->cache_check, record))
 	{
-		Message msg;
-		msg.role = "tool";
-		msg.tool_call_id = tc_data->tool_call_ids[i];
-		if (tc_data->results[i]->success)
-			msg.content = tc_data->results[i]->result;
-		else
-			msg.content = tc_data->results[i]->error_message;
-		ctx->req->messages.push_back(std::move(msg));
+		// prepared req has no fixed messages to compare
+		if (!this->similar_cache || req->stream || ctx->prepared ||
+			!this->similar_cache->get(*req, *ctx->resp))
+		{
+			return false;
+		}
+
+		ctx->cacheable = false;
+		return true;
 	}
 
-	ctx->resp->clear(); // clear resp for next round
+	if (!req->stream &&
+		!ctx->resp->ChatResponse::parse_json(record.data(), record.size()))
+	{
+		ctx->resp->clear();
+		record.clear();
+		return false;
+	}
 
-	auto *next = this->create(ctx);
-	series_of(pwork)->push_front(next);
-	delete tc_data;
+	ctx->cacheable = false;
+	return true;
 }
 
-void LLMClient::tool_calls_callback(WFGoTask *task, SessionContext *ctx)
+void LLMClient::cache_replay(WFHttpChunkedTask *task, SessionContext *ctx)
 {
-	ToolCallsData *tc_data = static_cast<ToolCallsData *>(task->user_data);
-//	if (!ctx || ctx->results.empty() || ctx->tool_call_ids.empty())
-//		return;
+	std::string record;
 
-	Message msg;
-	msg.role = "tool";
-	msg.tool_call_id = tc_data->tool_call_ids[0];
-	if (tc_data->results[0]->success)
-		msg.content = tc_data->results[0]->result;
-	else
-		msg.content = tc_data->results[0]->error_message;
-	ctx->req->messages.push_back(std::move(msg));
+	record.swap(ctx->cache_record);
+	if (!ctx->req->stream)
+		return;
 
-	ctx->resp->clear(); // clear resp for next round
+	// replayed in caller thread before it can take any chunk,
+	// so the queue must be able to hold them all
+	if (ctx->is_async_streaming())
+		ctx->async_msgqueue_reserve(count_events(record) + 1);
 
-	auto *next = this->create(ctx);
-	series_of(task)->push_front(next);
-	delete tc_data;
+	this->extract_stream(task, ctx, record.data(), record.size());
+	// hits never reach callback(), which flattens a streamed one
+	ctx->resp->flatten();
+	ctx->resp->state = RESPONSE_SUCCESS;
 }
 
-void LLMClient::extract(WFHttpChunkedTask *task, SessionContext *ctx)
+void LLMClient::serve_cached(WFHttpChunkedTask *task, SessionContext *ctx)
 {
-	protocol::HttpMessageChunk *msg_chunk = task->get_chunk();
-	const void *msg;
-	size_t size;
+	if (this->cancel_unsent(task, ctx))
+		return;
 
-	if (!msg_chunk->get_chunk_data(&msg, &size))
+	this->cache_replay(task, ctx);
+	if (ctx->cancelled)
+		this->finish_cancel(task, ctx);
+
+	this->finish(task, ctx);
+}
+
+void LLMClient::cache_store(WFHttpChunkedTask *task, SessionContext *ctx)
+{
+	const void *body;
+	size_t len;
+	std::string inflated;
+
+	if (task->get_state() != WFT_STATE_SUCCESS ||
+		atoi(task->get_resp()->get_status_code()) != 200)
 	{
-		// TODO : mark error : invalid chunk data
 		return;
 	}
 
 	if (!ctx->req->stream)
 	{
-		ctx->resp->append_buffer(static_cast<const char*>(msg), size);
+		if (ctx->resp->state != RESPONSE_SUCCESS)
+			return;
 
-		if (ctx->extract)
-			ctx->extract(task, ctx->req, nullptr); // not a chunk for no streaming
+		if (ctx->cache_record.empty() &&
+			get_response_body(task, &body, &len, inflated))
+		{
+			ctx->cache_record.assign(static_cast<const char *>(body), len);
+		}
 	}
-	else
-	{
-		const char *p = static_cast<const char *>(msg);
-		const char *msg_end = p + size;
-		const char *begin;
-		const char *end;
-		size_t len;
 
-		while (p < msg_end)
-		{
-			begin = strstr(p, "data: ");
-			if (!begin || begin >= msg_end)
-				break;
+	if (this->response_cache && !ctx->cache_record.empty())
+	{
+		this->response_cache->put(ctx->cache_key, ctx->cache_check,
+								  ctx->cache_record);
+	}
 
-			begin += 6;
+	if (this->similar_cache && !ctx->req->stream && !ctx->prepared)
+		this->similar_cache->put(*ctx->req, *ctx->resp);
+}
 
-			end = strstr(begin, "data: "); // \r\n
-			end = end ? end : msg_end;
-			p = end;
+void LLMClient::set_function_manager(FunctionManager *manager)
+{
+	this->function_manager = manager;
+}
 
-			while (end > begin && (*(end - 1) == '\n' || *(end - 1) == '\r'))
-				--end;
+void LLMClient::set_request_coalescing(bool enable)
+{
+	this->coalescing = enable;
+}
 
-			len = end - begin;
-			if (len > 0)
-			{
-				ChatCompletionChunk chunk;
-				if (chunk.parse_json(begin, len))
-				{
-					if (!chunk.choices.empty() &&
-						!chunk.choices[0].delta.tool_calls.empty())
-					{
-						if (!append_tool_call_from_chunk(chunk, ctx->resp))
-						{
-							chunk.state = RESPONSE_FRAMEWORK_ERROR;
-						}
-					}
+void LLMClient::set_response_cache(ResponseCache *cache)
+{
+	this->response_cache = cache;
+}
 
-					if (ctx->extract)
-					{
-						ctx->extract(task, ctx->req, &chunk);
-					}
-					else if (ctx->is_async_streaming())
-					{
-						// created by async api and streaming mode
-						if (!chunk.choices.empty() &&
-							!chunk.choices[0].finish_reason.empty())
-						{
-							chunk.set_last_chunk(true);
-						}
+void LLMClient::set_similar_cache(SimilarCache *cache)
+{
+	this->similar_cache = cache;
+}
 
-						ChatCompletionChunk *msg =
-							new ChatCompletionChunk(std::move(chunk));
+void LLMClient::set_adaptive_timeout(bool enable)
+{
+	this->adaptive_timeout = enable;
+}
 
-						ctx->async_msgqueue_put(msg);
+ParallelWork *LLMClient::create_prewarm_work(int connections,
+											 parallel_callback_t callback)
+{
+	ParallelWork *pwork = Workflow::create_parallel_work(std::move(callback));
+	size_t pos = this->base_url.find("://");
+	std::string root;
+
+	// the root of the API server, only the connection matters
+	pos = this->base_url.find('/', pos == std::string::npos ? 0 : pos + 3);
+	root = this->base_url.substr(0, pos);
+	root += '/';
+
+	// concurrent requests can not share one connection in HTTP/1.1.
+	// no credential, nothing is counted by the server for a key
+	for (int i = 0; i < connections; i++)
+	{
+		auto *task = this->client.create_chunked_task(root,
+			this->redirect_max,
+			[](WFHttpChunkedTask *) { },
+			nullptr);
+		auto *http_req = task->get_req();
+
+		http_req->set_method("OPTIONS");
+		http_req->add_header_pair("Connection", "keep-alive");
+		task->set_watch_timeout(this->ttft);
 
-						if (msg->last_chunk() == true)
-							ctx->async_msgqueue_set_nonblock();
-					}
-				}
-			}
-		}
+		pwork->add_series(Workflow::create_series_work(task, nullptr));
 	}
+
+	return pwork;
 }
 
-void LLMClient::set_function_manager(FunctionManager *manager)
+void LLMClient::prewarm(int connections)
 {
-	this->function_manager = manager;
+	WFFacilities::WaitGroup wait_group(1);
+
+	auto *pwork = this->create_prewarm_work(connections,
+		[&wait_group](const ParallelWork *) { wait_group.done(); });
+
+	pwork->start();
+	wait_group.wait();
+}
+
+bool LLMClient::set_tls_session_cache(TLSSessionCache *cache)
+{
+	// the one SSL_CTX of all Workflow client tasks
+	return cache->attach(WFGlobal::get_ssl_client_ctx());
+}
+
+void LLMClient::set_request_compression(size_t threshold, int level)
+{
+	this->compress_threshold = threshold;
+	this->compress_level = level;
+}
+
+void LLMClient::set_response_compression(bool enable)
+{
+	this->accept_encoding = enable;
+}
+
+void LLMClient::set_scheduler(RequestScheduler *scheduler)
+{
+	this->scheduler = scheduler;
+}
+
+void LLMClient::set_api_key_pool(ApiKeyPool *pool)
+{
+	this->key_pool = pool;
+}
+
+void LLMClient::set_arena_size(size_t size)
+{
+	this->arena_size = size;
+}
+
+void LLMClient::set_max_pending_chunks(size_t n)
+{
+	this->max_pending_chunks = n;
+}
+
+PreparedChatRequest LLMClient::prepare(const ChatCompletionRequest& request) const
+{
+	if (!this->function_manager || request.tool_choice == "none")
+		return PreparedChatRequest(request);
+
+	ChatCompletionRequest req(request);
+	auto tools = this->function_manager->get_functions();
+	for (const auto& tool : tools)
+		req.tools.emplace_back(tool);
+
+	return PreparedChatRequest(req);
 }
 
 bool LLMClient::register_function(const FunctionDefinition& def,
@@ -463,7 +1562,27 @@ void LLMClient::sync_callback(WFHttpChunkedTask *task,
 {
 	SyncResult result;
 
-	if (task->get_state() != WFT_STATE_SUCCESS)
+	LLMClient::make_sync_result(task, resp, result);
+	promise->set_value(std::move(result));
+	delete promise;
+}
+
+void LLMClient::make_sync_result(WFHttpChunkedTask *task,
+								 ChatCompletionResponse *resp,
+								 SyncResult& result)
+{
+	if (resp->state == RESPONSE_CANCELLED)
+	{
+		result.success = false;
+		result.error_message = "Cancelled";
+		result.response = std::move(*resp); // for partial usage
+	}
+	else if (resp->state == RESPONSE_NO_KEY)
+	{
+		result.success = false;
+		result.error_message = resp->error;
+	}
+	else if (task->get_state() != WFT_STATE_SUCCESS)
 	{
 		result.success = false;
 		result.error_message = "Task execution failed. State: " +
@@ -487,13 +1606,141 @@ void LLMClient::sync_callback(WFHttpChunkedTask *task,
 			result.response = std::move(*resp); // must move if need resp after callback
 		}
 	}
-
-	promise->set_value(std::move(result));
-	delete promise;
 }
 
 SyncResult LLMClient::chat_completion_sync(ChatCompletionRequest& request,
 										   ChatCompletionResponse& response)
+{
+	return this->sync_request(&request, &response, nullptr);
+}
+
+SyncResult LLMClient::chat_completion_sync(const PreparedChatRequest& prepared,
+										   const std::vector<Message>& messages,
+										   ChatCompletionResponse& response)
+{
+	ChatCompletionRequest request;
+
+	prepared.make_request(request);
+	request.messages = messages;
+	return this->sync_request(&request, &response, &prepared);
+}
+
+struct wfai::ChatBatch
+{
+	std::vector<ChatCompletionRequest> *requests;
+	std::vector<SyncResult> results;
+	std::atomic<size_t> next;
+	std::atomic<size_t> finished;
+	batch_progress_t progress;
+};
+
+std::vector<SyncResult>
+LLMClient::chat_completion_batch(std::vector<ChatCompletionRequest>& requests,
+								 size_t concurrency,
+								 batch_progress_t progress)
+{
+	WFFacilities::WaitGroup wait_group(1);
+	ChatBatch batch;
+
+	if (requests.empty())
+		return std::vector<SyncResult>();
+
+	batch.requests = &requests;
+	batch.results.resize(requests.size());
+	batch.next = 0;
+	batch.finished = 0;
+	batch.progress = std::move(progress);
+
+	ParallelWork *pwork = Workflow::create_parallel_work(
+		[&wait_group](const ParallelWork *) { wait_group.done(); });
+
+	// each series is a slot of the window, running requests one by one
+	for (size_t i = 0; i < concurrency || i == 0; i++)
+	{
+		SeriesWork *series;
+
+		series = Workflow::create_series_work(WFTaskFactory::create_empty_task(),
+											  nullptr);
+		if (!this->batch_next(series, &batch))
+		{
+			series->dismiss();
+			break;
+		}
+
+		pwork->add_series(series);
+	}
+
+	pwork->start();
+	wait_group.wait();
+
+	return std::move(batch.results);
+}
+
+bool LLMClient::batch_next(SeriesWork *series, ChatBatch *batch)
+{
+	size_t total = batch->requests->size();
+	size_t i;
+
+	while ((i = batch->next++) < total)
+	{
+		auto cb_for_batch = std::bind(
+			&LLMClient::batch_callback,
+			this,
+			std::placeholders::_1,
+			std::placeholders::_3,
+			batch,
+			i
+		);
+
+		// resp is moved into result by callback, which deletes it
+		SessionContext *ctx = new SessionContext(&(*batch->requests)[i],
+												 new ChatCompletionResponse(),
+												 nullptr,
+												 std::move(cb_for_batch),
+												 false);
+
+		if (!this->cache_lookup(ctx, true))
+		{
+			WFHttpChunkedTask *task = this->create(ctx);
+			series->push_back(this->schedule(task, ctx));
+			return true;
+		}
+
+		SyncResult& result = batch->results[i];
+		result.success = true;
+		result.status_code = 200;
+		result.response = std::move(*ctx->resp);
+
+		delete ctx->resp;
+		SessionContext::destroy(ctx);
+
+		size_t finished = ++batch->finished;
+		if (batch->progress)
+			batch->progress(finished, total);
+	}
+
+	return false;
+}
+
+void LLMClient::batch_callback(WFHttpChunkedTask *task,
+							   ChatCompletionResponse *resp,
+							   ChatBatch *batch, size_t index)
+{
+	size_t total = batch->requests->size();
+
+	LLMClient::make_sync_result(task, resp, batch->results[index]);
+	delete resp;
+
+	size_t finished = ++batch->finished;
+	if (batch->progress)
+		batch->progress(finished, total);
+
+	this->batch_next(series_of(task), batch);
+}
+
+SyncResult LLMClient::sync_request(ChatCompletionRequest *req,
+								   ChatCompletionResponse *resp,
+								   const PreparedChatRequest *prepared)
 {
 	auto *promise = new WFPromise<SyncResult>();
 	auto future = promise->get_future();
@@ -507,16 +1754,30 @@ SyncResult LLMClient::chat_completion_sync(ChatCompletionRequest& request,
 		promise
 	);
 
-	SessionContext *ctx = new SessionContext(&request, &response,
+	SessionContext *ctx = new SessionContext(req, resp,
 											 nullptr, std::move(cb_for_sync),
 											 false);
+	ctx->prepared = prepared;
+
+	if (this->cache_lookup(ctx, true))
+	{
+		SyncResult result;
+		result.success = true;
+		result.status_code = 200;
+
+		delete promise;
+		SessionContext::destroy(ctx);
+		return result;
+	}
+
+	auto *task = this->create_or_join(ctx);
+	if (task)
+		this->schedule(task, ctx)->start();
 
-	auto *task = this->create(ctx);
-	task->start();
 	SyncResult result = future.get();
 
 	if (result.success)
-		response = std::move(result.response);
+		*resp = std::move(result.response);
 
 	return result;
 }
@@ -524,11 +1785,17 @@ SyncResult LLMClient::chat_completion_sync(ChatCompletionRequest& request,
 void LLMClient::async_callback(WFHttpChunkedTask *task,
 							   ChatCompletionRequest *req,
 							   ChatCompletionResponse *resp,
-							   SessionContext *ctx)
+							   AsyncResultPtr *result)
 {
-	AsyncResultPtr *result = ctx->get_async_result();
 
-	if (task->get_state() != WFT_STATE_SUCCESS)
+	if (resp->state == RESPONSE_CANCELLED ||
+		resp->state == RESPONSE_FLOW_CONTROL ||
+		resp->state == RESPONSE_NO_KEY)
+	{
+		result->set_success(false);
+		result->set_error_message(resp->error);
+	}
+	else if (task->get_state() != WFT_STATE_SUCCESS)
 	{
 		resp->state = RESPONSE_FRAMEWORK_ERROR;
 		result->set_success(false);
@@ -560,16 +1827,23 @@ void LLMClient::async_callback(WFHttpChunkedTask *task,
 	}
 
 	// user may waiting at get_chunk(), so use a chunk to send error
-	if (resp->state != RESPONSE_SUCCESS && ctx->is_async_streaming())
+	if (resp->state != RESPONSE_SUCCESS && result->is_streaming())
 	{
 		auto chunk = new ChatCompletionChunk();
 		chunk->state = resp->state;
+		chunk->usage = resp->usage;
+		chunk->set_last_chunk(true);
 		result->msg_queue_put(chunk);
 	}
 
+	// get_chunk() returns nullptr after the chunks left, even no last chunk
+	if (result->is_streaming())
+		result->msg_queue_finish();
+
 	// should this logic move inside AsyncResultPtr ?
 	result->get_promise()->set_value(std::move(resp));
 	delete result->get_promise();
+	result->set_done();
 	result->decref();
 }
 
@@ -578,29 +1852,46 @@ AsyncResult LLMClient::chat_completion_async(ChatCompletionRequest& request)
 	ChatCompletionResponse *response = new ChatCompletionResponse();
 	AsyncResult result;
 
+	// chunks over the ring wait in its overflow, see check_pending()
 	if (request.stream)
-	{
-		result.msg_queue_create(request.max_tokens + 2);
-	}
+		result.msg_queue_create(default_ring_capacity);
 
 	SessionContext *ctx = new SessionContext(&request, response,
 											 nullptr, nullptr,
 											 false);
 	ctx->set_async_result(&result);
 
+	if (this->cache_lookup(ctx, true))
+	{
+		AsyncResultPtr *ptr = ctx->get_async_result();
+
+		ptr->set_status_code(200);
+		ptr->set_success(true);
+		if (ptr->is_streaming())
+			ptr->msg_queue_finish();
+		ptr->get_promise()->set_value(response);
+		delete ptr->get_promise();
+		ptr->set_done();
+		ptr->decref();
+
+		SessionContext::destroy(ctx);
+		return result;
+	}
+
 	auto cb_for_async = std::bind(
 		&LLMClient::async_callback,
 		this,
 		std::placeholders::_1,
 		std::placeholders::_2,
 		std::placeholders::_3,
-		ctx // TODO: this is not straight forward, but easy to manage
+		ctx->get_async_result() // not ctx, a coalesced one may swap it
 	);
 
 	ctx->set_callback(std::move(cb_for_async));
 
-	auto *task = this->create(ctx);
-	task->start();
+	auto *task = this->create_or_join(ctx);
+	if (task)
+		this->schedule(task, ctx)->start();
 
 	return result;
 }
@@ -11,13 +11,29 @@
 #include "chat_request.h"
 #include "llm_session.h"
 #include "llm_function.h"
+#include "llm_singleflight.h"
+#include "llm_cache.h"
+#include "llm_similar_cache.h"
+#include "llm_latency.h"
+#include "llm_tls.h"
+#include "llm_compress.h"
+#include "llm_scheduler.h"
+#include "llm_keypool.h"
+#include "llm_arena.h"
 
 namespace wfai {
 
+struct ChatBatch;
+
+// called in Workflow threads after each request ends
+using batch_progress_t = std::function<void (size_t finished, size_t total)>;
+
 class LLMClient
 {
 public:
 	///// Asynchronous APIs /////
+	// Latency of a chat task is measured from its creation, start it
+	// at once. Scheduled tasks and other APIs measure from dispatch.
 
 	using extract_t = std::function<void (WFHttpChunkedTask *)>;
 	using callback_t = std::function<void (WFHttpChunkedTask *)>;
@@ -26,10 +42,51 @@ public:
 										llm_extract_t extract,
 										llm_callback_t callback);
 
+	// no copy of request, use request.history to share long conversation
+	WFHttpChunkedTask *create_chat_task(ChatCompletionRequest&& request,
+										llm_extract_t extract,
+										llm_callback_t callback);
+
+	// extract gets all chunks of each read at once, for streaming only
+	WFHttpChunkedTask *create_chat_task_batched(ChatCompletionRequest& request,
+												llm_batch_extract_t extract,
+												llm_callback_t callback);
+	WFHttpChunkedTask *create_chat_task_batched(ChatCompletionRequest&& request,
+												llm_batch_extract_t extract,
+												llm_callback_t callback);
+
+	// Same as above but admitted by the scheduler, start the conditional.
+	// Without scheduler, the chat task is wrapped and runs at once.
+	// A cache hit is replayed to extract and callback when started, the
+	// chat task passed is never sent : check resp->state, not the task
+	WFConditional *create_scheduled_chat_task(ChatCompletionRequest& request,
+											  llm_extract_t extract,
+											  llm_callback_t callback);
+	WFConditional *create_scheduled_chat_task(ChatCompletionRequest&& request,
+											  llm_extract_t extract,
+											  llm_callback_t callback);
+
+	// prepared must be alive until callback
+	WFHttpChunkedTask *create_chat_task(const PreparedChatRequest& prepared,
+										const std::vector<Message>& messages,
+										llm_extract_t extract,
+										llm_callback_t callback);
+
 	///// Synchronous APIs /////
 	SyncResult chat_completion_sync(ChatCompletionRequest& request,
 									ChatCompletionResponse& response);
 
+	SyncResult chat_completion_sync(const PreparedChatRequest& prepared,
+									const std::vector<Message>& messages,
+									ChatCompletionResponse& response);
+
+	// At most concurrency requests in flight, a new one starts when one
+	// ends. Results are in the order of requests. No coalescing in batch
+	std::vector<SyncResult>
+	chat_completion_batch(std::vector<ChatCompletionRequest>& requests,
+						  size_t concurrency,
+						  batch_progress_t progress = nullptr);
+
 	///// Asynchronous but blocking APIs /////
 	AsyncResult chat_completion_async(ChatCompletionRequest& request);
 
@@ -44,11 +101,140 @@ public:
 	bool register_function(const FunctionDefinition& function,
 						   FunctionHandler handler);
 
+	// Serialize the invariant part of request once, with functions
+	// from function manager. Messages of request are the fixed prefix
+	PreparedChatRequest prepare(const ChatCompletionRequest& request) const;
+
+	// Identical concurrent requests from sync / async APIs share one task.
+	// A cancelled one is finished alone, the task is closed when all are
+	void set_request_coalescing(bool enable);
+
+	// Responses of requests with temperature == 0 are stored in cache.
+	// Sync / async APIs and scheduled tasks are served from cache, streaming
+	// is replayed as chunks. Other task APIs are always sent, only to store
+	void set_response_cache(ResponseCache *cache);
+
+	// Optional near-duplicate tier after exact cache, non streaming only
+	void set_similar_cache(SimilarCache *cache);
+
+	// Derive timeouts from observed TTFT / TPOT of each model and endpoint.
+	// ChatCompletionRequest::ttft_timeout / tpot_timeout always take effect
+	void set_adaptive_timeout(bool enable);
+	LatencyTracker *get_latency_tracker() { return &this->latency; }
+
+	// Open connections to the server of base_url ahead of time, kept alive
+	// for requests. OPTIONS to the root of server without the API key
+	ParallelWork *create_prewarm_work(int connections,
+									  parallel_callback_t callback);
+	void prewarm(int connections); // blocking until all connected
+
+	// Resume TLS sessions, which can be loaded from a file by cache->load().
+	// Process wide : it is attached to WFGlobal::get_ssl_client_ctx(), the
+	// SSL_CTX of all Workflow client tasks, not only of any LLMClient
+	static bool set_tls_session_cache(TLSSessionCache *cache);
+
+	// gzip request body not less than threshold bytes, 0 to disable
+	void set_request_compression(size_t threshold, int level);
+	// send Accept-Encoding and inflate response chunk by chunk
+	void set_response_compression(bool enable);
+
+	// Sync / async APIs and scheduled tasks wait for a slot by priority
+	// deadline and tenant of request. Cache hits and coalesced waiters skip it
+	void set_scheduler(RequestScheduler *scheduler);
+
+	// Each request uses the key with most headroom instead of api_key,
+	// which is still used when no key in pool is usable. Without api_key,
+	// sync / async APIs, scheduled tasks and tool call rounds wait for a
+	// key cooling or out of budget, and end with RESPONSE_NO_KEY if none
+	// is enabled. A task of other task APIs is sent with the key to
+	// recover first, as it is started by the user
+	void set_api_key_pool(ApiKeyPool *pool);
+
+	// First block of the per-request arena of task APIs, which holds
+	// context, request, response and tool calls data. 0 to use new/delete
+	void set_arena_size(size_t size);
+
+	// Bound of async streaming, off by default (0) : when n chunks are
+	// not taken by get_chunk(), the stream is stopped and ends with a
+	// last chunk of RESPONSE_FLOW_CONTROL, so memory per stream stays
+	// bounded. Nothing ever waits for the consumer. A coalesced waiter is
+	// stopped alone, and a user waiting at get_response() is never stopped
+	void set_max_pending_chunks(size_t n);
+
 public:
 	WFHttpChunkedTask *create(SessionContext *ctx);
 
+	// for task APIs, req and resp are owned by ctx
+	SessionContext *create_context(llm_extract_t extract,
+								   llm_callback_t callback);
+
+	const std::string& get_body(SessionContext *ctx);
+
+	// return nullptr if ctx is attached to an in-flight duplicate
+	WFHttpChunkedTask *create_or_join(SessionContext *ctx);
+
+	// the task to start, the chat task runs after begin() in its series,
+	// once admitted if there is a scheduler
+	WFGenericTask *schedule(WFHttpChunkedTask *task, SessionContext *ctx);
+
+	void finish(WFHttpChunkedTask *task, SessionContext *ctx);
+
+	void set_timeout(WFHttpChunkedTask *task, SessionContext *ctx);
+	// the task is about to start, the key is picked and latency is
+	// measured from here
+	WFHttpChunkedTask *begin(WFHttpChunkedTask *task, SessionContext *ctx);
+	// as begin() for the task to run next in series, which waits in a
+	// timer before it while no key is usable. A task cancelled or with
+	// no key ever is finished without sending and dismissed
+	void begin_in(SeriesWork *series, WFHttpChunkedTask *task,
+				  SessionContext *ctx);
+	WFTimerTask *wait_key(WFHttpChunkedTask *task, SessionContext *ctx,
+						  int64_t wait_us);
+	void set_key(WFHttpChunkedTask *task, SessionContext *ctx,
+				 const std::string& key);
+	void release_key(WFHttpChunkedTask *task, SessionContext *ctx);
+	void record_latency(SessionContext *ctx);
+	void record_done(WFHttpChunkedTask *task, SessionContext *ctx);
+
 	void extract(WFHttpChunkedTask *task, SessionContext *ctx);
 
+	// true if cancelled, the connection is closed at the next read.
+	// called for each chunk only, nothing can interrupt a read
+	bool check_cancel(WFHttpChunkedTask *task, SessionContext *ctx);
+	// true if the async stream of ctx has max_pending_chunks not taken,
+	// then it is stopped as cancelled with RESPONSE_FLOW_CONTROL
+	bool check_pending(SessionContext *ctx);
+	// state, partial usage and the last chunk for a cancelled one
+	void finish_cancel(WFHttpChunkedTask *task, SessionContext *ctx);
+	// true if cancelled before the task is started, ctx is finished
+	bool cancel_unsent(WFHttpChunkedTask *task, SessionContext *ctx);
+	// coalesced requests cancel one by one : a cancelled waiter is
+	// finished alone, a cancelled leader gives its task to a waiter.
+	// the flight is removed when the leader is the last one left
+	void detach_cancelled(WFHttpChunkedTask *task, SessionContext *ctx);
+	// ctx, out of the flight of leader, finished as cancelled
+	void finish_detached(WFHttpChunkedTask *task, SessionContext *leader,
+						 SessionContext *ctx);
+
+	// task is nullptr when replayed from cache in the caller thread
+	void extract_stream(WFHttpChunkedTask *task, SessionContext *ctx,
+						const char *msg, size_t size);
+	// inflated blocks do not end at events, the tail after the last blank
+	// line waits in ctx->partial for the next read, or the end of task
+	void extract_events(WFHttpChunkedTask *task, SessionContext *ctx,
+						const char *msg, size_t size);
+	void extract_rest(WFHttpChunkedTask *task, SessionContext *ctx);
+
+	bool cache_lookup(SessionContext *ctx, bool replay);
+	// true if hit, the record is in ctx->cache_record to be replayed,
+	// or resp is filled by the similar cache
+	bool cache_get(SessionContext *ctx);
+	// task is nullptr when replayed in the caller thread
+	void cache_replay(WFHttpChunkedTask *task, SessionContext *ctx);
+	// a hit of scheduled task, ctx is finished with the unsent task
+	void serve_cached(WFHttpChunkedTask *task, SessionContext *ctx);
+	void cache_store(WFHttpChunkedTask *task, SessionContext *ctx);
+
 	void callback(WFHttpChunkedTask *task, SessionContext *ctx);
 
 	void callback_with_tools(WFHttpChunkedTask *task, SessionContext *ctx);
@@ -56,6 +242,21 @@ public:
 	void tool_calls_callback(WFGoTask *task, SessionContext *ctx);
 	void p_tool_calls_callback(const ParallelWork *pwork, SessionContext *ctx);
 
+	SyncResult sync_request(ChatCompletionRequest *req,
+							ChatCompletionResponse *resp,
+							const PreparedChatRequest *prepared);
+
+	// moves resp into result when succeeded
+	static void make_sync_result(WFHttpChunkedTask *task,
+								 ChatCompletionResponse *resp,
+								 SyncResult& result);
+
+	// push the next request of batch into series, false if none left
+	bool batch_next(SeriesWork *series, ChatBatch *batch);
+	void batch_callback(WFHttpChunkedTask *task,
+						ChatCompletionResponse *resp,
+						ChatBatch *batch, size_t index);
+
 	void sync_callback(WFHttpChunkedTask *task,
 					   ChatCompletionRequest *req,
 					   ChatCompletionResponse *resp,
@@ -64,18 +265,32 @@ public:
 	void async_callback(WFHttpChunkedTask *task,
 						ChatCompletionRequest *req,
 						ChatCompletionResponse *resp,
-						SessionContext *ctx);
+						AsyncResultPtr *result);
 
 private:
 	WFHttpChunkedClient client;
 	std::string api_key;
 	std::string base_url;
+	std::string auth_header; // "Bearer " + api_key
 	int ttft; // time to first token (seconds)
 	int tpft; // time per output token (seconds)
 	int streaming_ttft;
 	int streaming_tpft;
 	int redirect_max;
 	FunctionManager *function_manager;
+	bool coalescing;
+	SingleFlight single_flight;
+	ResponseCache *response_cache;
+	SimilarCache *similar_cache;
+	bool adaptive_timeout;
+	LatencyTracker latency;
+	size_t compress_threshold;
+	int compress_level;
+	bool accept_encoding;
+	RequestScheduler *scheduler;
+	ApiKeyPool *key_pool;
+	size_t arena_size;
+	size_t max_pending_chunks;
 };
 
 } // namespace llm_client
@@ -0,0 +1,86 @@
+#include <string.h>
+#include "llm_compress.h"
+
+#define INFLATE_BUFFER_SIZE	16384
+
+namespace wfai {
+
+bool gzip_compress(const void *data, size_t size, int level, std::string& out)
+{
+	z_stream stream;
+
+	memset(&stream, 0, sizeof stream);
+	// 15 + 16 : max window with gzip wrapper
+	if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+					 Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+
+	out.resize(deflateBound(&stream, size) + 32);
+	stream.next_in = (Bytef *)data;
+	stream.avail_in = size;
+	stream.next_out = (Bytef *)&out[0];
+	stream.avail_out = out.size();
+
+	int ret = deflate(&stream, Z_FINISH);
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+
+	return ret == Z_STREAM_END;
+}
+
+bool StreamInflater::init()
+{
+	memset(&this->stream, 0, sizeof this->stream);
+	// 15 + 32 : max window and detect gzip or zlib wrapper
+	if (inflateInit2(&this->stream, 15 + 32) != Z_OK)
+		return false;
+
+	this->inited = true;
+	this->finished = false;
+	return true;
+}
+
+StreamInflater::~StreamInflater()
+{
+	if (this->inited)
+		inflateEnd(&this->stream);
+}
+
+bool StreamInflater::inflate(const void *data, size_t size, std::string& out)
+{
+	char buf[INFLATE_BUFFER_SIZE];
+	int ret;
+
+	if (!this->inited || this->finished)
+		return size == 0;
+
+	this->stream.next_in = (Bytef *)data;
+	this->stream.avail_in = size;
+
+	do
+	{
+		this->stream.next_out = (Bytef *)buf;
+		this->stream.avail_out = sizeof buf;
+
+		ret = ::inflate(&this->stream, Z_NO_FLUSH);
+		if (ret == Z_BUF_ERROR) // no progress, wait for more input
+			break;
+
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			return false;
+
+		out.append(buf, sizeof buf - this->stream.avail_out);
+
+		if (ret == Z_STREAM_END)
+		{
+			this->finished = true;
+			break;
+		}
+	} while (this->stream.avail_out == 0 || this->stream.avail_in > 0);
+
+	return true;
+}
+
+} // namespace wfai
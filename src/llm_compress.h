@@ -0,0 +1,34 @@
+#ifndef LLM_COMPRESS_H
+#define LLM_COMPRESS_H
+
+#include <string>
+#include <zlib.h>
+
+namespace wfai {
+
+// compress whole request body with gzip wrapper
+bool gzip_compress(const void *data, size_t size, int level, std::string& out);
+
+// Incremental decompression for Content-Encoding : gzip or deflate.
+// Each piece of input is inflated as soon as it arrives.
+class StreamInflater
+{
+public:
+	bool init();
+	bool inflate(const void *data, size_t size, std::string& out);
+
+	StreamInflater() : inited(false), finished(false) {}
+	~StreamInflater();
+
+	StreamInflater(const StreamInflater&) = delete;
+	StreamInflater& operator=(const StreamInflater&) = delete;
+
+private:
+	z_stream stream;
+	bool inited;
+	bool finished;
+};
+
+} // namespace wfai
+
+#endif // LLM_COMPRESS_H
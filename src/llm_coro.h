@@ -0,0 +1,480 @@
+#ifndef LLM_CORO_H
+#define LLM_CORO_H
+
+// Optional coroutine layer, only available when compiled as C++20.
+// Coroutines are resumed right inside Workflow callbacks, so do not
+// block in them, and keep request / client alive until resumed.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <optional>
+#include <utility>
+#include <type_traits>
+#include "workflow/WFTaskFactory.h"
+#include "llm_client.h"
+#include "llm_function.h"
+
+namespace wfai {
+
+namespace coro_detail {
+
+struct PromiseBase
+{
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+	bool detached = false;
+
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept { return false; }
+
+		template<class PROMISE>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<PROMISE> h) noexcept
+		{
+			PromiseBase& p = h.promise();
+
+			if (p.continuation)
+				return p.continuation;
+
+			if (p.detached)
+				h.destroy();
+
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept { }
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception()
+	{
+		if (this->detached)
+			std::terminate(); // nobody to rethrow to
+
+		this->exception = std::current_exception();
+	}
+};
+
+template<class T>
+struct Promise : PromiseBase
+{
+	std::optional<T> value;
+
+	template<class U>
+	void return_value(U&& v) { this->value.emplace(std::forward<U>(v)); }
+};
+
+template<>
+struct Promise<void> : PromiseBase
+{
+	void return_void() { }
+};
+
+} // namespace coro_detail
+
+// Lazy coroutine, runs when awaited, or by detach() / sync_wait()
+template<class T = void>
+class CoTask
+{
+public:
+	struct promise_type : coro_detail::Promise<T>
+	{
+		CoTask get_return_object()
+		{
+			return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+	};
+
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		this->coro.promise().continuation = h;
+		return this->coro;
+	}
+
+	T await_resume()
+	{
+		auto& p = this->coro.promise();
+
+		if (p.exception)
+			std::rethrow_exception(p.exception);
+
+		if constexpr (!std::is_void_v<T>)
+			return std::move(*p.value);
+	}
+
+	// start it, the frame is freed when it ends
+	void detach()
+	{
+		handle_type h = std::exchange(this->coro, nullptr);
+
+		h.promise().detached = true;
+		h.resume();
+	}
+
+public:
+	CoTask(CoTask&& move) noexcept : coro(std::exchange(move.coro, nullptr)) { }
+
+	CoTask& operator=(CoTask&& move) noexcept
+	{
+		if (this != &move)
+		{
+			if (this->coro)
+				this->coro.destroy();
+
+			this->coro = std::exchange(move.coro, nullptr);
+		}
+
+		return *this;
+	}
+
+	~CoTask()
+	{
+		if (this->coro)
+			this->coro.destroy();
+	}
+
+private:
+	explicit CoTask(handle_type h) : coro(h) { }
+
+	handle_type coro;
+};
+
+// block current thread until task ends, never call it in a callback
+template<class T>
+T sync_wait(CoTask<T> task)
+{
+	std::promise<void> done;
+	std::optional<std::conditional_t<std::is_void_v<T>, char, T>> value;
+	std::exception_ptr exception;
+
+	auto wrapper = [&]() -> CoTask<void> {
+		try
+		{
+			if constexpr (std::is_void_v<T>)
+				co_await std::move(task);
+			else
+				value.emplace(co_await std::move(task));
+		}
+		catch (...)
+		{
+			exception = std::current_exception();
+		}
+
+		done.set_value();
+	};
+
+	std::future<void> future = done.get_future();
+	wrapper().detach();
+	future.wait();
+
+	if (exception)
+		std::rethrow_exception(exception);
+
+	if constexpr (!std::is_void_v<T>)
+		return std::move(*value);
+}
+
+// co_await co_chat_completion(client, request) : SyncResult
+class ChatAwaiter
+{
+public:
+	ChatAwaiter(LLMClient *client, ChatCompletionRequest&& request) :
+		client(client), request(std::move(request))
+	{
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		auto *task = this->client->create_chat_task(std::move(this->request),
+			nullptr,
+			[this, h](WFHttpChunkedTask *task, ChatCompletionRequest *,
+					  ChatCompletionResponse *resp)
+			{
+				LLMClient::make_sync_result(task, resp, this->result);
+				h.resume();
+			});
+
+		task->start();
+	}
+
+	SyncResult await_resume() { return std::move(this->result); }
+
+private:
+	LLMClient *client;
+	ChatCompletionRequest request;
+	SyncResult result;
+};
+
+inline ChatAwaiter co_chat_completion(LLMClient& client,
+									  ChatCompletionRequest request)
+{
+	return ChatAwaiter(&client, std::move(request));
+}
+
+// Items pushed from callbacks, taken by co_await next() in a coroutine.
+// A waiting consumer is resumed directly by push() or finish(), so items
+// pile up only while it is suspended somewhere else. Then push() waits
+// when capacity items are not taken, which holds the producer's thread.
+// The generator is the consumer, producer() gives handles for callbacks,
+// and push() drops items once the generator is gone.
+template<class T>
+class AsyncGenerator
+{
+protected:
+	struct State
+	{
+		std::mutex mutex;
+		std::condition_variable space;
+		std::deque<T> items;
+		size_t capacity;
+		bool finished = false;
+		bool abandoned = false;
+		std::coroutine_handle<> waiter;
+	};
+
+public:
+	class NextAwaiter
+	{
+	public:
+		bool await_ready()
+		{
+			std::lock_guard<std::mutex> lock(this->state->mutex);
+			return !this->state->items.empty() || this->state->finished;
+		}
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			std::lock_guard<std::mutex> lock(this->state->mutex);
+
+			// may be pushed between await_ready() and here
+			if (!this->state->items.empty() || this->state->finished)
+				return false;
+
+			this->state->waiter = h;
+			return true;
+		}
+
+		// nullptr when finished, valid until the next next()
+		T *await_resume()
+		{
+			{
+				std::lock_guard<std::mutex> lock(this->state->mutex);
+
+				if (this->state->items.empty())
+					return nullptr;
+
+				*this->current = std::move(this->state->items.front());
+				this->state->items.pop_front();
+			}
+
+			this->state->space.notify_one();
+			return this->current;
+		}
+
+	private:
+		NextAwaiter(State *state, T *current) :
+			state(state), current(current)
+		{
+		}
+
+		State *state;
+		T *current;
+
+		friend class AsyncGenerator;
+	};
+
+	class Producer
+	{
+	public:
+		// from any thread, may resume the consumer in it
+		void push(T&& item)
+		{
+			std::coroutine_handle<> h;
+
+			{
+				std::unique_lock<std::mutex> lock(this->state->mutex);
+
+				while (this->state->items.size() >= this->state->capacity &&
+					   !this->state->abandoned)
+				{
+					this->state->space.wait(lock);
+				}
+
+				if (this->state->abandoned)
+					return;
+
+				this->state->items.push_back(std::move(item));
+				h = std::exchange(this->state->waiter, nullptr);
+			}
+
+			if (h)
+				h.resume();
+		}
+
+		void finish()
+		{
+			std::coroutine_handle<> h;
+
+			{
+				std::lock_guard<std::mutex> lock(this->state->mutex);
+				this->state->finished = true;
+				h = std::exchange(this->state->waiter, nullptr);
+			}
+
+			if (h)
+				h.resume();
+		}
+
+	private:
+		explicit Producer(std::shared_ptr<State> state) :
+			state(std::move(state))
+		{
+		}
+
+		std::shared_ptr<State> state;
+
+		friend class AsyncGenerator;
+	};
+
+	NextAwaiter next() { return NextAwaiter(this->state.get(), &this->current); }
+
+	Producer producer() const { return Producer(this->state); }
+
+public:
+	explicit AsyncGenerator(size_t capacity) :
+		state(std::make_shared<State>())
+	{
+		this->state->capacity = capacity > 0 ? capacity : 1;
+	}
+
+	AsyncGenerator() : AsyncGenerator(default_capacity) { }
+
+	AsyncGenerator(AsyncGenerator&& move) = default;
+	AsyncGenerator& operator=(AsyncGenerator&& move) = delete;
+
+	~AsyncGenerator()
+	{
+		if (!this->state)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(this->state->mutex);
+			this->state->abandoned = true;
+			this->state->items.clear();
+		}
+
+		this->state->space.notify_all();
+	}
+
+	static constexpr size_t default_capacity = 64;
+
+protected:
+	std::shared_ptr<State> state;
+	T current;
+};
+
+// Streaming chat : while (auto *chunk = co_await stream.next()) { ... }
+class ChatStream : public AsyncGenerator<ChatCompletionChunk>
+{
+public:
+	// valid after next() returned nullptr
+	const SyncResult& result() const { return *this->sync_result; }
+
+	ChatStream() : sync_result(std::make_shared<SyncResult>()) { }
+
+private:
+	std::shared_ptr<SyncResult> sync_result;
+
+	friend ChatStream co_chat_stream(LLMClient& client,
+									 ChatCompletionRequest request);
+};
+
+// the request is started at once, chunks are kept until taken, up to
+// default_capacity before the producer waits
+inline ChatStream co_chat_stream(LLMClient& client,
+								 ChatCompletionRequest request)
+{
+	ChatStream stream;
+	ChatStream::Producer producer = stream.producer();
+	std::shared_ptr<SyncResult> sync_result = stream.sync_result;
+
+	request.stream = true;
+
+	auto *task = client.create_chat_task(std::move(request),
+		[producer](WFHttpChunkedTask *, ChatCompletionRequest *,
+				   ChatCompletionChunk *chunk) mutable
+		{
+			if (chunk)
+				producer.push(std::move(*chunk));
+		},
+		[producer, sync_result](WFHttpChunkedTask *task,
+								ChatCompletionRequest *,
+								ChatCompletionResponse *resp) mutable
+		{
+			LLMClient::make_sync_result(task, resp, *sync_result);
+			producer.finish();
+		});
+
+	task->start();
+	return stream;
+}
+
+// co_await co_execute(manager, name, arguments) : FunctionResult
+class FunctionAwaiter
+{
+public:
+	FunctionAwaiter(const FunctionManager *manager,
+					std::string name, std::string arguments) :
+		manager(manager), name(std::move(name)), arguments(std::move(arguments))
+	{
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		WFGoTask *task = this->manager->async_execute(this->name,
+													  this->arguments,
+													  &this->result);
+		if (!task)
+			return false; // result has the error already
+
+		task->set_callback([h](WFGoTask *) { h.resume(); });
+		task->start();
+		return true;
+	}
+
+	FunctionResult await_resume() { return std::move(this->result); }
+
+private:
+	const FunctionManager *manager;
+	std::string name;
+	std::string arguments;
+	FunctionResult result;
+};
+
+inline FunctionAwaiter co_execute(const FunctionManager& manager,
+								  std::string name, std::string arguments)
+{
+	return FunctionAwaiter(&manager, std::move(name), std::move(arguments));
+}
+
+} // namespace wfai
+
+#endif // C++20
+
+#endif // LLM_CORO_H
@@ -0,0 +1,1008 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <unordered_set>
+#include "llm_util.h"
+#include "llm_disk_memory.h"
+
+#define MEMORY_RECORD_MAGIC	0x4d454d57	// "WMEM"
+#define MEMORY_ALIGN(n)		(((n) + 7) & ~((size_t)7))
+
+namespace wfai {
+
+constexpr size_t DiskMemory::default_segment_size;
+
+enum
+{
+	MEMORY_OP_APPEND	= 1,	// a message with its seq
+	MEMORY_OP_POP		= 2,	// kill the message of seq
+	MEMORY_OP_CLEAR		= 3,	// kill messages of session before seq
+};
+
+// payload follows, padded to 8 bytes. written at once with payload,
+// so a torn record fails the checksum
+struct MemoryRecord
+{
+	uint32_t magic;
+	uint32_t size; // of payload
+	uint64_t checksum;
+};
+
+static int64_t get_current_time_us()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+static std::string segment_path(const std::string& dir, size_t index)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%06zu.mem", index);
+	return dir + name;
+}
+
+///// encoding, all little things are length prefixed /////
+
+static void put_u32(std::string& buf, uint32_t v)
+{
+	buf.append((const char *)&v, sizeof v);
+}
+
+static void put_u64(std::string& buf, uint64_t v)
+{
+	buf.append((const char *)&v, sizeof v);
+}
+
+static void put_str(std::string& buf, const std::string& s)
+{
+	put_u32(buf, (uint32_t)s.size());
+	buf.append(s);
+}
+
+struct Reader
+{
+	const char *p;
+	const char *end;
+
+	bool get(void *v, size_t n)
+	{
+		if ((size_t)(this->end - this->p) < n)
+			return false;
+
+		memcpy(v, this->p, n);
+		this->p += n;
+		return true;
+	}
+
+	bool get_str(std::string& s)
+	{
+		uint32_t n;
+
+		if (!this->get(&n, sizeof n) || (size_t)(this->end - this->p) < n)
+			return false;
+
+		s.assign(this->p, n);
+		this->p += n;
+		return true;
+	}
+};
+
+static std::string *encode_record(int op, uint64_t seq, const std::string& id,
+								  const Message *msg)
+{
+	std::string *buf = new std::string(sizeof (MemoryRecord), '\0');
+
+	buf->push_back((char)op);
+	put_u64(*buf, seq);
+	put_str(*buf, id);
+
+	if (msg)
+	{
+		put_str(*buf, msg->role);
+		put_str(*buf, msg->content);
+		put_str(*buf, msg->name);
+		buf->push_back(msg->prefix ? 1 : 0);
+		put_str(*buf, msg->reasoning_context);
+		put_str(*buf, msg->tool_call_id);
+		put_u32(*buf, (uint32_t)msg->tool_calls.size());
+
+		for (const ToolCall& tc : msg->tool_calls)
+		{
+			put_str(*buf, tc.id);
+			put_str(*buf, tc.type);
+			put_u32(*buf, (uint32_t)tc.index);
+			put_str(*buf, tc.function.name);
+			put_str(*buf, tc.function.arguments);
+		}
+	}
+
+	MemoryRecord *record = (MemoryRecord *)&(*buf)[0];
+	const char *payload = buf->data() + sizeof (MemoryRecord);
+
+	record->magic = MEMORY_RECORD_MAGIC;
+	record->size = (uint32_t)(buf->size() - sizeof (MemoryRecord));
+	record->checksum = fnv1a_hash(payload, record->size);
+	buf->resize(MEMORY_ALIGN(buf->size()), '\0');
+	return buf;
+}
+
+static bool decode_header(Reader& r, int& op, uint64_t& seq, std::string& id)
+{
+	char c;
+
+	if (!r.get(&c, 1) || !r.get(&seq, sizeof seq) || !r.get_str(id))
+		return false;
+
+	op = c;
+	return true;
+}
+
+static bool decode_message(Reader& r, Message& msg)
+{
+	uint32_t n;
+	char prefix;
+
+	if (!r.get_str(msg.role) || !r.get_str(msg.content) ||
+		!r.get_str(msg.name) || !r.get(&prefix, 1) ||
+		!r.get_str(msg.reasoning_context) || !r.get_str(msg.tool_call_id) ||
+		!r.get(&n, sizeof n))
+	{
+		return false;
+	}
+
+	msg.prefix = prefix != 0;
+	msg.tool_calls.resize(n);
+
+	for (ToolCall& tc : msg.tool_calls)
+	{
+		uint32_t index;
+
+		if (!r.get_str(tc.id) || !r.get_str(tc.type) ||
+			!r.get(&index, sizeof index) ||
+			!r.get_str(tc.function.name) || !r.get_str(tc.function.arguments))
+		{
+			return false;
+		}
+
+		tc.index = (int)index;
+	}
+
+	return true;
+}
+
+///// DiskMemory /////
+
+DiskMemory::DiskMemory(size_t shards) :
+	segment_size(0),
+	active(0),
+	tail(0),
+	pending(0),
+	next_seq(1)
+{
+	size_t n = 1;
+
+	while (n < shards)
+		n <<= 1;
+
+	this->shards.reset(new Shard[n]);
+	this->mask = n - 1;
+}
+
+DiskMemory::~DiskMemory()
+{
+	this->close();
+}
+
+DiskMemory::Shard& DiskMemory::shard(const std::string &id) const
+{
+	return this->shards[std::hash<std::string>()(id) & this->mask];
+}
+
+bool DiskMemory::reserve(size_t size, Location& loc, int& fd)
+{
+	if (this->segments.empty() || size > this->segment_size)
+		return false;
+
+	if (this->tail + size > this->segment_size)
+	{
+		size_t next = this->active + 1;
+
+		if (!this->open_segment(next, true))
+			return false;
+
+		this->active = next;
+		this->tail = 0;
+	}
+
+	Segment& seg = this->segments[this->active];
+
+	loc.segment = this->active;
+	loc.offset = this->tail;
+	loc.size = size;
+	fd = seg.fd;
+	this->tail += size;
+	return true;
+}
+
+// called with lock of shard s held, which write_done() waits for
+bool DiskMemory::write(Shard& s, const std::string& id, uint64_t generation,
+					   std::string *buf, Location& loc)
+{
+	bool tombstone = (*buf)[sizeof (MemoryRecord)] != MEMORY_OP_APPEND;
+	int fd;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if (!this->reserve(buf->size(), loc, fd))
+		{
+			delete buf;
+			return false;
+		}
+
+		Segment& seg = this->segments[loc.segment];
+		seg.pending++;
+		this->pending++;
+
+		if (tombstone)
+			seg.tombstones.push_back(loc);
+		else
+			seg.live += loc.size;
+	}
+
+	WFFileIOTask *task = WFTaskFactory::create_pwrite_task(fd,
+		buf->data(), buf->size(), loc.offset,
+		[this, buf, id, generation, loc, tombstone](WFFileIOTask *task) {
+			bool success = task->get_state() == WFT_STATE_SUCCESS &&
+						   task->get_retval() == (ssize_t)buf->size();
+
+			delete buf;
+			this->write_done(id, generation, loc, tombstone, success);
+		});
+
+	task->start();
+	return true;
+}
+
+// a failed or short write is not on disk, the message stays in memory.
+// a failed tombstone is lost, what it kills is back after reopen
+void DiskMemory::write_done(const std::string& id, uint64_t generation,
+							const Location& loc, bool tombstone, bool success)
+{
+	if (!tombstone)
+	{
+		Shard& s = this->shard(id);
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		// not a session of the same id after clear()
+		auto it = s.sessions.find(id);
+		if (it != s.sessions.end() && it->second.generation == generation)
+		{
+			Session& session = it->second;
+
+			session.pending--;
+			if (success)
+				session.unwritten.erase(loc.seq);
+			else
+				session.failed++;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	Segment& seg = this->segments[loc.segment];
+
+	if (!success && tombstone)
+	{
+		auto it = std::find_if(seg.tombstones.begin(), seg.tombstones.end(),
+			[&loc](const Location& t) { return t.offset == loc.offset; });
+
+		if (it != seg.tombstones.end())
+			seg.tombstones.erase(it);
+	}
+
+	seg.pending--;
+	if (--this->pending == 0)
+		this->cond.notify_all();
+}
+
+Message DiskMemory::decode(const Session& session, const Location& loc) const
+{
+	// not on disk yet, the segment is still zero there
+	auto it = session.unwritten.find(loc.seq);
+	if (it != session.unwritten.end())
+		return it->second;
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	const Segment& seg = this->segments.at(loc.segment);
+	const char *p = seg.base + loc.offset + sizeof (MemoryRecord);
+	Reader r = {p, seg.base + loc.offset + loc.size};
+	Message msg;
+	std::string id;
+	uint64_t seq;
+	int op;
+
+	if (decode_header(r, op, seq, id))
+		decode_message(r, msg);
+
+	return msg;
+}
+
+// decoded only when a cold session is accessed
+void DiskMemory::load(Session& session) const
+{
+	std::vector<Message> messages;
+
+	messages.reserve(session.records.size());
+	for (const Location& loc : session.records)
+		messages.push_back(this->decode(session, loc));
+
+	session.history.clear();
+	session.history.append(std::move(messages));
+	session.hot = true;
+}
+
+void DiskMemory::add_message(const std::string &id, const Message &msg)
+{
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+	Session& session = s.sessions[id];
+	uint64_t seq = this->next_seq++;
+	Location loc;
+
+	// a cold one stays cold, only the record is added
+	if (session.hot)
+		session.history.push_back(msg);
+	else
+		session.unwritten.emplace(seq, msg);
+
+	session.last_access = get_current_time_us();
+	if (session.version == 0)
+	{
+		session.version = seq;
+		session.generation = seq;
+	}
+
+	loc.seq = seq;
+	if (this->write(s, id, session.generation,
+					encode_record(MEMORY_OP_APPEND, seq, id, &msg), loc))
+	{
+		session.records.push_back(loc);
+		session.pending++;
+	}
+	else
+		session.unwritten.erase(seq);
+}
+
+MessageHistory DiskMemory::get_shared_history(const std::string &id) const
+{
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end())
+		return MessageHistory();
+
+	Session& session = it->second;
+	if (!session.hot)
+		this->load(session);
+
+	session.last_access = get_current_time_us();
+	return session.history;
+}
+
+MessageHistory DiskMemory::get_window(const std::string &id, size_t max_tokens)
+{
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end())
+		return MessageHistory();
+
+	Session& session = it->second;
+	if (!session.hot)
+		this->load(session);
+
+	session.last_access = get_current_time_us();
+	return session.window.get(session.history, max_tokens);
+}
+
+std::vector<Message> DiskMemory::get_history(const std::string &id) const
+{
+	return this->get_shared_history(id).to_vector();
+}
+
+void DiskMemory::clear(const std::string &id)
+{
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+	Location loc;
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end())
+		return;
+
+	Session& session = it->second;
+	if (!session.records.empty())
+	{
+		{
+			std::lock_guard<std::mutex> seg_lock(this->mutex);
+
+			for (const Location& rec : session.records)
+				this->segments[rec.segment].live -= rec.size;
+		}
+
+		loc.seq = this->next_seq++;
+		this->write(s, id, 0,
+					encode_record(MEMORY_OP_CLEAR, loc.seq, id, nullptr), loc);
+	}
+
+	// pending writes of it find nothing in write_done()
+	s.sessions.erase(it);
+}
+
+void DiskMemory::clear_last_query(const std::string &id)
+{
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end())
+		return;
+
+	Session& session = it->second;
+	if (session.hot)
+	{
+		if (session.history.empty() || session.history.back().role != "user")
+			return;
+
+		session.history.pop_back();
+		session.window.reset();
+	}
+	else if (session.records.empty() ||
+			 this->decode(session, session.records.back()).role != "user")
+	{
+		return;
+	}
+
+	if (!session.records.empty())
+	{
+		Location rec = session.records.back();
+		Location loc;
+
+		session.records.pop_back();
+
+		{
+			std::lock_guard<std::mutex> seg_lock(this->mutex);
+			this->segments[rec.segment].live -= rec.size;
+		}
+
+		loc.seq = rec.seq;
+		this->write(s, id, 0,
+					encode_record(MEMORY_OP_POP, rec.seq, id, nullptr), loc);
+	}
+}
+
+MessageHistory DiskMemory::get_versioned_history(const std::string &id,
+												 uint64_t& version) const
+{
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end())
+	{
+		version = 0;
+		return MessageHistory();
+	}
+
+	Session& session = it->second;
+	if (!session.hot)
+		this->load(session);
+
+	session.last_access = get_current_time_us();
+	version = session.version;
+	return session.history;
+}
+
+bool DiskMemory::replace_front(const std::string &id, uint64_t version,
+							   size_t count, std::vector<Message>&& messages)
+{
+	Shard& s = this->shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+	MessageHistory history;
+	Location loc;
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end() || it->second.version != version)
+		return false;
+
+	Session& session = it->second;
+	if (!session.hot)
+		this->load(session);
+
+	if (session.history.size() < count)
+		return false;
+
+	history.append(std::move(messages));
+	history.extend(session.history, count);
+
+	{
+		std::lock_guard<std::mutex> seg_lock(this->mutex);
+
+		for (const Location& rec : session.records)
+			this->segments[rec.segment].live -= rec.size;
+	}
+
+	// the CLEAR kills records before its seq, new ones are after it
+	loc.seq = this->next_seq++;
+	this->write(s, id, 0,
+				encode_record(MEMORY_OP_CLEAR, loc.seq, id, nullptr), loc);
+	session.records.clear();
+
+	history.for_each([&](const Message& msg) {
+		Location rec;
+
+		rec.seq = this->next_seq++;
+		if (this->write(s, id, session.generation,
+						encode_record(MEMORY_OP_APPEND, rec.seq, id, &msg), rec))
+		{
+			session.records.push_back(rec);
+			session.pending++;
+		}
+	});
+
+	session.history = std::move(history);
+	session.window.reset();
+	session.version = this->next_seq++;
+	session.last_access = get_current_time_us();
+	return true;
+}
+
+size_t DiskMemory::evict(int idle_seconds)
+{
+	int64_t before = get_current_time_us() - (int64_t)idle_seconds * 1000000;
+	size_t n = 0;
+
+	if (this->dir.empty())
+		return 0;
+
+	for (size_t i = 0; i <= this->mask; i++)
+	{
+		Shard& s = this->shards[i];
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		for (auto& kv : s.sessions)
+		{
+			Session& session = kv.second;
+
+			// all messages must be on disk before dropped
+			if (session.hot && session.pending == 0 && session.failed == 0 &&
+				session.records.size() == session.history.size() &&
+				session.last_access <= before)
+			{
+				session.history.clear();
+				session.window.reset();
+				session.hot = false;
+				n++;
+			}
+		}
+	}
+
+	return n;
+}
+
+size_t DiskMemory::hot_sessions() const
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i <= this->mask; i++)
+	{
+		Shard& s = this->shards[i];
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		for (const auto& kv : s.sessions)
+			n += kv.second.hot ? 1 : 0;
+	}
+
+	return n;
+}
+
+///// segments /////
+
+bool DiskMemory::open_segment(size_t index, bool create)
+{
+	std::string path = segment_path(this->dir, index);
+	int flags = create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR;
+	int fd = ::open(path.c_str(), flags, 0644);
+	struct stat st;
+
+	if (fd < 0)
+		return false;
+
+	// zero tail of a new segment marks the end of records
+	if ((create && ftruncate(fd, this->segment_size) < 0) ||
+		fstat(fd, &st) < 0 || (size_t)st.st_size != this->segment_size)
+	{
+		::close(fd);
+		return false;
+	}
+
+	void *base = mmap(NULL, this->segment_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+	{
+		::close(fd);
+		return false;
+	}
+
+	Segment& seg = this->segments[index];
+	seg.fd = fd;
+	seg.base = (char *)base;
+	seg.live = 0;
+	seg.pending = 0;
+	return true;
+}
+
+bool DiskMemory::open(const std::string& dir, size_t segment_size)
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	std::vector<std::pair<std::string, Session>> loaded;
+	std::vector<size_t> ids;
+	DIR *dirp;
+
+	if (!this->segments.empty())
+		return false;
+
+	mkdir(dir.c_str(), 0755);
+	dirp = opendir(dir.c_str());
+	if (!dirp)
+		return false;
+
+	struct dirent *ent;
+	while ((ent = readdir(dirp)) != NULL)
+	{
+		size_t id;
+		char ext[8];
+
+		if (sscanf(ent->d_name, "%zu.%7s", &id, ext) == 2 &&
+			strcmp(ext, "mem") == 0)
+		{
+			ids.push_back(id);
+		}
+	}
+
+	closedir(dirp);
+	std::sort(ids.begin(), ids.end());
+
+	this->dir = dir;
+	this->segment_size = segment_size;
+
+	// replay : kills by seq, so order of segments does not matter
+	struct Replay
+	{
+		std::vector<Location> appends;
+		uint64_t clear_before = 0;
+		std::unordered_set<uint64_t> popped;
+	};
+	std::unordered_map<std::string, Replay> replay;
+	uint64_t max_seq = 0;
+	size_t end = 0;
+
+	for (size_t index : ids)
+	{
+		if (!this->open_segment(index, false))
+			continue;
+
+		Segment& seg = this->segments[index];
+		size_t off = 0;
+
+		end = 0;
+
+		while (off + sizeof (MemoryRecord) <= this->segment_size)
+		{
+			const MemoryRecord *record = (const MemoryRecord *)(seg.base + off);
+			size_t len = MEMORY_ALIGN(sizeof (MemoryRecord) + record->size);
+			const char *payload = (const char *)(record + 1);
+			Reader r = {payload, payload + record->size};
+			std::string id;
+			uint64_t seq;
+			int op;
+
+			if (record->magic != MEMORY_RECORD_MAGIC ||
+				off + len > this->segment_size ||
+				fnv1a_hash(payload, record->size) != record->checksum ||
+				!decode_header(r, op, seq, id))
+			{
+				// a torn record, or the hole of a write failed or not
+				// finished. records after it start on 8 bytes too
+				off += 8;
+				continue;
+			}
+
+			Location loc = {index, off, len, seq};
+			Replay& rp = replay[id];
+
+			if (op == MEMORY_OP_APPEND)
+				rp.appends.push_back(loc);
+			else
+			{
+				if (op == MEMORY_OP_CLEAR)
+					rp.clear_before = std::max(rp.clear_before, seq);
+				else
+					rp.popped.insert(seq);
+
+				seg.tombstones.push_back(loc);
+			}
+
+			max_seq = std::max(max_seq, seq);
+			off += len;
+			end = off;
+		}
+
+		this->active = index;
+	}
+
+	// append after the last valid record of the last segment
+	if (this->segments.empty())
+	{
+		if (!this->open_segment(0, true))
+			return false;
+
+		this->active = 0;
+		end = 0;
+	}
+
+	this->tail = end;
+	this->next_seq = max_seq + 1;
+
+	for (auto& kv : replay)
+	{
+		Replay& rp = kv.second;
+		Session session;
+
+		for (const Location& loc : rp.appends)
+		{
+			if (loc.seq >= rp.clear_before && rp.popped.count(loc.seq) == 0)
+				session.records.push_back(loc);
+		}
+
+		if (session.records.empty())
+			continue;
+
+		std::sort(session.records.begin(), session.records.end(),
+				  [](const Location& a, const Location& b) { return a.seq < b.seq; });
+
+		// copies left by a compaction not finished, keep one of them
+		auto last = std::unique(session.records.begin(), session.records.end(),
+				  [](const Location& a, const Location& b) { return a.seq == b.seq; });
+		session.records.erase(last, session.records.end());
+
+		for (const Location& loc : session.records)
+			this->segments[loc.segment].live += loc.size;
+
+		session.hot = false;
+		session.version = this->next_seq++;
+		session.generation = session.version;
+		loaded.emplace_back(kv.first, std::move(session));
+	}
+
+	// shard locks are taken before the segment lock everywhere else
+	lock.unlock();
+
+	for (auto& kv : loaded)
+	{
+		Shard& s = this->shard(kv.first);
+		std::lock_guard<std::mutex> shard_lock(s.mutex);
+		s.sessions[kv.first] = std::move(kv.second);
+	}
+
+	return true;
+}
+
+void DiskMemory::close()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while (this->pending != 0)
+		this->cond.wait(lock);
+
+	for (auto& kv : this->segments)
+	{
+		munmap(kv.second.base, this->segment_size);
+		::close(kv.second.fd);
+	}
+
+	this->segments.clear();
+	this->dir.clear();
+	lock.unlock();
+
+	// all sessions are cold, nothing left for them
+	for (size_t i = 0; i <= this->mask; i++)
+	{
+		Shard& s = this->shards[i];
+		std::lock_guard<std::mutex> shard_lock(s.mutex);
+
+		for (auto it = s.sessions.begin(); it != s.sessions.end(); )
+		{
+			it->second.records.clear();
+			if (!it->second.hot)
+				it = s.sessions.erase(it);
+			else
+				++it;
+		}
+	}
+}
+
+///// compaction /////
+
+// copy a record to the tail, by the only compactor without shard locks
+bool DiskMemory::relocate(Location& loc)
+{
+	Location to = loc;
+	const char *from;
+	int fd;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if (!this->reserve(loc.size, to, fd))
+			return false;
+
+		from = this->segments[loc.segment].base + loc.offset;
+	}
+
+	// the old segment is not deleted until relocation finished
+	if (pwrite(fd, from, loc.size, to.offset) != (ssize_t)loc.size)
+		return false;
+
+	loc = to;
+	return true;
+}
+
+void DiskMemory::compact_segment(size_t index)
+{
+	struct Move
+	{
+		std::string id;
+		Location from;
+		Location to;
+	};
+	std::vector<Move> moves;
+	std::vector<Location> tombstones;
+	size_t done;
+	bool oldest;
+
+	for (size_t i = 0; i <= this->mask; i++)
+	{
+		Shard& s = this->shards[i];
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		for (const auto& kv : s.sessions)
+		{
+			for (const Location& loc : kv.second.records)
+			{
+				if (loc.segment == index)
+					moves.push_back({kv.first, loc, loc});
+			}
+		}
+	}
+
+	// copied out of shard locks, so disk I/O never stalls their sessions
+	for (done = 0; done < moves.size(); done++)
+	{
+		if (!this->relocate(moves[done].to))
+			break;
+	}
+
+	for (size_t i = 0; i < done; i++)
+	{
+		const Move& m = moves[i];
+		Shard& s = this->shard(m.id);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		Location *rec = nullptr;
+
+		auto it = s.sessions.find(m.id);
+		if (it != s.sessions.end())
+		{
+			auto& records = it->second.records;
+			auto r = std::lower_bound(records.begin(), records.end(), m.from.seq,
+				[](const Location& loc, uint64_t seq) { return loc.seq < seq; });
+
+			if (r != records.end() && r->seq == m.from.seq && r->segment == index)
+				rec = &*r;
+		}
+
+		if (rec)
+		{
+			*rec = m.to;
+			std::lock_guard<std::mutex> seg_lock(this->mutex);
+			this->segments[m.to.segment].live += m.to.size;
+		}
+		else
+		{
+			// killed while copied, its tombstone may be before the copy
+			Location loc;
+
+			loc.seq = m.from.seq;
+			this->write(s, m.id, 0,
+						encode_record(MEMORY_OP_POP, m.from.seq, m.id, nullptr),
+						loc);
+		}
+	}
+
+	if (done < moves.size())
+		return; // keep the segment, try next time
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		oldest = (this->segments.begin()->first == index);
+		tombstones.swap(this->segments[index].tombstones);
+	}
+
+	// killed records are older than their tombstones, may be alive in
+	// older segments, or in this one only if it is the oldest
+	if (!oldest)
+	{
+		for (Location& loc : tombstones)
+		{
+			Location to = loc;
+
+			if (!this->relocate(to))
+			{
+				std::lock_guard<std::mutex> lock(this->mutex);
+				this->segments[index].tombstones.swap(tombstones);
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->segments[to.segment].tombstones.push_back(to);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	Segment& seg = this->segments[index];
+
+	munmap(seg.base, this->segment_size);
+	::close(seg.fd);
+	unlink(segment_path(this->dir, index).c_str());
+	this->segments.erase(index);
+}
+
+void DiskMemory::compact(double live_ratio)
+{
+	std::lock_guard<std::mutex> compact_lock(this->compact_mutex);
+	std::vector<size_t> victims;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		for (const auto& kv : this->segments)
+		{
+			const Segment& seg = kv.second;
+
+			if (kv.first != this->active && seg.pending == 0 &&
+				seg.live < live_ratio * this->segment_size)
+			{
+				victims.push_back(kv.first);
+			}
+		}
+	}
+
+	for (size_t index : victims)
+		this->compact_segment(index);
+}
+
+WFGoTask *DiskMemory::create_compact_task(double live_ratio)
+{
+	return WFTaskFactory::create_go_task("llm_disk_memory",
+		[this, live_ratio]() { this->compact(live_ratio); });
+}
+
+} // namespace wfai
@@ -0,0 +1,147 @@
+#ifndef LLM_DISK_MEMORY_H
+#define LLM_DISK_MEMORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include "workflow/WFTaskFactory.h"
+#include "llm_memory.h"
+
+namespace wfai {
+
+// SessionMemory with every change appended to segment files in dir by
+// WFFileIOTask. Only the index of records is kept for all sessions,
+// messages are in memory for hot sessions only. evict() drops idle ones,
+// which are decoded from mmap of the segments again when accessed.
+//
+// Records of each session carry a global sequence, so compaction can move
+// live records of mostly dead segments to the tail in any order.
+class DiskMemory : public SessionMemory
+{
+public:
+	void add_message(const std::string &session_id, const Message &msg) override;
+	std::vector<Message> get_history(const std::string &session_id) const override;
+	MessageHistory get_shared_history(const std::string &session_id) const override;
+	MessageHistory get_window(const std::string &session_id,
+							  size_t max_tokens) override;
+	void clear(const std::string &session_id) override;
+	void clear_last_query(const std::string &id) override;
+	MessageHistory get_versioned_history(const std::string &session_id,
+										 uint64_t& version) const override;
+	// all records of the session are written again after a CLEAR
+	bool replace_front(const std::string &session_id, uint64_t version,
+					   size_t count, std::vector<Message>&& messages) override;
+
+	// load the index of existing segments in dir, all sessions are cold.
+	// segments of another size are not loaded
+	bool open(const std::string& dir, size_t segment_size);
+	bool open(const std::string& dir) { return this->open(dir, default_segment_size); }
+	// wait for pending writes
+	void close();
+
+	// drop messages of sessions idle for seconds, return the number
+	size_t evict(int idle_seconds);
+
+	// rewrite sealed segments with live bytes under ratio, then delete them
+	void compact(double live_ratio);
+	// compact() in a go task of queue "llm_disk_memory"
+	WFGoTask *create_compact_task(double live_ratio);
+
+	size_t hot_sessions() const;
+
+public:
+	DiskMemory(size_t shards);
+	DiskMemory() : DiskMemory(Memory::default_shards) { }
+	virtual ~DiskMemory();
+
+	static constexpr size_t default_segment_size = 64 * 1024 * 1024;
+
+private:
+	struct Location
+	{
+		size_t segment;
+		size_t offset;	// of record header
+		size_t size;	// whole record
+		uint64_t seq;
+	};
+
+	struct Session
+	{
+		MessageHistory history;	// all messages if hot, empty if cold
+		HistoryWindow window;
+		bool hot;
+		std::vector<Location> records; // live ones on disk, by seq
+		int pending;			// writes not finished
+		int failed;				// writes failed, never evicted then
+		int64_t last_access;	// microseconds
+		uint64_t version;
+		uint64_t generation;	// a session of the same id after clear()
+		// added while cold, by seq, until written, forever if failed
+		std::unordered_map<uint64_t, Message> unwritten;
+
+		Session() :
+			hot(true), pending(0), failed(0), last_access(0), version(0),
+			generation(0)
+		{ }
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+		std::unordered_map<std::string, Session> sessions;
+		char pad[64];
+	};
+
+	struct Segment
+	{
+		int fd;
+		char *base;
+		size_t live;		// bytes of live records
+		int pending;
+		std::vector<Location> tombstones; // needed while older segments exist
+	};
+
+	Shard& shard(const std::string &id) const;
+
+	// encoded record is in buf, reserve space and start writing it.
+	// the done of an append is for the session of generation only
+	bool write(Shard& s, const std::string& id, uint64_t generation,
+			   std::string *buf, Location& loc);
+	bool reserve(size_t size, Location& loc, int& fd);
+	void write_done(const std::string& id, uint64_t generation,
+					const Location& loc, bool tombstone, bool success);
+
+	void load(Session& session) const;
+	Message decode(const Session& session, const Location& loc) const;
+
+	bool open_segment(size_t index, bool create);
+	bool relocate(Location& loc);
+	void compact_segment(size_t index);
+
+private:
+	std::unique_ptr<Shard[]> shards;
+	size_t mask;
+
+	mutable std::mutex mutex; // of segments
+	std::condition_variable cond;
+	std::string dir;
+	size_t segment_size;
+	std::map<size_t, Segment> segments;
+	size_t active;	// the segment to append
+	size_t tail;	// append offset in active
+	int pending;	// all writes not finished
+	std::atomic<uint64_t> next_seq;
+
+	std::mutex compact_mutex;
+};
+
+} // namespace wfai
+
+#endif // LLM_DISK_MEMORY_H
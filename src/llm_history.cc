@@ -0,0 +1,260 @@
+#include <algorithm>
+#include "llm_history.h"
+
+using namespace wfai;
+
+static constexpr size_t max_segment_size = 64; // messages
+
+MessageHistory::MessageHistory(const MessageHistory& copy) :
+	tail(copy.tail)
+{
+	if (this->tail)
+		this->tail->frozen = true;
+}
+
+MessageHistory& MessageHistory::operator=(const MessageHistory& copy)
+{
+	if (this != &copy)
+	{
+		this->tail = copy.tail;
+		if (this->tail)
+			this->tail->frozen = true;
+	}
+
+	return *this;
+}
+
+MessageHistory::Segment *MessageHistory::writable_tail()
+{
+	// never copied, nobody else can see it
+	if (this->tail && !this->tail->frozen &&
+		this->tail->messages.size() < max_segment_size)
+	{
+		return this->tail.get();
+	}
+
+	std::shared_ptr<Segment> seg = std::make_shared<Segment>();
+
+	seg->total = this->size();
+	seg->tokens = this->tokens();
+	if (this->tail)
+		this->tail->frozen = true; // may be seen through seg from now on
+
+	seg->prev = std::move(this->tail);
+	this->tail = std::move(seg);
+	return this->tail.get();
+}
+
+uint32_t MessageHistory::estimate_tokens(const Message& msg)
+{
+	size_t bytes = msg.content.size() + msg.role.size();
+
+	for (const auto& tc : msg.tool_calls)
+		bytes += tc.function.name.size() + tc.function.arguments.size();
+
+	return (uint32_t)((bytes + 3) / 4);
+}
+
+void MessageHistory::push_back(const Message& msg)
+{
+	Segment *seg = this->writable_tail();
+	uint32_t n = estimate_tokens(msg);
+
+	seg->messages.push_back(msg);
+	seg->counts.push_back(n);
+	seg->total++;
+	seg->tokens += n;
+}
+
+void MessageHistory::push_back(Message&& msg)
+{
+	Segment *seg = this->writable_tail();
+	uint32_t n = estimate_tokens(msg);
+
+	seg->messages.push_back(std::move(msg));
+	seg->counts.push_back(n);
+	seg->total++;
+	seg->tokens += n;
+}
+
+void MessageHistory::append(std::vector<Message>&& messages)
+{
+	std::vector<uint32_t> counts;
+
+	counts.reserve(messages.size());
+	for (const Message& msg : messages)
+		counts.push_back(estimate_tokens(msg));
+
+	this->append(std::move(messages), std::move(counts));
+}
+
+void MessageHistory::append(std::vector<Message>&& messages,
+							std::vector<uint32_t>&& counts)
+{
+	if (messages.empty())
+		return;
+
+	std::shared_ptr<Segment> seg = std::make_shared<Segment>();
+
+	seg->total = this->size() + messages.size();
+	seg->tokens = this->tokens();
+	for (uint32_t n : counts)
+		seg->tokens += n;
+
+	seg->messages = std::move(messages);
+	seg->counts = std::move(counts);
+	if (this->tail)
+		this->tail->frozen = true;
+
+	seg->prev = std::move(this->tail);
+	this->tail = std::move(seg);
+}
+
+void MessageHistory::pop_back()
+{
+	if (!this->tail)
+		return;
+
+	if (this->tail->messages.size() == 1)
+	{
+		std::shared_ptr<Segment> prev = this->tail->prev;
+		this->tail = std::move(prev);
+	}
+	else if (!this->tail->frozen)
+	{
+		this->tail->tokens -= this->tail->counts.back();
+		this->tail->messages.pop_back();
+		this->tail->counts.pop_back();
+		this->tail->total--;
+	}
+	else
+	{
+		std::shared_ptr<Segment> seg = std::make_shared<Segment>();
+
+		seg->messages.assign(this->tail->messages.begin(),
+							 this->tail->messages.end() - 1);
+		seg->counts.assign(this->tail->counts.begin(),
+						   this->tail->counts.end() - 1);
+		seg->total = this->tail->total - 1;
+		seg->tokens = this->tail->tokens - this->tail->counts.back();
+		seg->prev = this->tail->prev;
+		this->tail = std::move(seg);
+	}
+}
+
+std::vector<Message> MessageHistory::to_vector() const
+{
+	std::vector<Message> messages;
+
+	messages.reserve(this->size());
+	this->for_each([&messages](const Message& msg) {
+		messages.push_back(msg);
+	});
+
+	return messages;
+}
+
+void MessageHistory::extend(const MessageHistory& history, size_t index)
+{
+	history.for_each_since(index, [this](const Message& msg, uint32_t n) {
+		Segment *seg = this->writable_tail();
+
+		seg->messages.push_back(msg);
+		seg->counts.push_back(n);
+		seg->total++;
+		seg->tokens += n;
+	});
+}
+
+MessageHistory MessageHistory::window(size_t max_tokens) const
+{
+	struct Ref
+	{
+		const Message *msg;
+		uint32_t tokens;
+	};
+	std::vector<Ref> refs;
+
+	refs.reserve(this->size());
+	this->for_each_since(0, [&refs](const Message& msg, uint32_t n) {
+		refs.push_back({&msg, n});
+	});
+
+	size_t pinned = 0;
+	size_t used = 0;
+
+	while (pinned < refs.size() && refs[pinned].msg->role == "system")
+		used += refs[pinned++].tokens;
+
+	// newest first, the oldest cut of each kind which still fits
+	size_t turn_cut = refs.size();
+	size_t any_cut = refs.size();
+	size_t last_cut = refs.size();
+
+	for (size_t i = refs.size(); i > pinned; i--)
+	{
+		const std::string& role = refs[i - 1].msg->role;
+
+		if (role != "tool" && last_cut == refs.size())
+			last_cut = i - 1;
+
+		used += refs[i - 1].tokens;
+		if (used > max_tokens)
+			break;
+
+		if (role == "user")
+			turn_cut = i - 1;
+		if (role != "tool")
+			any_cut = i - 1;
+	}
+
+	size_t cut = turn_cut;
+	if (cut == refs.size())
+		cut = any_cut;
+	if (cut == refs.size())
+		cut = std::max(last_cut, pinned);
+
+	// nothing dropped
+	if (cut == pinned)
+		return *this;
+
+	std::vector<Message> messages;
+	std::vector<uint32_t> counts;
+
+	auto add = [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			messages.push_back(*refs[i].msg);
+			counts.push_back(refs[i].tokens);
+		}
+	};
+
+	add(0, pinned);
+	add(cut, refs.size());
+
+	MessageHistory result;
+	result.append(std::move(messages), std::move(counts));
+	return result;
+}
+
+const MessageHistory& HistoryWindow::get(const MessageHistory& history,
+										 size_t max_tokens)
+{
+	if (this->budget == max_tokens && this->end <= history.size())
+	{
+		this->window.extend(history, this->end);
+		this->end = history.size();
+		if (this->window.tokens() <= max_tokens)
+			return this->window;
+	}
+
+	// down to 3/4, so the next turns are only added
+	if (history.tokens() <= max_tokens)
+		this->window = history;
+	else
+		this->window = history.window(max_tokens - max_tokens / 4);
+
+	this->end = history.size();
+	this->budget = max_tokens;
+	return this->window;
+}
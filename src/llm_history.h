@@ -0,0 +1,126 @@
+#ifndef LLM_HISTORY_H
+#define LLM_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "llm_util.h"
+
+namespace wfai {
+
+// Conversation history made of immutable segments shared by copies.
+// Copying is O(1), and appending to one copy is never seen by others,
+// so memory and in-flight requests can hold the same messages.
+class MessageHistory
+{
+public:
+	MessageHistory() = default;
+	MessageHistory(const MessageHistory& copy);
+	MessageHistory& operator=(const MessageHistory& copy);
+	MessageHistory(MessageHistory&& move) = default;
+	MessageHistory& operator=(MessageHistory&& move) = default;
+
+	void push_back(const Message& msg);
+	void push_back(Message&& msg);
+	void append(std::vector<Message>&& messages); // as one segment
+	void pop_back();
+	void clear() { this->tail.reset(); }
+
+	size_t size() const { return this->tail ? this->tail->total : 0; }
+	bool empty() const { return !this->tail; }
+	const Message& back() const { return this->tail->messages.back(); }
+
+	// estimated tokens of all messages, O(1). each message is counted
+	// once when added, and the count moves with it
+	size_t tokens() const { return this->tail ? this->tail->tokens : 0; }
+	static uint32_t estimate_tokens(const Message& msg);
+
+	// from the oldest to the newest
+	template<class FUNC>
+	void for_each(FUNC&& func) const
+	{
+		this->for_each_since(0, [&func](const Message& msg, uint32_t) {
+			func(msg);
+		});
+	}
+
+	// messages from index on, with their tokens.
+	// only segments after index are visited
+	template<class FUNC>
+	void for_each_since(size_t index, FUNC&& func) const
+	{
+		std::vector<const Segment *> segments;
+		const Segment *s;
+
+		for (s = this->tail.get(); s && s->total > index; s = s->prev.get())
+			segments.push_back(s);
+
+		for (size_t i = segments.size(); i > 0; i--)
+		{
+			s = segments[i - 1];
+			size_t first = s->total - s->messages.size();
+
+			for (size_t j = index > first ? index - first : 0;
+				 j < s->messages.size(); j++)
+			{
+				func(s->messages[j], s->counts[j]);
+			}
+		}
+	}
+
+	std::vector<Message> to_vector() const;
+
+	// append messages of history from index on
+	void extend(const MessageHistory& history, size_t index);
+
+	// the newest messages in max_tokens, after leading system messages
+	// which are always kept. cut only before a user message, so tool calls
+	// stay with their results, or if the last turn is too long, before any
+	// message but a tool result. the newest of them is kept even if too long
+	MessageHistory window(size_t max_tokens) const;
+
+private:
+	struct Segment
+	{
+		std::vector<Message> messages;
+		std::vector<uint32_t> counts; // tokens of each message
+		std::shared_ptr<Segment> prev;
+		size_t total; // messages in this and all previous segments
+		size_t tokens; // the same for tokens
+		std::atomic<bool> frozen; // set when copied, never changed after
+
+		Segment() : total(0), tokens(0), frozen(false) {}
+	};
+
+	// the tail segment which is safe to change in place
+	Segment *writable_tail();
+	void append(std::vector<Message>&& messages, std::vector<uint32_t>&& counts);
+
+private:
+	std::shared_ptr<Segment> tail;
+};
+
+// window() of a growing history kept between calls. new messages are
+// added to it, and it is rebuilt only when over budget, down to 3/4 of
+// it, so the prefix sent stays the same for several turns
+class HistoryWindow
+{
+public:
+	const MessageHistory& get(const MessageHistory& history, size_t max_tokens);
+
+	// after messages are removed from history
+	void reset() { this->window.clear(); this->end = 0; this->budget = 0; }
+
+	HistoryWindow() : end(0), budget(0) { }
+
+private:
+	MessageHistory window;
+	size_t end;		// messages of history in it
+	size_t budget;
+};
+
+} // namespace wfai
+
+#endif // LLM_HISTORY_H
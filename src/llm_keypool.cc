@@ -0,0 +1,256 @@
+#include <stdint.h>
+#include <chrono>
+#include "llm_keypool.h"
+
+using namespace wfai;
+
+static constexpr int default_cooldown = 1000; // ms
+static constexpr int default_max_cooldown = 60 * 1000; // ms
+static constexpr int error_cooldown = 1000; // ms
+static constexpr int max_failures = 3; // in a row before error cooldown
+
+static inline int64_t get_current_time_us()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+void ApiKeyPool::Bucket::refill(int64_t elapsed)
+{
+	if (this->capacity == 0)
+		return;
+
+	this->tokens += this->rate * elapsed;
+	if (this->tokens > this->capacity)
+		this->tokens = this->capacity;
+}
+
+double ApiKeyPool::Bucket::headroom() const
+{
+	if (this->capacity == 0)
+		return 1.0;
+
+	return this->tokens / this->capacity;
+}
+
+ApiKeyPool::ApiKeyPool() :
+	cooldown(default_cooldown),
+	max_cooldown(default_max_cooldown)
+{
+}
+
+void ApiKeyPool::add_key(const std::string& key, uint32_t rpm, uint32_t tpm)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	Key k;
+
+	k.key = key;
+	k.requests.capacity = rpm;
+	k.requests.tokens = rpm;
+	k.requests.rate = rpm / 60e6;
+	k.tokens.capacity = tpm;
+	k.tokens.tokens = tpm;
+	k.tokens.rate = tpm / 60e6;
+	k.last_refill = get_current_time_us();
+	k.cooldown_until = 0;
+	k.backoff = this->cooldown;
+	k.failures = 0;
+
+	this->keys.push_back(std::move(k));
+}
+
+void ApiKeyPool::refill(Key& k, int64_t now)
+{
+	int64_t elapsed = now - k.last_refill;
+
+	k.requests.refill(elapsed);
+	k.tokens.refill(elapsed);
+	k.last_refill = now;
+}
+
+int ApiKeyPool::acquire(uint32_t tokens, std::string& key)
+{
+	return this->acquire(tokens, key, nullptr);
+}
+
+int ApiKeyPool::acquire(uint32_t tokens, std::string& key, int64_t *wait_us)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	int64_t now = get_current_time_us();
+	int64_t earliest = INT64_MAX;
+	double best = -1;
+	int index = -1;
+	int fallback = -1;
+
+	for (size_t i = 0; i < this->keys.size(); i++)
+	{
+		Key& k = this->keys[i];
+		int64_t ready = now; // when the key can take this request
+		double need;
+
+		if (k.stats.disabled)
+			continue;
+
+		this->refill(k, now);
+
+		// the server has just refused it
+		k.stats.cooling = (k.cooldown_until > now);
+		if (k.stats.cooling)
+			ready = k.cooldown_until;
+
+		// a request over the whole budget waits for a full bucket
+		if (k.requests.capacity != 0 && k.requests.tokens < 1)
+		{
+			double wait = (1 - k.requests.tokens) / k.requests.rate;
+			if (now + (int64_t)wait > ready)
+				ready = now + (int64_t)wait;
+		}
+
+		need = k.tokens.capacity < tokens ? k.tokens.capacity : tokens;
+		if (k.tokens.capacity != 0 && k.tokens.tokens < need)
+		{
+			double wait = (need - k.tokens.tokens) / k.tokens.rate;
+			if (now + (int64_t)wait > ready)
+				ready = now + (int64_t)wait;
+		}
+
+		if (ready > now)
+		{
+			if (ready < earliest)
+			{
+				earliest = ready;
+				fallback = (int)i;
+			}
+
+			continue;
+		}
+
+		double headroom = k.requests.headroom();
+		double t = k.tokens.headroom();
+		if (t < headroom)
+			headroom = t;
+
+		if (headroom > best)
+		{
+			best = headroom;
+			index = (int)i;
+		}
+	}
+
+	if (index < 0 && wait_us)
+	{
+		*wait_us = fallback < 0 ? -1 : earliest - now;
+		return -1;
+	}
+
+	if (index < 0)
+		index = fallback;
+
+	if (index < 0)
+		return -1;
+
+	Key& k = this->keys[index];
+	if (k.requests.capacity != 0)
+		k.requests.tokens -= 1;
+	if (k.tokens.capacity != 0)
+		k.tokens.tokens -= tokens;
+
+	k.stats.requests++;
+	key = k.key;
+	return index;
+}
+
+void ApiKeyPool::release(int index, int status_code, int retry_after,
+						 uint32_t tokens, uint32_t used_tokens)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	int64_t now = get_current_time_us();
+	Key& k = this->keys[index];
+	int ms;
+
+	if (used_tokens > 0 && used_tokens < tokens && k.tokens.capacity != 0)
+	{
+		k.tokens.tokens += tokens - used_tokens;
+		if (k.tokens.tokens > k.tokens.capacity)
+			k.tokens.tokens = k.tokens.capacity;
+	}
+
+	if (status_code == 429)
+	{
+		k.stats.throttled++;
+
+		if (retry_after >= 0)
+			ms = retry_after * 1000;
+		else
+		{
+			ms = k.backoff;
+			k.backoff = k.backoff * 2 < this->max_cooldown ?
+						k.backoff * 2 : this->max_cooldown;
+		}
+
+		k.cooldown_until = now + (int64_t)ms * 1000;
+		k.stats.cooling = true;
+	}
+	else if (status_code == 401 || status_code == 403)
+	{
+		k.stats.disabled = true;
+	}
+	else if (status_code == 0 || status_code >= 500)
+	{
+		k.stats.errors++;
+		if (++k.failures >= max_failures)
+		{
+			k.cooldown_until = now + (int64_t)error_cooldown * 1000;
+			k.stats.cooling = true;
+			k.failures = 0;
+		}
+	}
+	else
+	{
+		k.backoff = this->cooldown;
+		k.failures = 0;
+	}
+}
+
+void ApiKeyPool::update_remaining(int index, int64_t requests, int64_t tokens)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	Key& k = this->keys[index];
+
+	// server knows better, other clients may share the key
+	if (requests >= 0 && k.requests.capacity != 0 &&
+		requests < k.requests.tokens)
+	{
+		k.requests.tokens = (double)requests;
+	}
+
+	if (tokens >= 0 && k.tokens.capacity != 0 && tokens < k.tokens.tokens)
+		k.tokens.tokens = (double)tokens;
+}
+
+size_t ApiKeyPool::size()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->keys.size();
+}
+
+bool ApiKeyPool::get_stats(int index, ApiKeyStats& stats)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (index < 0 || (size_t)index >= this->keys.size())
+		return false;
+
+	stats = this->keys[index].stats;
+	return true;
+}
+
+void ApiKeyPool::set_cooldown(int ms, int max_ms)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->cooldown = ms;
+	this->max_cooldown = max_ms;
+	for (Key& k : this->keys)
+		k.backoff = ms;
+}
@@ -0,0 +1,91 @@
+#ifndef LLM_KEYPOOL_H
+#define LLM_KEYPOOL_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+namespace wfai {
+
+struct ApiKeyStats
+{
+	uint64_t requests;
+	uint64_t throttled;		// 429 from server
+	uint64_t errors;		// network errors and 5xx
+	bool cooling;
+	bool disabled;			// 401 / 403, never picked again
+
+	ApiKeyStats() :
+		requests(0), throttled(0), errors(0),
+		cooling(false), disabled(false) {}
+};
+
+// Provider keys with their own RPM / TPM budgets.
+// Each request goes to the healthy key with the most headroom left,
+// a key is cooled down after 429 for Retry-After or an exponential backoff.
+class ApiKeyPool
+{
+public:
+	// rpm / tpm : 0 for no limit
+	void add_key(const std::string& key, uint32_t rpm, uint32_t tpm);
+
+	// return index of the key, -1 if no key is usable now : cooling ones
+	// or out of budget. wait_us is then the time until the first one may
+	// be, -1 if none ever, such as all disabled
+	int acquire(uint32_t tokens, std::string& key, int64_t *wait_us);
+	// for requests which can not wait : the one to recover first instead
+	// of -1, which is only for no key enabled
+	int acquire(uint32_t tokens, std::string& key);
+
+	// status_code 0 for network error. retry_after in seconds, -1 : none.
+	// used_tokens > 0 gives back the over-estimated part of acquire()
+	void release(int index, int status_code, int retry_after,
+				 uint32_t tokens, uint32_t used_tokens);
+
+	// rate limit headers reported by server, -1 : not reported
+	void update_remaining(int index, int64_t requests, int64_t tokens);
+
+	size_t size();
+	bool get_stats(int index, ApiKeyStats& stats);
+
+	// base backoff after 429 without Retry-After, doubled each time
+	void set_cooldown(int ms, int max_ms);
+
+	ApiKeyPool();
+
+private:
+	struct Bucket
+	{
+		double capacity; // 0 : no limit
+		double tokens;
+		double rate; // per microsecond
+
+		void refill(int64_t elapsed);
+		double headroom() const; // (0, 1], 1 for no limit
+	};
+
+	struct Key
+	{
+		std::string key;
+		Bucket requests;
+		Bucket tokens;
+		int64_t last_refill;
+		int64_t cooldown_until;
+		int backoff; // ms, of the next 429 without Retry-After
+		int failures; // in a row
+		ApiKeyStats stats;
+	};
+
+	void refill(Key& k, int64_t now);
+
+private:
+	std::mutex mutex;
+	std::vector<Key> keys;
+	int cooldown;
+	int max_cooldown;
+};
+
+} // namespace wfai
+
+#endif // LLM_KEYPOOL_H
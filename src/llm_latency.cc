@@ -0,0 +1,178 @@
+#include <string.h>
+#include "llm_latency.h"
+
+namespace wfai {
+
+constexpr int LatencyHistogram::sub_buckets;
+constexpr int LatencyHistogram::num_buckets;
+
+static constexpr uint32_t default_generation_size = 1024;
+static constexpr double default_percentile = 0.99;
+static constexpr double default_multiplier = 3.0;
+static constexpr uint32_t default_min_samples = 32;
+static constexpr int default_ttft_floor = 5 * 1000; // ms
+static constexpr int default_tpot_floor = 2 * 1000; // ms
+
+LatencyHistogram::LatencyHistogram(uint32_t generation_size) :
+	generation_size(generation_size),
+	cur_count(0),
+	prev_count(0)
+{
+	memset(this->cur, 0, sizeof this->cur);
+	memset(this->prev, 0, sizeof this->prev);
+}
+
+int LatencyHistogram::bucket_of(uint32_t ms)
+{
+	if (ms < sub_buckets)
+		return ms;
+
+	int log = 31 - __builtin_clz(ms); // >= 3
+	int sub = (ms >> (log - 3)) & (sub_buckets - 1);
+	int index = (log - 2) * sub_buckets + sub;
+
+	return index < num_buckets ? index : num_buckets - 1;
+}
+
+uint32_t LatencyHistogram::bucket_upper(int index)
+{
+	if (index < sub_buckets)
+		return index;
+
+	int log = index / sub_buckets + 2;
+	int sub = index % sub_buckets;
+
+	return ((uint32_t)(sub_buckets + sub + 1) << (log - 3)) - 1;
+}
+
+void LatencyHistogram::add(uint32_t ms)
+{
+	if (this->cur_count >= this->generation_size)
+	{
+		memcpy(this->prev, this->cur, sizeof this->cur);
+		memset(this->cur, 0, sizeof this->cur);
+		this->prev_count = this->cur_count;
+		this->cur_count = 0;
+	}
+
+	this->cur[bucket_of(ms)]++;
+	this->cur_count++;
+}
+
+uint32_t LatencyHistogram::percentile(double p) const
+{
+	uint32_t total = this->count();
+	uint32_t rank = (uint32_t)(p * total + 0.5);
+	uint32_t sum = 0;
+
+	if (rank == 0)
+		rank = 1;
+
+	for (int i = 0; i < num_buckets; i++)
+	{
+		sum += this->cur[i] + this->prev[i];
+		if (sum >= rank)
+			return bucket_upper(i);
+	}
+
+	return bucket_upper(num_buckets - 1);
+}
+
+LatencyStats::LatencyStats() :
+	ttft(default_generation_size),
+	tpot(default_generation_size)
+{
+}
+
+void LatencyStats::add_ttft(uint32_t ms)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->ttft.add(ms);
+}
+
+void LatencyStats::add_tpot(uint32_t ms)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->tpot.add(ms);
+}
+
+int LatencyStats::ttft_percentile(double p, uint32_t min_samples)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (this->ttft.count() < min_samples)
+		return -1;
+
+	return this->ttft.percentile(p);
+}
+
+int LatencyStats::tpot_percentile(double p, uint32_t min_samples)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (this->tpot.count() < min_samples)
+		return -1;
+
+	return this->tpot.percentile(p);
+}
+
+LatencyTracker::LatencyTracker() :
+	percentile(default_percentile),
+	multiplier(default_multiplier),
+	min_samples(default_min_samples),
+	ttft_floor(default_ttft_floor),
+	tpot_floor(default_tpot_floor)
+{
+}
+
+LatencyStats *LatencyTracker::get_stats(const std::string& base_url,
+										const std::string& model,
+										bool stream)
+{
+	std::string key = base_url + (stream ? " stream " : " ") + model;
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	std::unique_ptr<LatencyStats>& stats = this->stats[key];
+	if (!stats)
+		stats.reset(new LatencyStats());
+
+	return stats.get();
+}
+
+void LatencyTracker::set_policy(double percentile, double multiplier,
+								uint32_t min_samples)
+{
+	this->percentile = percentile;
+	this->multiplier = multiplier;
+	this->min_samples = min_samples;
+}
+
+void LatencyTracker::set_floor(int ttft_floor, int tpot_floor)
+{
+	this->ttft_floor = ttft_floor;
+	this->tpot_floor = tpot_floor;
+}
+
+int LatencyTracker::ttft_timeout(LatencyStats *stats)
+{
+	int p = stats->ttft_percentile(this->percentile, this->min_samples);
+
+	if (p < 0)
+		return -1;
+
+	int timeout = (int)(p * this->multiplier);
+	return timeout > this->ttft_floor ? timeout : this->ttft_floor;
+}
+
+int LatencyTracker::tpot_timeout(LatencyStats *stats)
+{
+	int p = stats->tpot_percentile(this->percentile, this->min_samples);
+
+	if (p < 0)
+		return -1;
+
+	int timeout = (int)(p * this->multiplier);
+	return timeout > this->tpot_floor ? timeout : this->tpot_floor;
+}
+
+} // namespace wfai
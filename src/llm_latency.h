@@ -0,0 +1,88 @@
+#ifndef LLM_LATENCY_H
+#define LLM_LATENCY_H
+
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+
+namespace wfai {
+
+// Rolling histogram of latencies in milliseconds.
+// Log-linear buckets : 8 per power of 2, about 9% error.
+// Two generations are kept, the older is dropped when the newer is full.
+class LatencyHistogram
+{
+public:
+	void add(uint32_t ms);
+	uint32_t percentile(double p) const; // p in (0, 1]
+	uint32_t count() const { return this->cur_count + this->prev_count; }
+
+	LatencyHistogram(uint32_t generation_size);
+
+private:
+	static constexpr int sub_buckets = 8;
+	static constexpr int num_buckets = 26 * sub_buckets; // up to 2^26 ms
+
+	static int bucket_of(uint32_t ms);
+	static uint32_t bucket_upper(int index);
+
+private:
+	uint32_t generation_size;
+	uint32_t cur_count;
+	uint32_t prev_count;
+	uint32_t cur[num_buckets];
+	uint32_t prev[num_buckets];
+};
+
+// TTFT and TPOT of one model on one endpoint, streaming or not
+class LatencyStats
+{
+public:
+	void add_ttft(uint32_t ms);
+	void add_tpot(uint32_t ms);
+
+	// -1 if there is not enough samples
+	int ttft_percentile(double p, uint32_t min_samples);
+	int tpot_percentile(double p, uint32_t min_samples);
+
+	LatencyStats();
+
+private:
+	std::mutex mutex;
+	LatencyHistogram ttft;
+	LatencyHistogram tpot;
+};
+
+class LatencyTracker
+{
+public:
+	LatencyStats *get_stats(const std::string& base_url,
+							const std::string& model,
+							bool stream);
+
+	// timeout = percentile * multiplier, but no less than the floor
+	void set_policy(double percentile, double multiplier, uint32_t min_samples);
+	void set_floor(int ttft_floor, int tpot_floor);
+
+	// return -1 to use the default timeout
+	int ttft_timeout(LatencyStats *stats);
+	int tpot_timeout(LatencyStats *stats);
+
+	LatencyTracker();
+
+private:
+	std::mutex mutex;
+	std::unordered_map<std::string, std::unique_ptr<LatencyStats>> stats;
+
+	double percentile;
+	double multiplier;
+	uint32_t min_samples;
+	int ttft_floor;
+	int tpot_floor;
+};
+
+} // namespace wfai
+
+#endif // LLM_LATENCY_H
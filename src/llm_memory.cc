@@ -1,39 +1,162 @@
+#include <functional>
 #include "llm_memory.h"
 
 namespace wfai
 {
 
+constexpr size_t Memory::default_shards;
+
+Memory::Memory(size_t shards) :
+	next_version_(1)
+{
+	size_t n = 1;
+
+	while (n < shards)
+		n <<= 1;
+
+	shards_.reset(new Shard[n]);
+	mask_ = n - 1;
+}
+
+Memory::Shard& Memory::shard(const std::string &id) const
+{
+	return shards_[std::hash<std::string>()(id) & mask_];
+}
+
 void Memory::add_message(const std::string &id, const Message &msg)
 {
-	sessions_[id].push_back(msg);
+	Shard& s = shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	Session& session = s.sessions[id];
+
+	if (session.version == 0)
+		session.version = next_version_++;
+
+	session.history.push_back(msg);
+}
+
+std::vector<Message> Memory::get_history(const std::string &id) const
+{
+	Shard& s = shard(id);
+	MessageHistory history;
+
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto it = s.sessions.find(id);
+		if (it == s.sessions.end())
+			return std::vector<Message>();
+
+		history = it->second.history; // O(1), copy messages out of lock
+	}
+
+	return history.to_vector();
+}
+
+MessageHistory Memory::get_shared_history(const std::string &id) const
+{
+	Shard& s = shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.sessions.find(id);
+	if (it != s.sessions.end())
+		return it->second.history;
+	return MessageHistory();
 }
 
-const std::vector<Message> &Memory::get_history(const std::string &id) const
+MessageHistory Memory::get_window(const std::string &id, size_t max_tokens)
 {
-	static const std::vector<Message> empty;
-	auto it = sessions_.find(id);
-	if (it != sessions_.end())
-		return it->second;
-	return empty;
+	Shard& s = shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end())
+		return MessageHistory();
+
+	Session& session = it->second;
+	return session.window.get(session.history, max_tokens);
 }
 
 void Memory::clear(const std::string &id)
 {
-	sessions_.erase(id);
+	Shard& s = shard(id);
+	Session session;
+
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto it = s.sessions.find(id);
+		if (it == s.sessions.end())
+			return;
+
+		session = std::move(it->second); // freed out of lock
+		s.sessions.erase(it);
+	}
 }
 
 void Memory::clear_last_query(const std::string &id)
 {
-	auto it = sessions_.find(id);
-	if (it == sessions_.end())
+	Shard& s = shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end())
 		return;
 
-	auto& messages = it->second;
-	if (messages.empty())
+	auto& history = it->second.history;
+	if (history.empty())
 		return;
 
-	if (messages.back().role == "user")
-		messages.pop_back();
+	if (history.back().role == "user")
+	{
+		history.pop_back();
+		it->second.window.reset();
+	}
+}
+
+
+MessageHistory Memory::get_versioned_history(const std::string &id,
+											 uint64_t& version) const
+{
+	Shard& s = shard(id);
+	std::lock_guard<std::mutex> lock(s.mutex);
+
+	auto it = s.sessions.find(id);
+	if (it == s.sessions.end())
+	{
+		version = 0;
+		return MessageHistory();
+	}
+
+	version = it->second.version;
+	return it->second.history;
+}
+
+bool Memory::replace_front(const std::string &id, uint64_t version,
+						   size_t count, std::vector<Message>&& messages)
+{
+	Shard& s = shard(id);
+	MessageHistory history;
+
+	history.append(std::move(messages));
+
+	{
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto it = s.sessions.find(id);
+		if (it == s.sessions.end() || it->second.version != version ||
+			it->second.history.size() < count)
+		{
+			return false;
+		}
+
+		// kept messages, with those added after the snapshot
+		Session& session = it->second;
+		history.extend(session.history, count);
+		std::swap(history, session.history); // old one freed out of lock
+		session.window.reset();
+		session.version = next_version_++;
+	}
+
+	return true;
 }
 
 } // namespace wfai
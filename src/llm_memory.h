@@ -1,23 +1,103 @@
 #ifndef LLM_TASK_MEMORY_H
 #define LLM_TASK_MEMORY_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <unordered_map>
 #include "llm_util.h"
+#include "llm_history.h"
 
 namespace wfai {
 
-class Memory
+// Messages of sessions by session id, thread safe
+class SessionMemory
 {
 public:
-	void add_message(const std::string &session_id, const Message &msg);
-	const std::vector<Message> &get_history(const std::string &session_id) const;
-	void clear(const std::string &session_id);
-	void clear_last_query(const std::string &id);
+	virtual void add_message(const std::string &session_id, const Message &msg) = 0;
+	virtual std::vector<Message> get_history(const std::string &session_id) const = 0;
+
+	// O(1), for ChatCompletionRequest::history
+	virtual MessageHistory get_shared_history(const std::string &session_id) const = 0;
+
+	// shared history in max_tokens, see MessageHistory::window(). kept for
+	// the session, so only messages added since the last call are counted
+	virtual MessageHistory get_window(const std::string &session_id,
+									  size_t max_tokens) = 0;
+
+	virtual void clear(const std::string &session_id) = 0;
+	virtual void clear_last_query(const std::string &id) = 0;
+
+	// shared history with its version, which changes when the session is
+	// cleared or compacted, but not when messages are added
+	virtual MessageHistory get_versioned_history(const std::string &session_id,
+												 uint64_t& version) const = 0;
+
+	// replace the first count messages of the session with messages, if
+	// version is still the same. readers see the old or the new one only
+	virtual bool replace_front(const std::string &session_id, uint64_t version,
+							   size_t count, std::vector<Message>&& messages) = 0;
+
+public:
+	SessionMemory() { }
+	virtual ~SessionMemory() { }
+
+	SessionMemory(const SessionMemory&) = delete;
+	SessionMemory& operator=(const SessionMemory&) = delete;
+};
+
+// Sessions are spread over shards by hash of session id,
+// each shard has its own lock, so different sessions rarely contend
+class Memory : public SessionMemory
+{
+public:
+	void add_message(const std::string &session_id, const Message &msg) override;
+	std::vector<Message> get_history(const std::string &session_id) const override;
+	MessageHistory get_shared_history(const std::string &session_id) const override;
+	MessageHistory get_window(const std::string &session_id,
+							  size_t max_tokens) override;
+	void clear(const std::string &session_id) override;
+	void clear_last_query(const std::string &id) override;
+	MessageHistory get_versioned_history(const std::string &session_id,
+										 uint64_t& version) const override;
+	bool replace_front(const std::string &session_id, uint64_t version,
+					   size_t count, std::vector<Message>&& messages) override;
+
+public:
+	Memory() : Memory(default_shards) { }
+	// rounded up to power of 2, 1 for a single lock
+	explicit Memory(size_t shards);
+	virtual ~Memory() { }
+
+	static constexpr size_t default_shards = 64;
+
+private:
+	struct Session
+	{
+		MessageHistory history;
+		HistoryWindow window;
+		uint64_t version;
+
+		Session() : version(0) { }
+	};
+
+	struct Shard
+	{
+		mutable std::mutex mutex;
+		std::unordered_map<std::string, Session> sessions;
+		char pad[64]; // mutexes of neighbours not in one cache line
+	};
+
+	Shard& shard(const std::string &id) const;
 
 private:
-	std::unordered_map<std::string, std::vector<Message>> sessions_;
+	std::unique_ptr<Shard[]> shards_;
+	size_t mask_;
+	std::atomic<uint64_t> next_version_;
 };
 
 } // namespace wfai
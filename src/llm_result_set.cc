@@ -0,0 +1,138 @@
+#include <chrono>
+#include "llm_session.h"
+#include "llm_result_set.h"
+
+namespace wfai {
+
+AsyncResultSet::AsyncResultSet() :
+	count(0)
+{
+}
+
+AsyncResultSet::~AsyncResultSet()
+{
+	for (Entry& entry : this->entries)
+	{
+		if (entry.result)
+		{
+			entry.ptr->set_watcher(nullptr, -1);
+			entry.ptr->decref();
+		}
+	}
+}
+
+void AsyncResultSet::add(AsyncResult *result)
+{
+	AsyncResultPtr *ptr = result->get_ptr();
+	int id;
+
+	ptr->incref();
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if (this->free_ids.empty())
+		{
+			id = (int)this->entries.size();
+			this->entries.push_back(Entry{nullptr, nullptr, false});
+		}
+		else
+		{
+			id = this->free_ids.back();
+			this->free_ids.pop_back();
+		}
+
+		this->entries[id].result = result;
+		this->entries[id].ptr = ptr;
+		this->count++;
+	}
+
+	// may be ready already, and nothing will be reported for that
+	ptr->set_watcher(this, id);
+	this->notify(id);
+}
+
+void AsyncResultSet::remove(AsyncResult *result)
+{
+	AsyncResultPtr *ptr = result->get_ptr();
+
+	// after this, no notify() from ptr is running or coming
+	int id = ptr->set_watcher(nullptr, -1);
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		if (id >= 0 && id < (int)this->entries.size() &&
+			this->entries[id].result == result)
+		{
+			Entry& entry = this->entries[id];
+
+			entry.result = nullptr;
+			entry.ptr = nullptr;
+			this->free_ids.push_back(id);
+			this->count--;
+		}
+	}
+
+	ptr->decref();
+}
+
+void AsyncResultSet::notify(int id)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	Entry& entry = this->entries[id];
+
+	if (!entry.queued)
+	{
+		entry.queued = true;
+		this->ready.push_back(id);
+		this->cond.notify_one();
+	}
+}
+
+AsyncResult *AsyncResultSet::wait(int timeout)
+{
+	auto abstime = std::chrono::steady_clock::now() +
+				   std::chrono::milliseconds(timeout > 0 ? timeout : 0);
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while (this->count != 0)
+	{
+		while (!this->ready.empty())
+		{
+			int id = this->ready.front();
+			Entry& entry = this->entries[id];
+
+			this->ready.pop_front();
+			entry.queued = false;
+
+			// a put after this check will notify again, it needs the lock
+			if (entry.result && entry.ptr->is_ready())
+			{
+				// still ready after taken, the next wait() checks it again
+				entry.queued = true;
+				this->ready.push_back(id);
+				return entry.result;
+			}
+		}
+
+		if (timeout < 0)
+			this->cond.wait(lock);
+		else if (timeout == 0 ||
+				 this->cond.wait_until(lock, abstime) == std::cv_status::timeout)
+		{
+			if (this->ready.empty())
+				break;
+		}
+	}
+
+	return nullptr;
+}
+
+size_t AsyncResultSet::size() const
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->count;
+}
+
+} // namespace wfai
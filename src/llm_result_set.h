@@ -0,0 +1,62 @@
+#ifndef LLM_RESULT_SET_H
+#define LLM_RESULT_SET_H
+
+#include <stddef.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace wfai {
+
+class AsyncResult;
+class AsyncResultPtr;
+
+// Wait on many AsyncResults at once, like poll() on file descriptors.
+// Level triggered : a result is returned by wait() as long as get_chunk()
+// or get_response() of it would not block, so remove() it when done.
+class AsyncResultSet
+{
+public:
+	// result must not be moved or destroyed until removed
+	void add(AsyncResult *result);
+	void remove(AsyncResult *result);
+
+	// a ready result, or nullptr on timeout or empty set.
+	// timeout in milliseconds, -1 to wait forever, 0 to poll
+	AsyncResult *wait(int timeout);
+
+	size_t size() const;
+
+public:
+	AsyncResultSet();
+	~AsyncResultSet();
+
+	AsyncResultSet(const AsyncResultSet&) = delete;
+	AsyncResultSet& operator=(const AsyncResultSet&) = delete;
+
+private:
+	// by AsyncResultPtr on chunk put, finish or done
+	void notify(int id);
+
+private:
+	struct Entry
+	{
+		AsyncResult *result;	// nullptr if the slot is free
+		AsyncResultPtr *ptr;
+		bool queued;			// in ready, may be a stale one
+	};
+
+	mutable std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<Entry> entries;
+	std::vector<int> free_ids;
+	std::deque<int> ready;		// may be ready, checked by wait()
+	size_t count;
+
+	friend class AsyncResultPtr;
+};
+
+} // namespace wfai
+
+#endif // LLM_RESULT_SET_H
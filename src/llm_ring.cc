@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <new>
+#ifdef __linux__
+# include <unistd.h>
+# include <limits.h>
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#else
+# include <condition_variable>
+#endif
+#include "llm_ring.h"
+
+using namespace wfai;
+
+#ifdef __linux__
+
+void SPSCRing::park(std::atomic<uint32_t>& word, uint32_t val)
+{
+	// returns at once if word is not val any more
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word),
+			FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+void SPSCRing::wake(std::atomic<uint32_t>& word)
+{
+	word.fetch_add(1, std::memory_order_seq_cst);
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word),
+			FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#else
+
+// no futex, a global condition is fine for the slow path
+static std::mutex park_mutex;
+static std::condition_variable park_cond;
+
+void SPSCRing::park(std::atomic<uint32_t>& word, uint32_t val)
+{
+	std::unique_lock<std::mutex> lock(park_mutex);
+
+	while (word.load() == val)
+		park_cond.wait(lock);
+}
+
+void SPSCRing::wake(std::atomic<uint32_t>& word)
+{
+	std::lock_guard<std::mutex> lock(park_mutex);
+
+	word.fetch_add(1, std::memory_order_seq_cst);
+	park_cond.notify_all();
+}
+
+#endif
+
+SPSCRing::SPSCRing(size_t capacity) :
+	head(0),
+	tail(0),
+	data_seq(0),
+	consumer_parked(false),
+	finished(false),
+	abandoned(false),
+	overflowed(0),
+	backlog_pos(0),
+	backlog_left(0)
+{
+	size_t n = 1;
+
+	while (n < capacity)
+		n <<= 1;
+
+	this->slots = new void *[n];
+	this->mask = n - 1;
+}
+
+SPSCRing::~SPSCRing()
+{
+	delete []this->slots;
+}
+
+bool SPSCRing::put(void *item)
+{
+	size_t t = this->tail.load(std::memory_order_relaxed);
+
+	if (this->abandoned.load(std::memory_order_acquire))
+		return false;
+
+	// once some are in overflow, the rest follow them to keep order
+	if (this->overflowed.load(std::memory_order_seq_cst) == 0 &&
+		t - this->head.load(std::memory_order_acquire) <= this->mask)
+	{
+		this->slots[t & this->mask] = item;
+		this->tail.store(t + 1, std::memory_order_seq_cst);
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(this->overflow_mutex);
+		this->overflow.push_back(item);
+		this->overflowed.fetch_add(1, std::memory_order_seq_cst);
+	}
+
+	if (this->consumer_parked.load(std::memory_order_seq_cst))
+		SPSCRing::wake(this->data_seq);
+
+	return true;
+}
+
+void *SPSCRing::get()
+{
+	size_t h = this->head.load(std::memory_order_relaxed);
+	uint32_t seq;
+	void *item;
+
+	// all older than what is in the ring now
+	if (this->backlog_pos < this->backlog.size())
+	{
+		this->backlog_left.fetch_sub(1, std::memory_order_relaxed);
+		return this->backlog[this->backlog_pos++];
+	}
+
+	while (h == this->tail.load(std::memory_order_acquire))
+	{
+		// the ring is drained, so the overflow is the oldest
+		if (this->overflowed.load(std::memory_order_seq_cst) != 0)
+		{
+			std::lock_guard<std::mutex> lock(this->overflow_mutex);
+
+			this->backlog.clear();
+			this->backlog.swap(this->overflow);
+			this->overflowed.store(0, std::memory_order_seq_cst);
+			this->backlog_left.store(this->backlog.size() - 1,
+									 std::memory_order_relaxed);
+			this->backlog_pos = 1;
+			return this->backlog[0];
+		}
+
+		if (this->finished.load(std::memory_order_acquire))
+		{
+			// items put before finish() are visible now
+			if (h == this->tail.load(std::memory_order_acquire) &&
+				this->overflowed.load(std::memory_order_acquire) == 0)
+			{
+				return NULL;
+			}
+
+			continue;
+		}
+
+		seq = this->data_seq.load(std::memory_order_seq_cst);
+		this->consumer_parked.store(true, std::memory_order_seq_cst);
+
+		if (h == this->tail.load(std::memory_order_seq_cst) &&
+			this->overflowed.load(std::memory_order_seq_cst) == 0 &&
+			!this->finished.load(std::memory_order_seq_cst))
+		{
+			SPSCRing::park(this->data_seq, seq);
+		}
+
+		this->consumer_parked.store(false, std::memory_order_relaxed);
+	}
+
+	item = this->slots[h & this->mask];
+	this->head.store(h + 1, std::memory_order_release);
+	return item;
+}
+
+void SPSCRing::finish()
+{
+	this->finished.store(true, std::memory_order_seq_cst);
+
+	if (this->consumer_parked.load(std::memory_order_seq_cst))
+		SPSCRing::wake(this->data_seq);
+}
+
+void SPSCRing::abandon()
+{
+	this->abandoned.store(true, std::memory_order_seq_cst);
+}
+
+size_t SPSCRing::size() const
+{
+	return this->tail.load(std::memory_order_acquire) -
+		   this->head.load(std::memory_order_acquire) +
+		   this->overflowed.load(std::memory_order_acquire) +
+		   this->backlog_left.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,76 @@
+#ifndef LLM_RING_H
+#define LLM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace wfai {
+
+// Single producer single consumer queue of pointers.
+// Lock free while neither empty nor full. The consumer parks on a futex
+// while empty, and is woken only when the producer sees it parked.
+// put() never waits : when full, the rest are kept in an overflow list
+// under a mutex until the consumer catches up.
+class SPSCRing
+{
+public:
+	// false if the consumer is gone, item is not taken
+	bool put(void *item);
+
+	// block while empty. nullptr after finish() and all items taken
+	void *get();
+
+	// producer : no more items
+	void finish();
+
+	// consumer : no more get(), put() drops items from now on
+	void abandon();
+
+	size_t size() const;
+	size_t capacity() const { return this->mask + 1; }
+	bool is_finished() const { return this->finished.load(); }
+
+	// capacity is rounded up to power of 2
+	SPSCRing(size_t capacity);
+	~SPSCRing();
+
+	SPSCRing(const SPSCRing&) = delete;
+	SPSCRing& operator=(const SPSCRing&) = delete;
+
+private:
+	static void park(std::atomic<uint32_t>& word, uint32_t val);
+	static void wake(std::atomic<uint32_t>& word);
+
+private:
+	void **slots;
+	size_t mask;
+
+	// padding keeps each side on its own cache line, without
+	// alignas() which needs aligned new before C++17
+	char pad0[64];
+	std::atomic<size_t> head;	// next to get, by consumer
+	char pad1[64 - sizeof (std::atomic<size_t>)];
+	std::atomic<size_t> tail;	// next to put, by producer
+	char pad2[64 - sizeof (std::atomic<size_t>)];
+
+	std::atomic<uint32_t> data_seq;	// consumer parks on it
+	std::atomic<bool> consumer_parked;
+
+	std::atomic<bool> finished;
+	std::atomic<bool> abandoned;
+
+	// put after the ring, taken by consumer at once when the ring is empty
+	std::mutex overflow_mutex;
+	std::vector<void *> overflow;
+	std::atomic<size_t> overflowed;	// size of overflow
+	std::vector<void *> backlog;	// taken from overflow, by consumer
+	size_t backlog_pos;
+	std::atomic<size_t> backlog_left;
+};
+
+} // namespace wfai
+
+#endif // LLM_RING_H
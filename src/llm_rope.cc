@@ -0,0 +1,52 @@
+#include "llm_rope.h"
+
+namespace wfai {
+
+// small for short replies, large for long reasoning
+static constexpr size_t rope_min_block = 256;
+static constexpr size_t rope_max_block = 16 * 1024;
+
+void TextRope::append(const char *data, size_t size)
+{
+	size_t room;
+	size_t n;
+
+	this->total += size;
+
+	while (size != 0)
+	{
+		if (this->blocks.empty() ||
+			this->blocks.back().size() == this->blocks.back().capacity())
+		{
+			size_t cap = this->blocks.empty() ? rope_min_block :
+						 this->blocks.back().capacity() * 2;
+
+			this->blocks.emplace_back();
+			this->blocks.back().reserve(cap < rope_max_block ? cap : rope_max_block);
+		}
+
+		std::string& block = this->blocks.back();
+
+		room = block.capacity() - block.size();
+		n = size < room ? size : room;
+		block.append(data, n);
+		data += n;
+		size -= n;
+	}
+}
+
+void TextRope::flatten(std::string& out) const
+{
+	out.reserve(out.size() + this->total);
+
+	for (const std::string& block : this->blocks)
+		out.append(block);
+}
+
+void TextRope::clear()
+{
+	this->blocks.clear();
+	this->total = 0;
+}
+
+} // namespace wfai
@@ -0,0 +1,34 @@
+#ifndef LLM_ROPE_H
+#define LLM_ROPE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace wfai {
+
+// Append only text in blocks which are never reallocated, so appending
+// many small pieces copies each byte once. flatten() copies all out once
+class TextRope
+{
+public:
+	void append(const char *data, size_t size);
+	void append(const std::string& str) { this->append(str.data(), str.size()); }
+
+	// append all to out, reserved before copy
+	void flatten(std::string& out) const;
+
+	size_t size() const { return this->total; }
+	bool empty() const { return this->total == 0; }
+	void clear();
+
+	TextRope() : total(0) { }
+
+private:
+	std::vector<std::string> blocks; // reserved, never beyond capacity
+	size_t total;
+};
+
+} // namespace wfai
+
+#endif // LLM_ROPE_H
@@ -0,0 +1,368 @@
+#include <stdint.h>
+#include <chrono>
+#include "workflow/WFTaskFactory.h"
+#include "llm_scheduler.h"
+
+using namespace wfai;
+
+static constexpr uint32_t default_quantum = 4096; // tokens
+
+static inline int64_t get_current_time_us()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+RequestScheduler::RequestScheduler(int max_inflight) :
+	max_inflight(max_inflight),
+	reserved(0),
+	running(0),
+	pending(0),
+	quantum(default_quantum),
+	seq(0)
+{
+}
+
+RequestScheduler::~RequestScheduler()
+{
+	for (auto& kv : this->tenants)
+		delete kv.second;
+}
+
+int RequestScheduler::limit_of(int priority) const
+{
+	if (priority > PRIORITY_INTERACTIVE)
+		return this->max_inflight - this->reserved;
+
+	return this->max_inflight;
+}
+
+RequestScheduler::Tenant *RequestScheduler::get_tenant(const std::string& name)
+{
+	Tenant *&tenant = this->tenants[name];
+
+	if (!tenant)
+	{
+		tenant = new Tenant();
+		tenant->weight = 1;
+		tenant->max_inflight = 0;
+	}
+
+	return tenant;
+}
+
+// deficit round robin, must be called with lock
+bool RequestScheduler::pick(Lane& lane, Entry& entry,
+							std::vector<WFConditional *>& ready)
+{
+	size_t skipped = 0; // tenants at their own limit in a row
+	int64_t wait;
+
+	while (!lane.active.empty() && skipped < lane.active.size())
+	{
+		TenantQueue *tq = lane.active.front();
+		Tenant *tenant = tq->tenant;
+
+		while (!tq->entries.empty() && this->drop(tq, ready))
+			;
+
+		if (tq->entries.empty())
+		{
+			lane.active.pop_front();
+			this->retire(lane, tq);
+			continue;
+		}
+
+		if (tenant->max_inflight > 0 &&
+			tenant->stats.inflight >= tenant->max_inflight)
+		{
+			lane.active.splice(lane.active.end(), lane.active,
+							   lane.active.begin());
+			skipped++;
+			continue;
+		}
+
+		const Entry& top = tq->entries.top();
+		if (top.tokens > tq->deficit)
+		{
+			// next round, one more quantum
+			tq->deficit += (uint64_t)this->quantum * tenant->weight;
+			lane.active.splice(lane.active.end(), lane.active,
+							   lane.active.begin());
+			skipped = 0;
+			continue;
+		}
+
+		entry = top;
+		tq->entries.pop();
+		tq->deficit -= entry.tokens;
+		this->waiting.erase(entry.seq);
+
+		wait = get_current_time_us() - entry.enqueue_time;
+		tenant->stats.queued--;
+		tenant->stats.inflight++;
+		tenant->stats.admitted++;
+		tenant->stats.tokens += entry.tokens;
+		tenant->stats.total_wait += wait;
+		if (wait > tenant->stats.max_wait)
+			tenant->stats.max_wait = wait;
+
+		return true;
+	}
+
+	return false;
+}
+
+// not in lane.active any more, must be called with lock
+void RequestScheduler::retire(Lane& lane, TenantQueue *tq)
+{
+	tq->active = false;
+	tq->deficit = 0;
+
+	// one empty queue for each tenant ever seen would only grow
+	if (tq->entries.empty())
+		lane.queues.erase(tq->name);
+}
+
+// pop the head if it is dropped now or by recheck(), must be called with lock
+bool RequestScheduler::drop(TenantQueue *tq, std::vector<WFConditional *>& ready)
+{
+	auto it = this->waiting.find(tq->entries.top().seq);
+
+	if (it != this->waiting.end())
+	{
+		if (!it->second.drop || !it->second.drop())
+			return false;
+
+		ready.push_back(it->second.cond);
+		tq->tenant->stats.queued--;
+		this->pending--;
+		this->waiting.erase(it);
+	}
+
+	tq->entries.pop();
+	return true;
+}
+
+// must be called with lock
+void RequestScheduler::dispatch(std::vector<WFConditional *>& ready)
+{
+	Entry entry;
+
+	for (auto& kv : this->lanes)
+	{
+		// limit never grows with priority value, all behind are blocked
+		if (this->running >= this->limit_of(kv.first))
+			break;
+
+		// a lane with all tenants at their limits lets the next one go
+		while (this->running < this->limit_of(kv.first) &&
+			   this->pick(kv.second, entry, ready))
+		{
+			ready.push_back(entry.cond);
+			this->running++;
+			this->pending--;
+		}
+	}
+
+	auto it = this->lanes.begin();
+	while (it != this->lanes.end())
+	{
+		if (it->second.queues.empty())
+			it = this->lanes.erase(it);
+		else
+			++it;
+	}
+}
+
+// signal outside the lock, signal before start is fine
+void RequestScheduler::signal(std::vector<WFConditional *>& ready)
+{
+	for (WFConditional *cond : ready)
+		cond->signal(nullptr);
+}
+
+WFConditional *RequestScheduler::admit(SubTask *task, int priority,
+									   int64_t deadline_us)
+{
+	return this->admit(task, priority, deadline_us, "", 0);
+}
+
+WFConditional *RequestScheduler::admit(SubTask *task, int priority,
+									   int64_t deadline_us,
+									   const std::string& tenant,
+									   uint32_t tokens)
+{
+	return this->admit(task, priority, deadline_us, tenant, tokens,
+					   nullptr, nullptr);
+}
+
+WFConditional *RequestScheduler::admit(SubTask *task, int priority,
+									   int64_t deadline_us,
+									   const std::string& tenant,
+									   uint32_t tokens,
+									   std::function<bool ()> drop,
+									   uint64_t *ticket)
+{
+	WFConditional *cond = WFTaskFactory::create_conditional(task);
+	std::vector<WFConditional *> ready;
+	Entry entry;
+
+	entry.deadline = deadline_us > 0 ? deadline_us : INT64_MAX;
+	entry.enqueue_time = get_current_time_us();
+	entry.tokens = tokens;
+	entry.cond = cond;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		Lane& lane = this->lanes[priority];
+		TenantQueue *tq = &lane.queues[tenant]; // value initialized
+
+		if (!tq->tenant)
+		{
+			tq->name = tenant;
+			tq->tenant = this->get_tenant(tenant);
+		}
+
+		if (!tq->active)
+		{
+			lane.active.push_back(tq);
+			tq->active = true;
+		}
+
+		// no estimation, one request per round for weight 1
+		if (entry.tokens == 0)
+			entry.tokens = this->quantum;
+
+		entry.seq = this->seq++;
+		tq->entries.push(entry);
+		this->waiting[entry.seq] = {tq->tenant, cond, std::move(drop)};
+		tq->tenant->stats.queued++;
+		this->pending++;
+
+		this->dispatch(ready);
+	}
+
+	if (ticket)
+		*ticket = entry.seq;
+
+	this->signal(ready);
+	return cond;
+}
+
+bool RequestScheduler::recheck(uint64_t ticket)
+{
+	std::vector<WFConditional *> ready;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto it = this->waiting.find(ticket);
+
+		if (it == this->waiting.end() || !it->second.drop ||
+			!it->second.drop())
+		{
+			return false;
+		}
+
+		ready.push_back(it->second.cond);
+		it->second.tenant->stats.queued--;
+		this->pending--;
+		this->waiting.erase(it);
+	}
+
+	this->signal(ready);
+	return true;
+}
+
+void RequestScheduler::release()
+{
+	this->release("");
+}
+
+void RequestScheduler::release(const std::string& tenant)
+{
+	std::vector<WFConditional *> ready;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		this->get_tenant(tenant)->stats.inflight--;
+		this->running--;
+		this->dispatch(ready);
+	}
+
+	this->signal(ready);
+}
+
+size_t RequestScheduler::queued()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->pending;
+}
+
+int RequestScheduler::inflight()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->running;
+}
+
+void RequestScheduler::set_reserved(int slots)
+{
+	std::vector<WFConditional *> ready;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		this->reserved = slots;
+		this->dispatch(ready);
+	}
+
+	this->signal(ready);
+}
+
+void RequestScheduler::set_tenant(const std::string& name, uint32_t weight,
+								  int max_inflight)
+{
+	std::vector<WFConditional *> ready;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		Tenant *tenant = this->get_tenant(name);
+
+		tenant->weight = weight > 0 ? weight : 1;
+		tenant->max_inflight = max_inflight;
+		this->dispatch(ready);
+	}
+
+	this->signal(ready);
+}
+
+void RequestScheduler::set_quantum(uint32_t tokens)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->quantum = tokens > 0 ? tokens : 1;
+}
+
+bool RequestScheduler::get_tenant_stats(const std::string& tenant,
+										TenantStats& stats)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	auto it = this->tenants.find(tenant);
+
+	if (it == this->tenants.end())
+		return false;
+
+	stats = it->second->stats;
+	return true;
+}
+
+std::map<std::string, TenantStats> RequestScheduler::get_all_tenant_stats()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	std::map<std::string, TenantStats> all;
+
+	for (const auto& kv : this->tenants)
+		all[kv.first] = kv.second->stats;
+
+	return all;
+}
@@ -0,0 +1,150 @@
+#ifndef LLM_SCHEDULER_H
+#define LLM_SCHEDULER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <list>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include "workflow/WFTask.h"
+#include "llm_util.h"
+
+namespace wfai {
+
+struct TenantStats
+{
+	size_t queued;			// waiting for a slot now
+	int inflight;			// holding slots now
+	uint64_t admitted;		// total requests got a slot
+	uint64_t tokens;		// total estimated tokens of admitted requests
+	int64_t total_wait;		// microseconds, sum of queueing time
+	int64_t max_wait;		// microseconds
+
+	TenantStats() :
+		queued(0), inflight(0), admitted(0), tokens(0),
+		total_wait(0), max_wait(0) {}
+};
+
+// Admission control between task creation and start.
+// Lower priority value runs first. Inside one priority, tenants share
+// slots by weight with deficit round robin on estimated tokens, and
+// requests of one tenant run by earliest deadline, then FIFO.
+// Deadlines only order requests of the same tenant and priority, a near
+// deadline never lets a request overtake the turn of another tenant.
+// Use a lower priority value for requests which must jump the queue.
+// A granted slot is held until release(), across tool call rounds.
+class RequestScheduler
+{
+public:
+	// task runs in the series of the returned conditional once admitted
+	WFConditional *admit(SubTask *task, int priority, int64_t deadline_us);
+	WFConditional *admit(SubTask *task, int priority, int64_t deadline_us,
+						 const std::string& tenant, uint32_t tokens);
+	// drop is called with the lock held by recheck(), or when the request
+	// is the head of its tenant queue to get a slot. true takes it out,
+	// signaled without a slot and not to be released, such as a request
+	// cancelled while queued. ticket is for recheck()
+	WFConditional *admit(SubTask *task, int priority, int64_t deadline_us,
+						 const std::string& tenant, uint32_t tokens,
+						 std::function<bool ()> drop, uint64_t *ticket);
+	// call drop of a request still queued at once, e.g. when cancelled,
+	// and signal it if dropped, in this thread. Its place in the queue is
+	// erased when it comes to the head. false if not dropped
+	bool recheck(uint64_t ticket);
+	void release();
+	void release(const std::string& tenant);
+
+	size_t queued();
+	int inflight();
+
+	// keep some slots for PRIORITY_INTERACTIVE only
+	void set_reserved(int slots);
+
+	// unknown tenants have weight 1 and no limit of their own
+	void set_tenant(const std::string& tenant, uint32_t weight,
+					int max_inflight);
+	// tokens granted to a tenant of weight 1 in each round
+	void set_quantum(uint32_t tokens);
+
+	bool get_tenant_stats(const std::string& tenant, TenantStats& stats);
+	std::map<std::string, TenantStats> get_all_tenant_stats();
+
+	RequestScheduler(int max_inflight);
+	~RequestScheduler();
+
+private:
+	struct Entry
+	{
+		int64_t deadline; // absolute microseconds, INT64_MAX if none
+		int64_t enqueue_time;
+		uint64_t seq;
+		uint32_t tokens;
+		WFConditional *cond;
+
+		bool operator< (const Entry& e) const
+		{
+			if (this->deadline != e.deadline)
+				return this->deadline > e.deadline;
+			return this->seq > e.seq;
+		}
+	};
+
+	struct Tenant
+	{
+		uint32_t weight;
+		int max_inflight; // <= 0 : no limit
+		TenantStats stats;
+	};
+
+	// requests of one tenant in one priority, erased when empty
+	struct TenantQueue
+	{
+		std::string name;
+		Tenant *tenant;
+		std::priority_queue<Entry> entries;
+		uint64_t deficit;
+		bool active;
+	};
+
+	// a request in a queue, not dropped or admitted yet
+	struct Waiting
+	{
+		Tenant *tenant;
+		WFConditional *cond;
+		std::function<bool ()> drop;
+	};
+
+	struct Lane
+	{
+		std::unordered_map<std::string, TenantQueue> queues;
+		std::list<TenantQueue *> active;
+	};
+
+	int limit_of(int priority) const;
+	Tenant *get_tenant(const std::string& name);
+	bool pick(Lane& lane, Entry& entry, std::vector<WFConditional *>& ready);
+	bool drop(TenantQueue *tq, std::vector<WFConditional *>& ready);
+	void retire(Lane& lane, TenantQueue *tq);
+	void dispatch(std::vector<WFConditional *>& ready);
+	void signal(std::vector<WFConditional *>& ready);
+
+private:
+	std::mutex mutex;
+	std::map<int, Lane> lanes;
+	std::unordered_map<std::string, Tenant *> tenants;
+	std::unordered_map<uint64_t, Waiting> waiting; // by seq of entry
+	int max_inflight;
+	int reserved;
+	int running;
+	size_t pending;
+	uint32_t quantum;
+	uint64_t seq;
+};
+
+} // namespace wfai
+
+#endif // LLM_SCHEDULER_H
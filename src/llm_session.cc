@@ -1,4 +1,7 @@
 #include "llm_session.h"
+#include "llm_compress.h"
+#include "llm_arena.h"
+#include "llm_result_set.h"
 
 using namespace wfai;
 
@@ -9,12 +12,22 @@ SessionContext::SessionContext(ChatCompletionRequest *req,
 							   bool flag) :
 	req(req), resp(resp),
 	extract(std::move(extract)), callback(std::move(callback)),
-	flag(flag), result(nullptr)
+	prepared(nullptr),
+	cacheable(false), cache_key(0), cache_check(0),
+	latency(nullptr), start_time(0), last_time(0),
+	encoding_checked(false), inflater(nullptr),
+	scheduled(false), cancel_hook(0),
+	key_index(-1), key_tokens(0),
+	arena(nullptr),
+	cancelled(false), overflowed(false), chunks(0),
+	flag(flag), result(nullptr), flight(nullptr)
 {
 }
 
 SessionContext::~SessionContext()
 {
+	delete this->inflater;
+
 	if (this->flag)
 	{
 		delete this->req;
@@ -22,6 +35,14 @@ SessionContext::~SessionContext()
 	}
 }
 
+void SessionContext::destroy(SessionContext *ctx)
+{
+	if (ctx->arena)
+		Arena::destroy(ctx->arena);
+	else
+		delete ctx;
+}
+
 void SessionContext::set_callback(llm_callback_t cb)
 {
 	this->callback = std::move(cb);
@@ -49,9 +70,50 @@ void SessionContext::async_msgqueue_put(ChatCompletionChunk *chunk)
 	this->result->msg_queue_put(chunk);
 }
 
-void SessionContext::async_msgqueue_set_nonblock()
+void SessionContext::async_msgqueue_finish()
+{
+	this->result->msg_queue_finish();
+}
+
+void SessionContext::async_msgqueue_reserve(size_t capacity)
+{
+	this->result->msg_queue_reserve(capacity);
+}
+
+bool SessionContext::cancel_requested() const
+{
+	if (this->req->cancel.is_cancelled())
+		return true;
+
+	return this->result && this->result->is_cancelled();
+}
+
+bool SessionContext::is_abandoned() const
+{
+	return this->result && this->result->is_abandoned() && !this->flight;
+}
+
+void SessionContext::set_flight(Flight *flight)
+{
+	this->flight = flight;
+}
+
+Flight *SessionContext::get_flight() const
+{
+	return this->flight;
+}
+
+void SessionContext::swap_user(SessionContext *other)
 {
-	this->result->msg_queue_set_nonblock();
+	std::swap(this->req, other->req);
+	std::swap(this->resp, other->resp);
+	std::swap(this->extract, other->extract);
+	std::swap(this->callback, other->callback);
+	std::swap(this->batch_extract, other->batch_extract);
+	std::swap(this->prepared, other->prepared);
+	std::swap(this->flag, other->flag);
+	std::swap(this->result, other->result);
+	std::swap(this->overflowed, other->overflowed);
 }
 
 ////////// AsyncResult //////////////
@@ -63,7 +125,12 @@ AsyncResult::AsyncResult()
 
 AsyncResult::~AsyncResult()
 {
-	this->ptr->decref();
+	if (this->ptr)
+	{
+		// never block the producer for a consumer which is gone
+		this->ptr->abandon();
+		this->ptr->decref();
+	}
 }
 
 ChatCompletionChunk *AsyncResult::get_chunk()
@@ -91,6 +158,12 @@ AsyncResult& AsyncResult::operator=(AsyncResult&& move)
 {
 	if (this != &move)
 	{
+		if (this->ptr)
+		{
+			this->ptr->abandon();
+			this->ptr->decref();
+		}
+
 		this->ptr = move.ptr;
 		move.ptr = nullptr;
 	}
@@ -98,10 +171,19 @@ AsyncResult& AsyncResult::operator=(AsyncResult&& move)
 	return *this;
 }
 
-void AsyncResult::msg_queue_create(size_t len)
+void AsyncResult::cancel()
+{
+	this->ptr->cancel();
+}
+
+size_t AsyncResult::pending_chunks() const
+{
+	return this->ptr->msg_queue_size();
+}
+
+void AsyncResult::msg_queue_create(size_t capacity)
 {
-	this->ptr->msgqueue = msgqueue_create(len,
-							sizeof(struct ChatCompletionChunk));
+	this->ptr->msgqueue = new SPSCRing(capacity);
 }
 
 bool AsyncResult::success() const
@@ -124,7 +206,15 @@ AsyncResultPtr::AsyncResultPtr() :
 	success(false),
 	status_code(0),
 	current_chunk(nullptr),
-	response(nullptr)
+	response(nullptr),
+	msgqueue(nullptr),
+	done(false),
+	cancelled(false),
+	abandoned(false),
+	response_waited(false),
+	watched(false),
+	watch_set(nullptr),
+	watch_id(-1)
 {
 	this->promise = new WFPromise<ChatCompletionResponse *>();
 	this->future = this->promise->get_future();
@@ -145,17 +235,17 @@ void AsyncResultPtr::clear()
 
 	if (this->msgqueue)
 	{
-		msgqueue_set_nonblock(this->msgqueue);
+		// the last reference, producer is done
+		this->msgqueue->finish();
 		while (true)
 		{
-			ChatCompletionChunk *chunk;
-			chunk = static_cast<ChatCompletionChunk *>(msgqueue_get(this->msgqueue));
+			ChatCompletionChunk *chunk = this->msg_queue_get();
 			if (chunk == nullptr)
 				break;
 			delete chunk;
 		}
 
-		msgqueue_destroy(this->msgqueue);
+		delete this->msgqueue;
 	}
 }
 
@@ -167,14 +257,16 @@ ChatCompletionChunk *AsyncResultPtr::get_chunk()
 	if (this->current_chunk)
 		delete this->current_chunk;
 
-	this->current_chunk =
-		static_cast<ChatCompletionChunk *>(msgqueue_get(this->msgqueue));
+	this->current_chunk = this->msg_queue_get();
 
 	return this->current_chunk;
 }
 
 ChatCompletionResponse *AsyncResultPtr::get_response()
 {
+	// chunks are kept for get_chunk() later, the stream is not stopped
+	this->response_waited = true;
+
 	ChatCompletionResponse *resp = this->future.get();
 	return resp;
 }
@@ -197,17 +289,132 @@ bool AsyncResultPtr::is_streaming() const
 
 void AsyncResultPtr::msg_queue_put(ChatCompletionChunk *chunk)
 {
-	msgqueue_put(chunk, this->msgqueue);
+	if (!this->msgqueue->put(chunk))
+		delete chunk;
+	else
+		this->notify();
 }
 
 ChatCompletionChunk *AsyncResultPtr::msg_queue_get()
 {
-	return static_cast<ChatCompletionChunk *>(msgqueue_get(this->msgqueue));
+	return static_cast<ChatCompletionChunk *>(this->msgqueue->get());
+}
+
+void AsyncResultPtr::msg_queue_finish()
+{
+	this->msgqueue->finish();
+	this->notify();
+}
+
+
+void AsyncResultPtr::msg_queue_reserve(size_t capacity)
+{
+	if (this->msgqueue->capacity() < capacity &&
+		this->msgqueue->size() == 0)
+	{
+		delete this->msgqueue;
+		this->msgqueue = new SPSCRing(capacity);
+	}
+}
+
+size_t AsyncResultPtr::msg_queue_size() const
+{
+	return this->msgqueue ? this->msgqueue->size() : 0;
 }
 
-void AsyncResultPtr::msg_queue_set_nonblock()
+void AsyncResultPtr::cancel()
 {
-	msgqueue_set_nonblock(this->msgqueue);
+	this->cancelled = true;
+	this->run_cancel_hook();
+}
+
+bool AsyncResultPtr::is_cancelled() const
+{
+	return this->cancelled;
+}
+
+void AsyncResultPtr::abandon()
+{
+	this->abandoned = true;
+	if (this->msgqueue)
+		this->msgqueue->abandon();
+
+	this->run_cancel_hook();
+}
+
+bool AsyncResultPtr::is_abandoned() const
+{
+	return this->abandoned;
+}
+
+void AsyncResultPtr::set_cancel_hook(std::function<void ()> hook)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->hook_mutex);
+
+		if (!this->cancelled && !this->abandoned)
+		{
+			this->cancel_hook = std::move(hook);
+			return;
+		}
+	}
+
+	hook();
+}
+
+void AsyncResultPtr::run_cancel_hook()
+{
+	std::function<void ()> hook;
+
+	{
+		std::lock_guard<std::mutex> lock(this->hook_mutex);
+		hook.swap(this->cancel_hook);
+	}
+
+	if (hook)
+		hook();
+}
+
+bool AsyncResultPtr::is_response_waited() const
+{
+	return this->response_waited;
+}
+
+void AsyncResultPtr::set_done()
+{
+	this->done = true;
+	this->notify();
+}
+
+bool AsyncResultPtr::is_ready() const
+{
+	if (this->msgqueue)
+		return this->msgqueue->size() != 0 || this->msgqueue->is_finished();
+
+	return this->done;
+}
+
+int AsyncResultPtr::set_watcher(AsyncResultSet *set, int id)
+{
+	std::lock_guard<std::mutex> lock(this->watch_mutex);
+	int old_id = this->watch_id;
+
+	this->watch_set = set;
+	this->watch_id = id;
+	this->watched = (set != nullptr);
+	return old_id;
+}
+
+void AsyncResultPtr::notify()
+{
+	// almost free for results in no set
+	if (!this->watched)
+		return;
+
+	std::lock_guard<std::mutex> lock(this->watch_mutex);
+
+	if (this->watch_set)
+		this->watch_set->notify(this->watch_id);
 }
 
 void AsyncResultPtr::set_status_code(int code)
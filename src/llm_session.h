@@ -3,16 +3,22 @@
 
 #include <string>
 #include <atomic>
+#include <mutex>
 #include "workflow/WFFuture.h"
-#include "workflow/msgqueue.h"
 #include "llm_util.h"
 #include "chat_response.h"
 #include "chat_request.h"
 #include "llm_function.h"
+#include "llm_ring.h"
 
 namespace wfai {
 
 class AsyncResultPtr;
+class AsyncResultSet;
+class Arena;
+class Flight;
+class LatencyStats;
+class StreamInflater;
 
 struct SyncResult
 {
@@ -33,9 +39,17 @@ public:
 	bool success() const;
 	int status_code() const;
 	const std::string& error_message() const;
-
-	// for LLMClient
-	void msg_queue_create(size_t len);
+	// stop at the next chunk, then the last chunk is RESPONSE_CANCELLED.
+	// Workflow can not abort a read, so it is seen only when the next
+	// chunk arrives, or the task ends at its TTFT / TPOT timeout. A non
+	// streaming response not sent chunked runs to its end. One waiting
+	// for a slot of scheduler is finished at once.
+	void cancel();
+	// chunks received but not taken by get_chunk() yet
+	size_t pending_chunks() const;
+
+	// for LLMClient. chunks over capacity are kept in overflow
+	void msg_queue_create(size_t capacity);
 
 public:
 	AsyncResult();
@@ -57,6 +71,48 @@ public:
 	llm_extract_t extract;
 	llm_callback_t callback;
 
+	// instead of extract, with chunks kept for reuse in the next read
+	llm_batch_extract_t batch_extract;
+	std::vector<ChatCompletionChunk> chunk_batch;
+
+	// serialized req, reused by cache, coalescing and task of this round
+	const PreparedChatRequest *prepared; // not owned, may be nullptr
+	std::string body;
+
+	// for response cache
+	bool cacheable;
+	uint64_t cache_key;
+	uint64_t cache_check;
+	std::string cache_record; // raw bytes from server : json or SSE
+
+	// for latency statistics
+	LatencyStats *latency;
+	int64_t start_time;	// microseconds, when task dispatched
+	int64_t last_time;	// microseconds, when last chunk received
+
+	// for Content-Encoding of response, checked at the first chunk
+	bool encoding_checked;
+	StreamInflater *inflater;
+	std::string partial; // inflated SSE not ended by a blank line yet
+
+	// holding a slot of RequestScheduler until finished
+	bool scheduled;
+	std::string tenant;
+	uint64_t cancel_hook; // on req->cancel while queued, 0 : none
+
+	// the key from ApiKeyPool for the current round, -1 : none
+	int key_index;
+	uint32_t key_tokens;
+
+	// ctx, req, resp and tool calls data of this request are all in it
+	Arena *arena;
+
+	// cancel of request or AsyncResult is seen, reading is stopped
+	bool cancelled;
+	// too many chunks not taken by the consumer, stopped as cancelled
+	bool overflowed;
+	int chunks; // stream chunks received, for usage of cancelled one
+
 public:
 	SessionContext(ChatCompletionRequest *req,
 				   ChatCompletionResponse *resp,
@@ -66,17 +122,33 @@ public:
 
 	~SessionContext();
 
+	// delete ctx, or destroy its arena
+	static void destroy(SessionContext *ctx);
+
 	void set_callback(llm_callback_t cb);
 
 	void set_async_result(AsyncResult *result);
 	AsyncResultPtr *get_async_result() const;
 	bool is_async_streaming() const;
 	void async_msgqueue_put(ChatCompletionChunk *chunk);
-	void async_msgqueue_set_nonblock();
+	void async_msgqueue_finish();
+	// before the user sees the result only, e.g. replaying from cache
+	void async_msgqueue_reserve(size_t capacity);
+
+	bool cancel_requested() const;
+	// nobody waits for the result, not even coalesced requests
+	bool is_abandoned() const;
+
+	void set_flight(Flight *flight);
+	Flight *get_flight() const;
+	// exchange req, resp, callbacks and result with other, so this serves
+	// the user of other, e.g. a waiter taking the task of its leader
+	void swap_user(SessionContext *other);
 
 private:
 	bool flag; // whether ctx responsible for req and resp
 	AsyncResultPtr *result; // for async
+	Flight *flight; // for coalescing, only the leader has it
 };
 
 class AsyncResultPtr
@@ -102,10 +174,33 @@ public:
 	bool is_streaming() const;
 	void msg_queue_put(ChatCompletionChunk *chunk);
 	ChatCompletionChunk *msg_queue_get();
-	void msg_queue_set_nonblock();
+	void msg_queue_finish(); // get() returns nullptr once drained
+	void msg_queue_reserve(size_t capacity); // while no chunk in it
+	size_t msg_queue_size() const;
+
+	// response is set, called after the promise
+	void set_done();
+
+	void cancel();
+	bool is_cancelled() const;
+
+	// user is gone, put() drops chunks, not sent if still queued
+	void abandon();
+	bool is_abandoned() const;
+	// runs once at cancel() or abandon(), at once if either is done
+	void set_cancel_hook(std::function<void ()> hook);
+
+	// get_chunk() or get_response() would not block
+	bool is_ready() const;
+	// get_response() is waited, chunks not taken are no slow consumer
+	bool is_response_waited() const;
+	// report put / finish / done to set, nullptr to stop, returns old id
+	int set_watcher(AsyncResultSet *set, int id);
 
 private:
 	void clear();
+	void notify();
+	void run_cancel_hook();
 
 private:
 	std::atomic<int> ref;
@@ -116,7 +211,19 @@ private:
 	ChatCompletionResponse *response;
 	WFPromise<ChatCompletionResponse *> *promise;
 	WFFuture<ChatCompletionResponse *> future;
-	msgqueue_t *msgqueue;
+	SPSCRing *msgqueue;
+	std::atomic<bool> done;
+	std::atomic<bool> cancelled;
+	std::atomic<bool> abandoned;
+	std::atomic<bool> response_waited;
+
+	std::atomic<bool> watched;
+	std::mutex watch_mutex;
+	AsyncResultSet *watch_set;
+	int watch_id;
+
+	std::mutex hook_mutex;
+	std::function<void ()> cancel_hook;
 
 	friend class AsyncResult;
 };
@@ -0,0 +1,258 @@
+#include <ctype.h>
+#include <algorithm>
+#include "llm_util.h"
+#include "llm_similar_cache.h"
+
+namespace wfai {
+
+constexpr int SimilarCache::minhash_size;
+constexpr int SimilarCache::band_rows;
+constexpr int SimilarCache::bands;
+
+static inline uint64_t mix64(uint64_t x)
+{
+	// splitmix64 finalizer
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static inline uint64_t hash_combine(uint64_t seed, const std::string& s)
+{
+	return mix64(seed ^ fnv1a_hash(s.data(), s.size()));
+}
+
+// fold case and whitespace, then take words and word pairs as shingles
+static void make_shingles(const std::string& text,
+						  std::vector<uint64_t>& shingles)
+{
+	std::vector<uint64_t> words;
+	std::string word;
+
+	for (size_t i = 0; i <= text.size(); i++)
+	{
+		unsigned char c = i < text.size() ? text[i] : ' ';
+
+		if (isspace(c) || (c < 0x80 && ispunct(c)))
+		{
+			if (!word.empty())
+			{
+				words.push_back(fnv1a_hash(word.data(), word.size()));
+				word.clear();
+			}
+		}
+		else
+			word += (char)tolower(c);
+	}
+
+	for (size_t i = 0; i < words.size(); i++)
+	{
+		shingles.push_back(words[i]);
+		if (i + 1 < words.size())
+			shingles.push_back(mix64(words[i] * 31 + words[i + 1]));
+	}
+}
+
+SimilarCache::SimilarCache(double threshold, size_t max_entries) :
+	threshold(threshold),
+	max_entries(max_entries)
+{
+}
+
+bool SimilarCache::make_signature(const ChatCompletionRequest& req,
+								  Signature& sig)
+{
+	if (req.messages.empty() || req.messages.back().role != "user")
+		return false;
+
+	uint64_t fp = hash_combine(0, req.model);
+
+	// answers of one tenant are never served to another
+	fp = hash_combine(fp, req.tenant);
+	fp = hash_combine(fp, req.response_format);
+	fp = hash_combine(fp, req.tool_choice);
+	fp = mix64(fp ^ (uint64_t)req.max_tokens);
+	fp = mix64(fp ^ (uint64_t)(req.top_p * 1000000));
+	fp = mix64(fp ^ (uint64_t)(req.temperature * 1000000));
+	fp = mix64(fp ^ (uint64_t)(req.frequency_penalty * 1000000));
+	fp = mix64(fp ^ (uint64_t)(req.presence_penalty * 1000000));
+
+	// the whole definition, the same name may take other parameters
+	for (const auto& tool : req.tools)
+	{
+		const FunctionDefinition& func = tool.function;
+
+		fp = hash_combine(fp, tool.type);
+		fp = hash_combine(fp, func.name);
+		fp = hash_combine(fp, func.description);
+		fp = hash_combine(fp, func.parameters.type);
+
+		for (const auto& kv : func.parameters.properties)
+		{
+			fp = hash_combine(fp, kv.first);
+			fp = hash_combine(fp, kv.second.type);
+			fp = hash_combine(fp, kv.second.description);
+			fp = hash_combine(fp, kv.second.default_value);
+
+			for (const auto& value : kv.second.enum_values)
+				fp = hash_combine(fp, value);
+		}
+
+		for (const auto& name : func.parameters.required)
+			fp = hash_combine(fp, name);
+	}
+
+	for (const auto& stop : req.stop)
+		fp = hash_combine(fp, stop);
+
+	auto add = [&fp](const Message& msg) {
+		fp = hash_combine(fp, msg.role);
+		fp = hash_combine(fp, msg.content);
+		fp = hash_combine(fp, msg.tool_call_id);
+
+		for (const auto& tc : msg.tool_calls)
+		{
+			fp = hash_combine(fp, tc.id);
+			fp = hash_combine(fp, tc.function.name);
+			fp = hash_combine(fp, tc.function.arguments);
+		}
+	};
+
+	req.history.for_each(add);
+	for (size_t i = 0; i + 1 < req.messages.size(); i++)
+		add(req.messages[i]);
+
+	std::vector<uint64_t> shingles;
+	make_shingles(req.messages.back().content, shingles);
+	if (shingles.empty())
+		return false;
+
+	sig.fingerprint = fp;
+
+	for (int i = 0; i < minhash_size; i++)
+	{
+		uint64_t seed = mix64(i + 1);
+		uint32_t min = UINT32_MAX;
+
+		for (uint64_t sh : shingles)
+			min = std::min(min, (uint32_t)mix64(sh ^ seed));
+
+		sig.minhash[i] = min;
+	}
+
+	return true;
+}
+
+uint64_t SimilarCache::band_key(const Signature& sig, int band)
+{
+	uint64_t key = mix64(sig.fingerprint ^ band);
+
+	for (int i = band * band_rows; i < (band + 1) * band_rows; i++)
+		key = mix64(key ^ sig.minhash[i]);
+
+	return key;
+}
+
+double SimilarCache::similarity(const Signature& a, const Signature& b)
+{
+	int same = 0;
+
+	if (a.fingerprint != b.fingerprint)
+		return 0;
+
+	for (int i = 0; i < minhash_size; i++)
+	{
+		if (a.minhash[i] == b.minhash[i])
+			same++;
+	}
+
+	return (double)same / minhash_size;
+}
+
+bool SimilarCache::get(const ChatCompletionRequest& req,
+					   ChatCompletionResponse& resp)
+{
+	Signature sig;
+
+	if (!make_signature(req, sig))
+		return false;
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	const Entry *best = nullptr;
+	double best_sim = this->threshold;
+
+	for (int band = 0; band < bands; band++)
+	{
+		auto it = this->buckets.find(band_key(sig, band));
+		if (it == this->buckets.end())
+			continue;
+
+		for (const Entry *entry : it->second)
+		{
+			double sim = similarity(sig, entry->sig);
+			if (sim >= best_sim)
+			{
+				best = entry;
+				best_sim = sim;
+			}
+		}
+	}
+
+	if (!best)
+		return false;
+
+	resp = best->response;
+	return true;
+}
+
+void SimilarCache::put(const ChatCompletionRequest& req,
+					   const ChatCompletionResponse& resp)
+{
+	Signature sig;
+
+	if (!make_signature(req, sig))
+		return;
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (this->max_entries == 0)
+		return;
+
+	while (this->entries.size() >= this->max_entries)
+		this->evict();
+
+	this->entries.emplace_back();
+	Entry& entry = this->entries.back();
+	entry.sig = sig;
+	entry.response = resp;
+
+	for (int band = 0; band < bands; band++)
+	{
+		entry.band_keys[band] = band_key(sig, band);
+		this->buckets[entry.band_keys[band]].push_back(&entry);
+	}
+}
+
+void SimilarCache::evict()
+{
+	Entry& entry = this->entries.front();
+
+	for (int band = 0; band < bands; band++)
+	{
+		auto it = this->buckets.find(entry.band_keys[band]);
+		if (it == this->buckets.end())
+			continue;
+
+		auto& vec = it->second;
+		vec.erase(std::remove(vec.begin(), vec.end(), &entry), vec.end());
+		if (vec.empty())
+			this->buckets.erase(it);
+	}
+
+	this->entries.pop_front();
+}
+
+} // namespace wfai
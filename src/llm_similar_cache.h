@@ -0,0 +1,70 @@
+#ifndef LLM_SIMILAR_CACHE_H
+#define LLM_SIMILAR_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "chat_request.h"
+#include "chat_response.h"
+
+namespace wfai {
+
+// Near-duplicate tier for non streaming responses.
+//
+// Requests match when everything except the final user message is the same
+// (conversation fingerprint), and the final user messages are similar enough.
+// Similarity is Jaccard over word shingles after folding case and whitespace,
+// estimated by MinHash signatures and indexed by LSH banding.
+class SimilarCache
+{
+public:
+	bool get(const ChatCompletionRequest& req, ChatCompletionResponse& resp);
+	void put(const ChatCompletionRequest& req,
+			 const ChatCompletionResponse& resp);
+
+public:
+	SimilarCache(double threshold, size_t max_entries);
+	SimilarCache() : SimilarCache(0.8, 4096) {}
+
+	SimilarCache(const SimilarCache&) = delete;
+	SimilarCache& operator=(const SimilarCache&) = delete;
+
+private:
+	static constexpr int minhash_size = 64;
+	static constexpr int band_rows = 4;
+	static constexpr int bands = minhash_size / band_rows;
+
+	struct Signature
+	{
+		uint64_t fingerprint;
+		uint32_t minhash[minhash_size];
+	};
+
+	struct Entry
+	{
+		Signature sig;
+		ChatCompletionResponse response;
+		uint64_t band_keys[bands];
+	};
+
+	static bool make_signature(const ChatCompletionRequest& req,
+							   Signature& sig);
+	static uint64_t band_key(const Signature& sig, int band);
+	static double similarity(const Signature& a, const Signature& b);
+
+	void evict();
+
+private:
+	std::mutex mutex;
+	double threshold;
+	size_t max_entries;
+	std::list<Entry> entries; // FIFO
+	std::unordered_map<uint64_t, std::vector<Entry *>> buckets;
+};
+
+} // namespace wfai
+
+#endif // LLM_SIMILAR_CACHE_H
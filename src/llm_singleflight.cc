@@ -0,0 +1,75 @@
+#include "llm_util.h"
+#include "llm_singleflight.h"
+
+namespace wfai {
+
+Flight *SingleFlight::join(const std::string& body, SessionContext *ctx)
+{
+	uint64_t key = fnv1a_hash(body.data(), body.size());
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	auto it = this->flights.find(key);
+	if (it != this->flights.end())
+	{
+		// hash collision with a different request : not coalesce
+		if (it->second->body == body)
+		{
+			it->second->waiters.push_back(ctx);
+			return nullptr;
+		}
+
+		Flight *flight = new Flight();
+		flight->joinable = false;
+		return flight;
+	}
+
+	Flight *flight = new Flight();
+	flight->key = key;
+	flight->body = body;
+	this->flights.emplace(key, flight);
+	return flight;
+}
+
+void SingleFlight::leave(Flight *flight)
+{
+	// called at each chunk of a streaming leader
+	if (flight->left)
+		return;
+
+	flight->left = true;
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (!flight->joinable)
+		return;
+
+	flight->joinable = false;
+
+	auto it = this->flights.find(flight->key);
+	if (it != this->flights.end() && it->second == flight)
+		this->flights.erase(it);
+}
+
+void SingleFlight::detach(Flight *flight,
+						  const std::function<bool (SessionContext *)>& gone,
+						  std::vector<SessionContext *>& detached)
+{
+	std::unique_lock<std::mutex> lock(this->mutex, std::defer_lock);
+	std::vector<SessionContext *>& waiters = flight->waiters;
+	size_t n = 0;
+
+	// duplicates may still be joining
+	if (!flight->left)
+		lock.lock();
+
+	for (SessionContext *waiter : waiters)
+	{
+		if (gone(waiter))
+			detached.push_back(waiter);
+		else
+			waiters[n++] = waiter;
+	}
+
+	waiters.resize(n);
+}
+
+} // namespace wfai
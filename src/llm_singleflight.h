@@ -0,0 +1,52 @@
+#ifndef LLM_SINGLEFLIGHT_H
+#define LLM_SINGLEFLIGHT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+
+namespace wfai {
+
+class SessionContext;
+
+// One in-flight request and the duplicates attached to it
+class Flight
+{
+public:
+	uint64_t key;
+	std::string body;						// serialized request
+	std::vector<SessionContext *> waiters;	// frozen after leave()
+	bool joinable;
+	bool left;								// by the leader only, no lock
+
+	Flight() : key(0), joinable(true), left(false) {}
+};
+
+// Coalesce byte-identical requests while one of them is in flight
+class SingleFlight
+{
+public:
+	// return a new Flight led by ctx, or nullptr if ctx became a waiter
+	Flight *join(const std::string& body, SessionContext *ctx);
+
+	// stop accepting waiters, then waiters can be used without lock.
+	// by the leader, only the first call takes the lock
+	void leave(Flight *flight);
+
+	// by the leader, move the waiters for which gone() is true out of
+	// flight to detached, the lock is taken only before leave()
+	void detach(Flight *flight,
+				const std::function<bool (SessionContext *)>& gone,
+				std::vector<SessionContext *>& detached);
+
+private:
+	std::mutex mutex;
+	std::unordered_map<uint64_t, Flight *> flights;
+};
+
+} // namespace wfai
+
+#endif // LLM_SINGLEFLIGHT_H
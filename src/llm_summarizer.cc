@@ -0,0 +1,193 @@
+#include <string.h>
+#include "llm_summarizer.h"
+
+using namespace wfai;
+
+constexpr size_t MemorySummarizer::default_threshold;
+constexpr size_t MemorySummarizer::default_keep_tokens;
+constexpr int MemorySummarizer::default_summary_tokens;
+
+const char *const MemorySummarizer::summary_header =
+	"Summary of the earlier conversation:\n";
+
+static constexpr const char *default_prompt =
+	"Summarize the conversation below so that it can be continued "
+	"without it. Keep facts, decisions, names, numbers, results of tool "
+	"calls and open questions. Be concise, do not add anything new.";
+
+static bool is_summary(const Message& msg)
+{
+	return msg.role == "system" &&
+		   msg.content.compare(0, strlen(MemorySummarizer::summary_header),
+							   MemorySummarizer::summary_header) == 0;
+}
+
+// summarized messages as text of one user message, so the request does
+// not depend on rules of roles and tool call ids
+static void append_transcript(const Message& msg, std::string& text)
+{
+	if (is_summary(msg))
+	{
+		text += msg.content.substr(strlen(MemorySummarizer::summary_header));
+		text += "\n\n";
+		return;
+	}
+
+	text += msg.role;
+	text += ": ";
+	text += msg.content;
+
+	for (const ToolCall& tc : msg.tool_calls)
+	{
+		text += "\n[call ";
+		text += tc.function.name;
+		text += "(";
+		text += tc.function.arguments;
+		text += ")]";
+	}
+
+	text += "\n\n";
+}
+
+MemorySummarizer::MemorySummarizer(LLMClient *client, SessionMemory *memory) :
+	client(client),
+	memory(memory),
+	prompt(default_prompt),
+	threshold(default_threshold),
+	keep_tokens(default_keep_tokens),
+	summary_tokens(default_summary_tokens)
+{
+}
+
+bool MemorySummarizer::begin(const std::string& session_id)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->running.insert(session_id).second;
+}
+
+void MemorySummarizer::end(const std::string& session_id)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->running.erase(session_id);
+	if (this->running.empty())
+		this->cond.notify_all();
+}
+
+void MemorySummarizer::wait()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while (!this->running.empty())
+		this->cond.wait(lock);
+}
+
+WFConditional *MemorySummarizer::create_compact_task(const std::string& session_id)
+{
+	uint64_t version;
+	MessageHistory history = this->memory->get_versioned_history(session_id,
+																 version);
+	if (history.tokens() <= this->threshold)
+		return nullptr;
+
+	std::vector<const Message *> messages;
+	std::vector<uint32_t> counts;
+
+	history.for_each_since(0, [&](const Message& msg, uint32_t n) {
+		messages.push_back(&msg);
+		counts.push_back(n);
+	});
+
+	// system prompts stay, an earlier summary is summarized again
+	size_t pinned = 0;
+	while (pinned < messages.size() && messages[pinned]->role == "system" &&
+		   !is_summary(*messages[pinned]))
+	{
+		pinned++;
+	}
+
+	// cut before a user message, the oldest one in keep_tokens, or the
+	// newest one if the last turn is longer
+	size_t cut = messages.size();
+	size_t newest = messages.size();
+	size_t kept = 0;
+
+	for (size_t i = messages.size(); i > pinned; i--)
+	{
+		bool user = (messages[i - 1]->role == "user");
+
+		if (user && newest == messages.size())
+			newest = i - 1;
+
+		kept += counts[i - 1];
+		if (kept > this->keep_tokens)
+			break;
+
+		if (user)
+			cut = i - 1;
+	}
+
+	if (cut == messages.size())
+		cut = newest;
+
+	// one message is not worth it
+	if (cut == messages.size() || cut < pinned + 2)
+		return nullptr;
+
+	if (!this->begin(session_id))
+		return nullptr;
+
+	ChatCompletionRequest request;
+	std::string transcript;
+	std::vector<Message> front;
+
+	for (size_t i = pinned; i < cut; i++)
+		append_transcript(*messages[i], transcript);
+
+	for (size_t i = 0; i < pinned; i++)
+		front.push_back(*messages[i]);
+
+	if (!this->model.empty())
+		request.model = this->model;
+
+	request.max_tokens = this->summary_tokens;
+	request.priority = PRIORITY_BACKGROUND;
+	request.messages.push_back(Message("system", this->prompt));
+	request.messages.push_back(Message("user", transcript));
+
+	return this->client->create_scheduled_chat_task(std::move(request),
+		nullptr,
+		[this, session_id, version, cut, front](WFHttpChunkedTask *task,
+												ChatCompletionRequest *,
+												ChatCompletionResponse *resp) mutable
+		{
+			SyncResult result;
+
+			LLMClient::make_sync_result(task, resp, result);
+			if (result.success && !result.response.choices.empty() &&
+				!result.response.choices[0].message.content.empty())
+			{
+				std::string content = summary_header;
+
+				content += result.response.choices[0].message.content;
+				front.push_back(Message("system", content));
+
+				// fails if cleared or compacted since the snapshot
+				this->memory->replace_front(session_id, version, cut,
+											std::move(front));
+			}
+
+			this->end(session_id);
+		});
+}
+
+bool MemorySummarizer::compact(const std::string& session_id)
+{
+	WFConditional *task = this->create_compact_task(session_id);
+
+	if (!task)
+		return false;
+
+	task->start();
+	return true;
+}
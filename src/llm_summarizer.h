@@ -0,0 +1,76 @@
+#ifndef LLM_SUMMARIZER_H
+#define LLM_SUMMARIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include "workflow/WFTaskFactory.h"
+#include "llm_client.h"
+#include "llm_memory.h"
+
+namespace wfai {
+
+// Compacts long sessions of a SessionMemory in background. The oldest
+// turns are summarized by a chat request of PRIORITY_BACKGROUND, then
+// swapped for one system message by replace_front(), unless the session
+// was cleared or compacted meanwhile. With a RequestScheduler on the client,
+// it only takes the slots interactive requests leave.
+class MemorySummarizer
+{
+public:
+	// start compacting the session if it is over threshold and not being
+	// compacted already, return true if started. never blocks
+	bool compact(const std::string& session_id);
+
+	// the same but not started, nullptr if nothing to do.
+	// it must be started, the session is marked until its callback
+	WFConditional *create_compact_task(const std::string& session_id);
+
+	// wait for all started ones, before client or memory is gone
+	void wait();
+
+	void set_model(const std::string& model) { this->model = model; }
+	// compact a session with more estimated tokens
+	void set_threshold(size_t tokens) { this->threshold = tokens; }
+	// about this many newest tokens are kept as they are, whole turns
+	void set_keep_tokens(size_t tokens) { this->keep_tokens = tokens; }
+	void set_max_summary_tokens(int tokens) { this->summary_tokens = tokens; }
+	// instruction of the summary request
+	void set_prompt(const std::string& prompt) { this->prompt = prompt; }
+
+	// content of summary messages starts with it
+	static const char *const summary_header;
+
+public:
+	MemorySummarizer(LLMClient *client, SessionMemory *memory);
+	~MemorySummarizer() { this->wait(); }
+
+	static constexpr size_t default_threshold = 16384;
+	static constexpr size_t default_keep_tokens = 4096;
+	static constexpr int default_summary_tokens = 1024;
+
+private:
+	bool begin(const std::string& session_id);
+	void end(const std::string& session_id);
+
+private:
+	LLMClient *client;
+	SessionMemory *memory;
+	std::string model;
+	std::string prompt;
+	size_t threshold;
+	size_t keep_tokens;
+	int summary_tokens;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::unordered_set<std::string> running;
+};
+
+} // namespace wfai
+
+#endif // LLM_SUMMARIZER_H
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include "llm_tls.h"
+
+namespace wfai {
+
+static int get_ex_index()
+{
+	static int index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	return index;
+}
+
+static bool session_expired(const SSL_SESSION *sess)
+{
+	return SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) <=
+		   time(NULL);
+}
+
+TLSSessionCache::~TLSSessionCache()
+{
+	for (auto& kv : this->sessions)
+		SSL_SESSION_free(kv.second);
+}
+
+bool TLSSessionCache::attach(SSL_CTX *ssl_ctx)
+{
+	if (!ssl_ctx || get_ex_index() < 0)
+		return false;
+
+	if (SSL_CTX_set_ex_data(ssl_ctx, get_ex_index(), this) != 1)
+		return false;
+
+	// sessions are kept by us, looked up by server name at handshake start
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+											SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, TLSSessionCache::new_session_callback);
+	SSL_CTX_set_info_callback(ssl_ctx, TLSSessionCache::info_callback);
+	return true;
+}
+
+int TLSSessionCache::new_session_callback(SSL *ssl, SSL_SESSION *sess)
+{
+	SSL_CTX *ssl_ctx = SSL_get_SSL_CTX(ssl);
+	auto *cache = static_cast<TLSSessionCache *>(
+		SSL_CTX_get_ex_data(ssl_ctx, get_ex_index()));
+	const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+	if (!cache || !host || !SSL_SESSION_is_resumable(sess))
+		return 0;
+
+	cache->put(host, sess);
+	return 1; // we hold the reference now
+}
+
+// SSL_set_session() is still in time before ClientHello is constructed
+void TLSSessionCache::info_callback(const SSL *ssl, int where, int ret)
+{
+	if (!(where & SSL_CB_HANDSHAKE_START) || SSL_is_server((SSL *)ssl))
+		return;
+
+	SSL_CTX *ssl_ctx = SSL_get_SSL_CTX(ssl);
+	auto *cache = static_cast<TLSSessionCache *>(
+		SSL_CTX_get_ex_data(ssl_ctx, get_ex_index()));
+	const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+	if (!cache || !host || SSL_get0_session(ssl))
+		return;
+
+	SSL_SESSION *sess = cache->get(host);
+	if (sess)
+	{
+		SSL_set_session(const_cast<SSL *>(ssl), sess);
+		SSL_SESSION_free(sess);
+	}
+}
+
+void TLSSessionCache::put(const std::string& host, SSL_SESSION *sess)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	SSL_SESSION *& slot = this->sessions[host];
+
+	if (slot)
+		SSL_SESSION_free(slot);
+
+	slot = sess;
+}
+
+SSL_SESSION *TLSSessionCache::get(const std::string& host)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	auto it = this->sessions.find(host);
+	if (it == this->sessions.end())
+		return NULL;
+
+	if (session_expired(it->second))
+	{
+		SSL_SESSION_free(it->second);
+		this->sessions.erase(it);
+		return NULL;
+	}
+
+	SSL_SESSION_up_ref(it->second);
+	return it->second;
+}
+
+size_t TLSSessionCache::size()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->sessions.size();
+}
+
+// file format, for each session :
+//   uint32_t host_len, host, uint32_t der_len, DER of SSL_SESSION
+bool TLSSessionCache::save(const std::string& path)
+{
+	std::string tmp = path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	bool ret = true;
+
+	if (!fp)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		for (const auto& kv : this->sessions)
+		{
+			int der_len = i2d_SSL_SESSION(kv.second, NULL);
+			if (der_len <= 0 || session_expired(kv.second))
+				continue;
+
+			std::vector<unsigned char> der(der_len);
+			unsigned char *p = der.data();
+			i2d_SSL_SESSION(kv.second, &p);
+
+			uint32_t host_len = (uint32_t)kv.first.size();
+			uint32_t len = (uint32_t)der_len;
+
+			if (fwrite(&host_len, sizeof host_len, 1, fp) != 1 ||
+				fwrite(kv.first.data(), 1, host_len, fp) != host_len ||
+				fwrite(&len, sizeof len, 1, fp) != 1 ||
+				fwrite(der.data(), 1, len, fp) != len)
+			{
+				ret = false;
+				break;
+			}
+		}
+	}
+
+	if (fclose(fp) != 0)
+		ret = false;
+
+	if (ret && rename(tmp.c_str(), path.c_str()) != 0)
+		ret = false;
+
+	if (!ret)
+		remove(tmp.c_str());
+
+	return ret;
+}
+
+bool TLSSessionCache::load(const std::string& path)
+{
+	FILE *fp = fopen(path.c_str(), "rb");
+	uint32_t host_len;
+	uint32_t len;
+
+	if (!fp)
+		return false;
+
+	while (fread(&host_len, sizeof host_len, 1, fp) == 1)
+	{
+		std::string host(host_len, '\0');
+		if (fread(&host[0], 1, host_len, fp) != host_len ||
+			fread(&len, sizeof len, 1, fp) != 1)
+		{
+			break;
+		}
+
+		std::vector<unsigned char> der(len);
+		if (fread(der.data(), 1, len, fp) != len)
+			break;
+
+		const unsigned char *p = der.data();
+		SSL_SESSION *sess = d2i_SSL_SESSION(NULL, &p, len);
+		if (!sess)
+			continue;
+
+		if (session_expired(sess) || !SSL_SESSION_is_resumable(sess))
+			SSL_SESSION_free(sess);
+		else
+			this->put(host, sess);
+	}
+
+	fclose(fp);
+	return true;
+}
+
+} // namespace wfai
@@ -0,0 +1,46 @@
+#ifndef LLM_TLS_H
+#define LLM_TLS_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <openssl/ssl.h>
+
+namespace wfai {
+
+// Client side TLS session cache, one session per server name (SNI).
+// Sessions can be saved to a local file so a new process resumes them
+// instead of a full handshake.
+class TLSSessionCache
+{
+public:
+	// install callbacks into the SSL_CTX used by Workflow client tasks
+	bool attach(SSL_CTX *ssl_ctx);
+
+	bool load(const std::string& path);
+	bool save(const std::string& path);
+
+	size_t size();
+
+public:
+	TLSSessionCache() = default;
+	~TLSSessionCache();
+
+	TLSSessionCache(const TLSSessionCache&) = delete;
+	TLSSessionCache& operator=(const TLSSessionCache&) = delete;
+
+private:
+	static int new_session_callback(SSL *ssl, SSL_SESSION *sess);
+	static void info_callback(const SSL *ssl, int where, int ret);
+
+	void put(const std::string& host, SSL_SESSION *sess);
+	SSL_SESSION *get(const std::string& host); // with a reference
+
+private:
+	std::mutex mutex;
+	std::map<std::string, SSL_SESSION *> sessions;
+};
+
+} // namespace wfai
+
+#endif // LLM_TLS_H
@@ -1,11 +1,15 @@
 #ifndef LLM_UTIL_H
 #define LLM_UTIL_H
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <cstring>
 #include <map>
 #include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
 #include "workflow/json_parser.h"
 #include "workflow/WFHttpChunkedClient.h"
 
@@ -19,6 +23,12 @@ using llm_extract_t = std::function<void(WFHttpChunkedTask *,
 										 ChatCompletionRequest *,
 										 ChatCompletionChunk *)>;
 
+// all chunks decoded from one read, valid only in this call
+using llm_batch_extract_t = std::function<void(WFHttpChunkedTask *,
+											   ChatCompletionRequest *,
+											   ChatCompletionChunk *chunks,
+											   size_t n)>;
+
 using llm_callback_t = std::function<void(WFHttpChunkedTask *,
 										  ChatCompletionRequest *,
 										  ChatCompletionResponse *)>;
@@ -37,6 +47,19 @@ enum
 	RESPONSE_CONTENT_ERROR		=  12, // lack of some content
 	RESPONSE_API_ERROR			=  13, // API returned error
 	RESPONSE_TOOLS_ERROR		=  14, // Cannot find tools in function manager
+
+	RESPONSE_CANCELLED			=  21, // stopped by user, usage is partial
+	RESPONSE_FLOW_CONTROL		=  22, // chunks not taken, stopped as cancelled
+	RESPONSE_NO_KEY				=  23, // no key of ApiKeyPool ever usable, not sent
+};
+
+///// for request scheduling /////
+
+enum
+{
+	PRIORITY_INTERACTIVE		=  0,
+	PRIORITY_NORMAL				=  1,
+	PRIORITY_BACKGROUND			=  2,
 };
 
 ///// for request and response /////
@@ -172,6 +195,116 @@ struct FunctionResult
 using FunctionHandler =
 	std::function<void(const std::string& arguments, FunctionResult *result)>;
 
+///// for hashing serialized requests /////
+
+static inline uint64_t fnv1a_hash(const void *data, size_t size)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(data);
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+// not related to fnv1a_hash, tells apart requests colliding in it
+static inline uint64_t mix_hash(const void *data, size_t size)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(data);
+	uint64_t hash = 0x9E3779B97F4A7C15ULL ^ size;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ p[i]) * 0xBF58476D1CE4E5B9ULL;
+		hash ^= hash >> 29;
+	}
+
+	return hash;
+}
+
+///// for cancellation /////
+
+// Copies share one flag. Empty until create(), which costs nothing
+class CancelHandle
+{
+public:
+	static CancelHandle create()
+	{
+		CancelHandle handle;
+		handle.state = std::make_shared<State>();
+		return handle;
+	}
+
+	// hooks run in this thread, e.g. a request still waiting for a slot
+	// of RequestScheduler is finished here as cancelled
+	void cancel()
+	{
+		std::map<uint64_t, std::function<void ()>> hooks;
+
+		if (!this->state)
+			return;
+
+		this->state->flag = true;
+		{
+			std::lock_guard<std::mutex> lock(this->state->mutex);
+			hooks.swap(this->state->hooks);
+		}
+
+		for (auto& kv : hooks)
+			kv.second();
+	}
+
+	bool is_cancelled() const { return this->state && this->state->flag; }
+	explicit operator bool() const { return (bool)this->state; }
+
+	// for LLMClient. hook runs once at cancel(), at once if cancelled.
+	// returns id to remove it, 0 if it has run or the handle is empty
+	uint64_t add_hook(std::function<void ()> hook)
+	{
+		if (!this->state)
+			return 0;
+
+		{
+			std::lock_guard<std::mutex> lock(this->state->mutex);
+
+			if (!this->state->flag)
+			{
+				this->state->hooks[++this->state->hook_id] = std::move(hook);
+				return this->state->hook_id;
+			}
+		}
+
+		hook();
+		return 0;
+	}
+
+	void remove_hook(uint64_t id)
+	{
+		if (this->state && id != 0)
+		{
+			std::lock_guard<std::mutex> lock(this->state->mutex);
+			this->state->hooks.erase(id);
+		}
+	}
+
+private:
+	struct State
+	{
+		std::atomic<bool> flag;
+		std::mutex mutex;
+		std::map<uint64_t, std::function<void ()>> hooks;
+		uint64_t hook_id;
+
+		State() : flag(false), hook_id(0) {}
+	};
+
+	std::shared_ptr<State> state;
+};
+
 } // namespace wfai
 
 #endif // LLM_UTIL_H
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "workflow/HttpMessage.h"
+#include "workflow/HttpUtil.h"
+#include "workflow/WFHttpServer.h"
+#include "llm_batch.h"
+
+using namespace wfai;
+
+// Batch API against a local stand-in server on 127.0.0.1
+
+static constexpr unsigned short port = 18432;
+static constexpr const char *input_path = "batch_test_input.jsonl";
+
+static const char *output_lines[] = {
+	"{\"id\":\"r0\",\"custom_id\":\"req-0\",\"response\":{\"status_code\":200,"
+	"\"body\":{\"id\":\"c0\",\"object\":\"chat.completion\",\"choices\":"
+	"[{\"index\":0,\"message\":{\"role\":\"assistant\",\"content\":\"zero\"},"
+	"\"finish_reason\":\"stop\"}]}},\"error\":null}\n",
+	"{\"id\":\"r1\",\"custom_id\":\"req-1\",\"response\":{\"status_code\":200,"
+	"\"body\":{\"id\":\"c1\",\"object\":\"chat.completion\",\"choices\":"
+	"[{\"index\":0,\"message\":{\"role\":\"assistant\",\"content\":\"one\"},"
+	"\"finish_reason\":\"stop\"}]}},\"error\":null}\n",
+};
+
+static const char *error_lines[] = {
+	"{\"id\":\"r2\",\"custom_id\":\"req-2\",\"response\":{\"status_code\":400,"
+	"\"body\":{\"error\":{\"message\":\"bad request\"}}},\"error\":null}\n",
+	"{\"id\":\"r3\",\"custom_id\":\"req-3\",\"response\":null,"
+	"\"error\":{\"code\":\"expired\",\"message\":\"not run\"}}\n",
+};
+
+struct Scenario
+{
+	bool has_output;
+	bool has_error;
+	bool output_chunked;
+	int polls;			// in_progress before completed
+	bool ranged;		// Range of requests is followed
+	size_t padding;		// blank lines after the output
+};
+
+static Scenario scenario;
+
+static void reply_json(protocol::HttpResponse *resp, const std::string& body)
+{
+	resp->add_header_pair("Content-Type", "application/json");
+	resp->append_output_body(body);
+}
+
+// lines cut at odd places so that they span chunks
+static void reply_chunked(protocol::HttpResponse *resp,
+						  const char *lines[], size_t n)
+{
+	std::string data;
+	std::string body;
+	char size[32];
+
+	for (size_t i = 0; i < n; i++)
+		data += lines[i];
+
+	for (size_t pos = 0; pos < data.size(); pos += 37)
+	{
+		std::string chunk = data.substr(pos, 37);
+
+		snprintf(size, sizeof size, "%zx\r\n", chunk.size());
+		body += size;
+		body += chunk;
+		body += "\r\n";
+	}
+
+	body += "0\r\n\r\n";
+	resp->add_header_pair("Transfer-Encoding", "chunked");
+	resp->append_output_body(body);
+}
+
+static void reply_plain(protocol::HttpRequest *req,
+						protocol::HttpResponse *resp,
+						const char *lines[], size_t n)
+{
+	protocol::HttpHeaderCursor cursor(req);
+	std::string range;
+	std::string body(scenario.padding, '\n');
+	size_t first;
+	size_t last;
+	char value[64];
+
+	for (size_t i = 0; i < n; i++)
+		body.insert(body.size() - scenario.padding, lines[i]);
+
+	// no newline after the last line
+	if (scenario.padding == 0)
+		body.pop_back();
+
+	if (!scenario.ranged || !cursor.find("Range", range) ||
+		sscanf(range.c_str(), "bytes=%zu-%zu", &first, &last) != 2)
+	{
+		resp->append_output_body(body);
+		return;
+	}
+
+	if (first >= body.size())
+	{
+		resp->set_status_code("416");
+		return;
+	}
+
+	last = std::min(last, body.size() - 1);
+	snprintf(value, sizeof value, "bytes %zu-%zu/%zu", first, last,
+			 body.size());
+	resp->set_status_code("206");
+	resp->add_header_pair("Content-Range", value);
+	resp->append_output_body(body.substr(first, last + 1 - first));
+}
+
+static void process(WFHttpTask *task)
+{
+	protocol::HttpRequest *req = task->get_req();
+	protocol::HttpResponse *resp = task->get_resp();
+	std::string method = req->get_method();
+	std::string uri = req->get_request_uri();
+	std::string batch = "{\"id\":\"batch-1\",\"status\":\"";
+
+	if (method == "POST" && uri == "/v1/files")
+		reply_json(resp, "{\"id\":\"file-in\",\"purpose\":\"batch\"}");
+	else if (method == "POST" && uri == "/v1/batches")
+		reply_json(resp, batch + "validating\"}");
+	else if (method == "GET" && uri == "/v1/batches/batch-1")
+	{
+		if (scenario.polls > 0)
+		{
+			scenario.polls--;
+			reply_json(resp, batch + "in_progress\"}");
+			return;
+		}
+
+		batch += "completed\"";
+		if (scenario.has_output)
+			batch += ",\"output_file_id\":\"file-out\"";
+		if (scenario.has_error)
+			batch += ",\"error_file_id\":\"file-err\"";
+
+		reply_json(resp, batch + "}");
+	}
+	else if (method == "GET" && uri == "/v1/files/file-out/content")
+	{
+		if (scenario.output_chunked)
+			reply_chunked(resp, output_lines, 2);
+		else
+			reply_plain(req, resp, output_lines, 2);
+	}
+	else if (method == "GET" && uri == "/v1/files/file-err/content")
+		reply_plain(req, resp, error_lines, 2);
+	else
+		resp->set_status_code("404");
+}
+
+static int failures = 0;
+
+static void check(bool cond, const char *name, const char *what)
+{
+	if (!cond)
+	{
+		fprintf(stderr, "FAIL %s: %s\n", name, what);
+		failures++;
+	}
+}
+
+static BatchResult run(const char *name, const Scenario& s,
+					   std::vector<std::string>& ids,
+					   size_t max_unchunked_size)
+{
+	BatchClient client("test-key", "http://127.0.0.1:" +
+									std::to_string(port) + "/v1");
+
+	scenario = s;
+	ids.clear();
+	client.set_poll_interval(0);
+	if (max_unchunked_size)
+		client.set_max_unchunked_size(max_unchunked_size);
+
+	BatchResult result = client.batch_sync(input_path,
+		[&ids](const std::string& custom_id, int status_code,
+			   ChatCompletionResponse *resp)
+		{
+			ids.push_back(custom_id + ":" + std::to_string(status_code));
+		});
+
+	fprintf(stderr, "%s: success %d, %zu results, %zu failed %s\n", name,
+			result.success, result.result_count, result.error_count,
+			result.error_message.c_str());
+	return result;
+}
+
+int main()
+{
+	WFHttpServer server(process);
+	std::vector<std::string> ids;
+	BatchWriter writer;
+	BatchResult result;
+
+	if (server.start(port) != 0)
+	{
+		perror("server start");
+		return 1;
+	}
+
+	writer.open(input_path);
+	for (int i = 0; i < 4; i++)
+	{
+		ChatCompletionRequest request;
+		request.model = "test-model";
+		request.messages.push_back({"user", "hi"});
+		writer.add("req-" + std::to_string(i), request);
+	}
+	writer.close();
+
+	// chunked output then the error file
+	result = run("mixed", {true, true, true, 2}, ids, 0);
+	check(result.success, "mixed", "not success");
+	check(result.result_count == 4 && result.error_count == 2, "mixed",
+		  "wrong counts");
+	check(ids.size() == 4 && ids[0] == "req-0:200" && ids[1] == "req-1:200" &&
+		  ids[2] == "req-2:400" && ids[3] == "req-3:0", "mixed", "wrong lines");
+
+	// every request failed, only an error file
+	result = run("all_failed", {false, true, true, 0}, ids, 0);
+	check(result.success, "all_failed", "not success");
+	check(result.result_count == 2 && result.error_count == 2, "all_failed",
+		  "error file not read");
+
+	// output with Content-Length, small enough
+	result = run("plain", {true, false, false, 0}, ids, 0);
+	check(result.success && result.result_count == 2, "plain",
+		  "plain output not read");
+
+	// output with Content-Length over the limit, in many ranges
+	result = run("ranged", {true, true, false, 0, true, 0}, ids, 64);
+	check(result.success && result.result_count == 4 &&
+		  result.error_count == 2, "ranged", "ranges not joined");
+	check(ids.size() == 4 && ids[0] == "req-0:200" && ids[1] == "req-1:200",
+		  "ranged", "wrong lines");
+
+	// a whole output over the limit, Range ignored, is not buffered
+	result = run("plain_large", {true, false, false, 0, false, 32768}, ids, 64);
+	check(!result.success && !result.error_message.empty() &&
+		  result.result_count == 0, "plain_large", "not rejected");
+
+	server.stop();
+	remove(input_path);
+
+	if (failures)
+		return 1;
+
+	fprintf(stderr, "all passed\n");
+	return 0;
+}
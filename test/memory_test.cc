@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+#include "llm_disk_memory.h"
+
+using namespace wfai;
+
+// DiskMemory written, closed and replayed from its segment files
+
+static constexpr const char *dir = "memory_test_dir";
+static constexpr size_t segment_size = 4096;
+
+static int failures = 0;
+
+static void check(bool cond, const char *name, const char *what)
+{
+	if (!cond)
+	{
+		fprintf(stderr, "FAIL %s: %s\n", name, what);
+		failures++;
+	}
+}
+
+static void remove_segments()
+{
+	DIR *dirp = opendir(dir);
+	struct dirent *ent;
+
+	if (!dirp)
+		return;
+
+	while ((ent = readdir(dirp)) != NULL)
+	{
+		if (strstr(ent->d_name, ".mem"))
+			unlink((std::string(dir) + "/" + ent->d_name).c_str());
+	}
+
+	closedir(dirp);
+}
+
+static size_t count_segments()
+{
+	DIR *dirp = opendir(dir);
+	struct dirent *ent;
+	size_t n = 0;
+
+	if (!dirp)
+		return 0;
+
+	while ((ent = readdir(dirp)) != NULL)
+		n += strstr(ent->d_name, ".mem") ? 1 : 0;
+
+	closedir(dirp);
+	return n;
+}
+
+static bool history_is(DiskMemory& memory, const std::string& id,
+					   const std::vector<std::string>& contents)
+{
+	std::vector<Message> history = memory.get_history(id);
+
+	if (history.size() != contents.size())
+		return false;
+
+	for (size_t i = 0; i < history.size(); i++)
+	{
+		if (history[i].content != contents[i])
+			return false;
+	}
+
+	return true;
+}
+
+// break the payload of the n-th record in the first segment
+static bool tear_record(int n)
+{
+	std::string path = std::string(dir) + "/000000.mem";
+	int fd = open(path.c_str(), O_RDWR);
+	uint32_t magic = 0x4d454d57;
+	uint32_t word;
+	bool found = false;
+
+	if (fd < 0)
+		return false;
+
+	for (off_t off = 0; off < (off_t)segment_size; off += 8)
+	{
+		if (pread(fd, &word, sizeof word, off) != sizeof word)
+			break;
+
+		if (word == magic && n-- == 0)
+		{
+			char c = 0x7f;
+			found = (pwrite(fd, &c, 1, off + 20) == 1);
+			break;
+		}
+	}
+
+	close(fd);
+	return found;
+}
+
+static void append_pop_clear()
+{
+	const char *name = "append_pop_clear";
+
+	{
+		DiskMemory memory;
+
+		check(memory.open(dir, segment_size), name, "open failed");
+		memory.add_message("a", {"user", "q1"});
+		memory.add_message("a", {"assistant", "r1"});
+		memory.add_message("a", {"user", "q2"});
+		memory.clear_last_query("a");
+		memory.add_message("b", {"user", "x"});
+		memory.clear("b");
+		memory.add_message("b", {"user", "y"});
+	}
+
+	DiskMemory memory;
+
+	check(memory.open(dir, segment_size), name, "reopen failed");
+	check(memory.hot_sessions() == 0, name, "sessions not cold");
+	check(history_is(memory, "a", {"q1", "r1"}), name, "wrong a");
+	check(history_is(memory, "b", {"y"}), name, "wrong b");
+}
+
+static void compaction()
+{
+	const char *name = "compaction";
+	std::string text(200, 'c');
+	size_t before;
+
+	{
+		DiskMemory memory;
+
+		check(memory.open(dir, segment_size), name, "open failed");
+		for (int i = 0; i < 60; i++)
+		{
+			memory.add_message("c", {"user", text});
+			if (i % 10 == 0)
+				memory.add_message("d", {"user", std::to_string(i)});
+		}
+	}
+
+	before = count_segments();
+
+	{
+		DiskMemory memory;
+
+		check(memory.open(dir, segment_size), name, "reopen failed");
+		memory.clear("c");
+		memory.compact(0.5);
+	}
+
+	check(count_segments() < before, name, "no segment deleted");
+
+	DiskMemory memory;
+
+	check(memory.open(dir, segment_size), name, "reopen failed");
+	check(memory.get_history("c").empty(), name, "c not cleared");
+	check(history_is(memory, "d", {"0", "10", "20", "30", "40", "50"}), name,
+		  "wrong d");
+	check(history_is(memory, "a", {"q1", "r1"}), name, "wrong a");
+	check(history_is(memory, "b", {"y"}), name, "wrong b");
+}
+
+static void torn_record()
+{
+	const char *name = "torn_record";
+
+	remove_segments();
+
+	{
+		DiskMemory memory;
+
+		check(memory.open(dir, segment_size), name, "open failed");
+		memory.add_message("t", {"user", "m1"});
+		memory.add_message("t", {"assistant", "m2"});
+		memory.add_message("t", {"user", "m3"});
+	}
+
+	check(tear_record(1), name, "record not found");
+
+	{
+		DiskMemory memory;
+
+		// records after the torn one are still there
+		check(memory.open(dir, segment_size), name, "reopen failed");
+		check(history_is(memory, "t", {"m1", "m3"}), name, "m3 lost");
+		memory.add_message("t", {"assistant", "m4"});
+	}
+
+	// appended after m3, not over it
+	DiskMemory memory;
+
+	check(memory.open(dir, segment_size), name, "reopen failed");
+	check(history_is(memory, "t", {"m1", "m3", "m4"}), name, "m3 overwritten");
+}
+
+int main()
+{
+	remove_segments();
+
+	append_pop_clear();
+	compaction();
+	torn_record();
+
+	remove_segments();
+	rmdir(dir);
+
+	if (failures)
+		return 1;
+
+	fprintf(stderr, "all passed\n");
+	return 0;
+}